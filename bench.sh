@@ -0,0 +1,37 @@
+#!/bin/bash
+
+outputAssembly="yzbench"
+compiler="g++"
+
+echo "------------------------------"
+echo "C++ benchmark build for $outputAssembly"
+echo "------------------------------"
+echo
+
+if [ ! -d "./bin/" ]; then
+    mkdir bin
+fi
+
+# Add include directories
+includeDirs="-I./src -I./bench"
+
+# The benchmark driver plus every compiler source except the compiler's own main
+cppFiles="$(find bench -name "*.cpp") $(find src -name "*.cpp" ! -name "main.cpp")"
+
+# Compiler flags
+compilerFlags="-std=c++17 -pthread -O2"
+
+echo "compiling..."
+
+$compiler $cppFiles $compilerFlags $includeDirs -o bin/$outputAssembly
+
+if [ $? -ne 0 ]; then
+    echo "compilation/linking failed."
+    exit 1
+fi
+
+echo "compilation/linking successful."
+echo
+
+# Forward any arguments, e.g. ./bench.sh --max-n 32000
+./bin/$outputAssembly "$@"
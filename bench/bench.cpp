@@ -0,0 +1,1208 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "core/defines.h"
+#include "core/arena.hpp"
+#include "core/source_map.hpp"
+#include "YLogger/logger.h"
+#include "tokenizer.hpp"
+#include "parser.hpp"
+#include "genration.hpp"
+#include "pipeline.hpp"
+#include "driver.hpp"
+#include "program_gen.hpp"
+#include "perf_counters.hpp"
+
+#if defined(IPLATFORM_LINUX)
+#include <elf.h>
+#endif
+
+// Stage-level compiler benchmarks. Every synthetic program shape is compiled at
+// a series of doubling sizes; tokenize, parse and generate are timed on their
+// own, and a power law t = a * tokens^k is fitted per stage. An exponent
+// noticeably above 1 means a stage scales super-linearly and is reported as a
+// regression (exit status 1).
+
+struct BenchConfig
+{
+    size_t min_n = 1000;
+    size_t max_n = 16000;
+    int reps = 3;
+    double threshold = 1.25;
+    std::string baseline = "codegen.json"; // results of the previous codegen run
+    bool tos_cache = false;                // codegen with --tos-cache
+};
+
+struct Shape
+{
+    const char *name;
+    std::function<std::string(ProgramGen &, size_t)> make;
+};
+
+struct Sample
+{
+    size_t n;
+    size_t bytes;
+    size_t tokens;
+    double stage_ns[3];
+};
+
+static const char *STAGES[] = {"tokenize", "parse", "generate"};
+
+static double now_ns()
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Best of `reps` runs; the minimum is the least noisy estimate of the cost.
+static double time_min(int reps, const std::function<void()> &fn)
+{
+    double best = 1e300;
+    for (int i = 0; i < reps; i++)
+    {
+        double start = now_ns();
+        fn();
+        best = std::min(best, now_ns() - start);
+    }
+    return best;
+}
+
+static Sample measure(const std::string &src, size_t n, int reps, ArenaAlloc &arena)
+{
+    Sample sample{.n = n, .bytes = src.size(), .tokens = 0, .stage_ns = {}};
+    std::vector<Token> tokens;
+
+    sample.stage_ns[0] = time_min(reps, [&]
+                                  { Tokenizer(src).tokenize(tokens); });
+    sample.tokens = tokens.size();
+
+    NodeProg prog;
+    sample.stage_ns[1] = time_min(reps, [&]
+                                  {
+        arena.reset();
+        Parser parser(tokens, arena);
+        prog = parser.parse_prog().value(); });
+
+    size_t asm_bytes = 0;
+    sample.stage_ns[2] = time_min(reps, [&]
+                                  {
+        Generator generator(prog);
+        asm_bytes = generator.generate().size(); });
+    (void)asm_bytes;
+    return sample;
+}
+
+// Least-squares slope of log(time) over log(tokens).
+static double fit_exponent(const std::vector<Sample> &samples, int stage)
+{
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (const Sample &s : samples)
+    {
+        double x = std::log(static_cast<double>(s.tokens));
+        double y = std::log(std::max(s.stage_ns[stage], 1.0));
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    double n = static_cast<double>(samples.size());
+    double denom = n * sxx - sx * sx;
+    return denom == 0 ? 0 : (n * sxy - sx * sy) / denom;
+}
+
+static std::vector<Shape> shapes()
+{
+    return {
+        {"vals", [](ProgramGen &gen, size_t n)
+         { return gen.top_level_vals(n); }},
+        {"nested", [](ProgramGen &gen, size_t n)
+         { return gen.nested_blocks(n); }},
+        {"chain", [](ProgramGen &gen, size_t n)
+         { return gen.operator_chain(n); }},
+        {"shadowing", [](ProgramGen &gen, size_t n)
+         { return gen.shadowing(n); }},
+    };
+}
+
+static bool run_stages(const BenchConfig &cfg)
+{
+    ArenaAlloc arena(1024ull * 1024 * 1024);
+    bool regression = false;
+    char line[160];
+
+    for (const Shape &shape : shapes())
+    {
+        LLOG(CYAN_TEXT(shape.name), "\n");
+        snprintf(line, sizeof(line), "%8s %10s %9s %12s %12s %12s\n", "n", "bytes", "tokens",
+                 "tokenize ms", "parse ms", "generate ms");
+        LLOG(line);
+
+        std::vector<Sample> samples;
+        for (size_t n = cfg.min_n; n <= cfg.max_n; n *= 2)
+        {
+            ProgramGen gen;
+            Sample s = measure(shape.make(gen, n), n, cfg.reps, arena);
+            samples.push_back(s);
+            snprintf(line, sizeof(line), "%8zu %10zu %9zu %12.3f %12.3f %12.3f\n", s.n, s.bytes, s.tokens,
+                     s.stage_ns[0] / 1e6, s.stage_ns[1] / 1e6, s.stage_ns[2] / 1e6);
+            LLOG(line);
+        }
+
+        for (int stage = 0; stage < 3; stage++)
+        {
+            double k = fit_exponent(samples, stage);
+            const Sample &last = samples.back();
+            snprintf(line, sizeof(line), "  %-9s O(n^%.2f)  %7.1f ns/token", STAGES[stage], k,
+                     last.stage_ns[stage] / static_cast<double>(last.tokens));
+            if (k > cfg.threshold)
+            {
+                regression = true;
+                LLOG(line, "  ", RED_TEXT("SUPER-LINEAR"), "\n");
+            }
+            else
+                LLOG(line, "\n");
+        }
+        LLOG("\n");
+    }
+    return !regression;
+}
+
+// Messages per second through YLogger with 1..8 threads logging at once, with
+// the synchronous (mutex) backend and the asynchronous ring. Output goes to
+// /dev/null so the numbers measure the logger, not the terminal.
+static bool run_logger(const BenchConfig &cfg)
+{
+    const size_t per_thread = 20000 * static_cast<size_t>(cfg.reps);
+    char line[160];
+    snprintf(line, sizeof(line), "%8s %16s %16s %8s\n", "threads", "sync msg/s", "async msg/s", "speedup");
+    LLOG(CYAN_TEXT("logger"), "\n", line);
+
+    for (size_t threads = 1; threads <= 8; threads *= 2)
+    {
+        double rate[2];
+        for (int async = 0; async < 2; async++)
+        {
+            Logger::ChangeOutputType(LOG_FILE, "/dev/null");
+            if (async)
+                Logger::EnableAsync();
+
+            double start = now_ns();
+            std::vector<std::thread> workers;
+            for (size_t t = 0; t < threads; t++)
+                workers.emplace_back([t, per_thread]
+                                     {
+                    for (size_t i = 0; i < per_thread; i++)
+                        LWARN(false, "worker ", t, " message ", i, "\n"); });
+            for (auto &worker : workers)
+                worker.join();
+            Logger::Flush();
+            double elapsed = now_ns() - start;
+
+            Logger::DisableAsync();
+            Logger::ChangeOutputType(LOG_CONSOLE);
+            rate[async] = threads * per_thread / (elapsed / 1e9);
+        }
+        snprintf(line, sizeof(line), "%8zu %16.0f %16.0f %7.2fx\n", threads, rate[0], rate[1], rate[1] / rate[0]);
+        LLOG(line);
+    }
+    LLOG("\n");
+    return true;
+}
+
+// Serial front end against the three-thread pipeline on multi-megabyte
+// programs. The assembly of both paths is compared byte for byte.
+static bool run_pipeline(const BenchConfig &cfg)
+{
+    ArenaAlloc arena(64 * 1024 * 1024);
+    bool identical = true;
+    char line[160];
+    snprintf(line, sizeof(line), "%-10s %10s %12s %12s %8s\n", "shape", "MiB", "serial ms", "pipeline ms",
+             "speedup");
+    LLOG(CYAN_TEXT("pipeline"), " (", std::thread::hardware_concurrency(), " hardware threads)\n", line);
+
+    for (const Shape &shape : shapes())
+    {
+        // "vals" hits the generator's quadratic scope check at this size, and
+        // "chain" is one statement, which leaves nothing to overlap.
+        if (std::string(shape.name) == "vals" || std::string(shape.name) == "chain")
+            continue;
+        for (size_t mib = 2; mib <= 8; mib *= 2)
+        {
+            ProgramGen gen;
+            std::string src;
+            for (size_t n = cfg.min_n; src.size() < mib * 1024 * 1024; n *= 2)
+                src = shape.make(gen, n);
+
+            std::string serial, pipelined;
+            double serial_ns = time_min(cfg.reps, [&]
+                                        {
+                arena.reset();
+                std::vector<Token> tokens = Tokenizer(src).tokenize();
+                Parser parser(tokens, arena);
+                Generator generator(parser.parse_prog().value());
+                serial = generator.generate().str(); });
+            double pipeline_ns = time_min(cfg.reps, [&]
+                                          {
+                arena.reset();
+                pipelined = Pipeline(src, arena).run().str(); });
+
+            snprintf(line, sizeof(line), "%-10s %10.1f %12.3f %12.3f %7.2fx", shape.name,
+                     src.size() / (1024.0 * 1024.0), serial_ns / 1e6, pipeline_ns / 1e6, serial_ns / pipeline_ns);
+            if (serial != pipelined)
+            {
+                identical = false;
+                LLOG(line, "  ", RED_TEXT("OUTPUT DIFFERS"), "\n");
+            }
+            else
+                LLOG(line, "\n");
+        }
+    }
+    LLOG("\n");
+    return identical;
+}
+
+// Runs `exe` and returns its stdout; `ns` gets the best wall time of `reps` runs.
+static std::string run_program(const std::string &exe, int reps, double &ns)
+{
+    std::string output;
+    ns = time_min(reps, [&]
+                  {
+        output.clear();
+        FILE *pipe = popen(run_command(exe).c_str(), "r");
+        if (!pipe)
+            return;
+        char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), pipe)) > 0)
+            output.append(buf, n);
+        pclose(pipe); });
+    return output;
+}
+
+// Generated-code benchmark for loops: each kernel is built with -O0 (memory
+// counters, everything recomputed per iteration) and -O1 (invariants hoisted,
+// counters in registers), run, and timed. Needs nasm and ld on the PATH.
+static bool run_loops(const BenchConfig &cfg)
+{
+    if (system("nasm -v > /dev/null 2>&1") != 0)
+    {
+        LLOG(CYAN_TEXT("loops"), ": skipped, nasm not found\n\n");
+        return true;
+    }
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("yzbench-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+
+    struct Kernel
+    {
+        const char *name;
+        std::string src;
+    };
+    ProgramGen gen;
+    std::vector<Kernel> kernels = {
+        {"counting", gen.counting_loop(50000000)},
+        {"nested", gen.nested_loops(5000, 10000)},
+    };
+
+    bool ok = true;
+    char line[160];
+    snprintf(line, sizeof(line), "%-10s %12s %12s %8s\n", "kernel", "-O0 ms", "-O1 ms", "speedup");
+    LLOG(CYAN_TEXT("loops"), "\n", line);
+    for (const Kernel &kernel : kernels)
+    {
+        double ns[2];
+        std::string output[2];
+        for (int level = 0; level < 2; level++)
+        {
+            std::string input = (dir / (std::string(kernel.name) + "_O" + std::to_string(level) + ".yz")).string();
+            std::ofstream(input) << kernel.src;
+
+            Options opts;
+            opts.opt_level = level;
+            CompileStats stats;
+            try
+            {
+                OutputPaths paths = CompileContext(opts).compile(input, stats);
+                output[level] = run_program(paths.exe_path, cfg.reps, ns[level]);
+            }
+            catch (const CompileError &err)
+            {
+                report_failure(input, err);
+                return false;
+            }
+        }
+
+        snprintf(line, sizeof(line), "%-10s %12.3f %12.3f %7.2fx", kernel.name, ns[0] / 1e6, ns[1] / 1e6,
+                 ns[0] / ns[1]);
+        if (output[0] != output[1])
+        {
+            ok = false;
+            LLOG(line, "  ", RED_TEXT("OUTPUT DIFFERS"), "\n");
+        }
+        else
+            LLOG(line, "\n");
+    }
+    LLOG("\n");
+
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    return ok;
+}
+
+// Cost of --profile on the generated-code kernels: every statement executed
+// bumps a counter in memory. More than 10% on any kernel is reported as a
+// regression. Needs nasm and ld on the PATH.
+static bool run_profile(const BenchConfig &cfg)
+{
+    if (system("nasm -v > /dev/null 2>&1") != 0)
+    {
+        LLOG(CYAN_TEXT("profile"), ": skipped, nasm not found\n\n");
+        return true;
+    }
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("yzbench-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+
+    struct Kernel
+    {
+        const char *name;
+        std::string src;
+    };
+    ProgramGen gen;
+    std::vector<Kernel> kernels = {
+        {"counting", gen.counting_loop(50000000)},
+        {"nested", gen.nested_loops(5000, 10000)},
+        {"calls", gen.small_calls(20000000)},
+        {"single", gen.single_call(5000000)},
+        {"arrays", gen.array_kernel(1024, 100000)},
+        {"shared", gen.shared_subexprs(10000000)},
+    };
+
+    bool ok = true;
+    char line[160];
+    snprintf(line, sizeof(line), "%-10s %12s %12s %9s\n", "kernel", "plain ms", "profile ms", "overhead");
+    LLOG(CYAN_TEXT("profile"), "\n", line);
+    for (const Kernel &kernel : kernels)
+    {
+        double ns[2];
+        std::string output[2];
+        for (int profiled = 0; profiled < 2; profiled++)
+        {
+            std::string input = (dir / (std::string(kernel.name) + (profiled ? "_prof" : "") + ".yz")).string();
+            std::ofstream(input) << kernel.src;
+
+            Options opts;
+            opts.profile = profiled;
+            CompileStats stats;
+            try
+            {
+                OutputPaths paths = CompileContext(opts).compile(input, stats);
+                output[profiled] = run_program(paths.exe_path, cfg.reps, ns[profiled]);
+            }
+            catch (const CompileError &err)
+            {
+                report_failure(input, err);
+                return false;
+            }
+        }
+
+        double overhead = ns[1] / ns[0] - 1;
+        snprintf(line, sizeof(line), "%-10s %12.3f %12.3f %8.1f%%", kernel.name, ns[0] / 1e6, ns[1] / 1e6,
+                 100 * overhead);
+        if (output[0] != output[1])
+        {
+            ok = false;
+            LLOG(line, "  ", RED_TEXT("OUTPUT DIFFERS"), "\n");
+        }
+        else if (overhead > 0.10)
+        {
+            ok = false;
+            LLOG(line, "  ", RED_TEXT("OVER BUDGET"), "\n");
+        }
+        else
+            LLOG(line, "\n");
+    }
+    LLOG("\n");
+
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    return ok;
+}
+
+// The assembly for `src`, generated in-process so no assembler is needed.
+static std::string generate_asm(const std::string &src, GenOptions opts)
+{
+    std::vector<Token> tokens;
+    Tokenizer(src).tokenize(tokens);
+    ArenaAlloc arena(1024 * 1024);
+    Parser parser(tokens, arena);
+    return Generator(parser.parse_prog().value(), opts).generate().str();
+}
+
+// Instruction lines (indented) and `call`s to YZ functions in `assembly`.
+static void count_asm(const std::string &assembly, size_t &insns, size_t &calls)
+{
+    static const std::string CALL = "    call yz_fn_";
+    insns = calls = 0;
+    for (size_t pos = 0; pos < assembly.size();)
+    {
+        size_t end = assembly.find('\n', pos);
+        if (end == std::string::npos)
+            end = assembly.size();
+        if (assembly.compare(pos, 4, "    ") == 0)
+        {
+            insns++;
+            if (assembly.compare(pos, CALL.size(), CALL) == 0)
+                calls++;
+        }
+        pos = end + 1;
+    }
+}
+
+// Bytes in the .text section of the executable at `path`, 0 if it cannot be read.
+static u64 text_bytes(const std::string &path)
+{
+#if defined(IPLATFORM_LINUX)
+    std::ifstream in(path, std::ios::binary);
+    std::string elf((std::istreambuf_iterator<char>(in)), {});
+    if (elf.size() < sizeof(Elf64_Ehdr) || elf.compare(0, SELFMAG, ELFMAG) != 0)
+        return 0;
+    const Elf64_Ehdr *header = reinterpret_cast<const Elf64_Ehdr *>(elf.data());
+    if (header->e_shoff + u64(header->e_shnum) * sizeof(Elf64_Shdr) > elf.size() || header->e_shstrndx >= header->e_shnum)
+        return 0;
+    const Elf64_Shdr *sections = reinterpret_cast<const Elf64_Shdr *>(elf.data() + header->e_shoff);
+    const Elf64_Shdr &names = sections[header->e_shstrndx];
+    for (u32 i = 0; i < header->e_shnum; i++)
+    {
+        u64 name = names.sh_offset + sections[i].sh_name;
+        if (name + 6 <= elf.size() && memcmp(elf.data() + name, ".text", 6) == 0)
+            return sections[i].sh_size;
+    }
+#else
+    (void)path;
+#endif
+    return 0;
+}
+
+// Instruction lines in `assembly` that push, pop or address memory through
+// rsp or rbp, i.e. the traffic between the code and its stack.
+static size_t count_stack_ops(const std::string &assembly)
+{
+    size_t ops = 0;
+    for (size_t pos = 0; pos < assembly.size();)
+    {
+        size_t end = assembly.find('\n', pos);
+        if (end == std::string::npos)
+            end = assembly.size();
+        std::string_view line(assembly.data() + pos, end - pos);
+        if (line.compare(0, 4, "    ") == 0 &&
+            (line.compare(4, 5, "push ") == 0 || line.compare(4, 4, "pop ") == 0 ||
+             line.find("[rsp") != std::string_view::npos || line.find("[rbp") != std::string_view::npos))
+            ops++;
+        pos = end + 1;
+    }
+    return ops;
+}
+
+using CodegenResults = std::map<std::string, std::map<std::string, double>>; // kernel -> metric -> value
+
+// Reads the file run_codegen writes; a missing or unreadable file is an empty baseline.
+static CodegenResults read_baseline(const std::string &path)
+{
+    CodegenResults results;
+    std::ifstream in(path, std::ios::binary);
+    std::string json((std::istreambuf_iterator<char>(in)), {});
+    size_t pos = json.find("\"kernels\"");
+    if (pos == std::string::npos || (pos = json.find('{', pos)) == std::string::npos)
+        return results;
+
+    // "name": {"metric": number, ...}, ...
+    auto string_at = [&](size_t &at, std::string &out)
+    {
+        at = json.find_first_not_of(" \t\r\n,", at);
+        if (at == std::string::npos || json[at] != '"')
+            return false;
+        size_t close = json.find('"', at + 1);
+        if (close == std::string::npos)
+            return false;
+        out = json.substr(at + 1, close - at - 1);
+        at = json.find(':', close);
+        return at++ != std::string::npos;
+    };
+    pos++;
+    std::string kernel, metric;
+    while (string_at(pos, kernel))
+    {
+        pos = json.find('{', pos);
+        if (pos == std::string::npos)
+            break;
+        pos++;
+        while (string_at(pos, metric))
+        {
+            char *end;
+            double value = std::strtod(json.c_str() + pos, &end);
+            if (end == json.c_str() + pos)
+                return {};
+            results[kernel][metric] = value;
+            pos = end - json.c_str();
+        }
+        pos = json.find('}', pos);
+        if (pos == std::string::npos)
+            break;
+        pos++;
+    }
+    return results;
+}
+
+static bool write_baseline(const std::string &path, const std::vector<std::string> &order, const CodegenResults &results)
+{
+    std::ofstream out(path, std::ios::binary);
+    out << "{\n  \"kernels\": {";
+    for (size_t k = 0; k < order.size(); k++)
+    {
+        out << (k ? ",\n" : "\n") << "    \"" << order[k] << "\": {";
+        size_t m = 0;
+        for (const auto &[metric, value] : results.at(order[k]))
+            out << (m++ ? ", " : "") << "\"" << metric << "\": " << static_cast<u64>(value);
+        out << "}";
+    }
+    out << "\n  }\n}\n";
+    return static_cast<bool>(out);
+}
+
+// Quality of the code Generator::generate emits, at the default -O1. For every
+// kernel the static numbers (instructions, stack pushes, pops and rsp/rbp
+// memory operands, .text bytes) come from the assembly and the executable.
+// The executable is then run at least five times with hardware counters for
+// cycles, instructions and L1 data loads and stores, and the minimum and median
+// of each are kept; where perf_event_open is not permitted only wall time is.
+// The results are compared with the previous run's in --baseline and replace them,
+// so a run with --tos-cache after one without shows what the cache saves.
+static bool run_codegen(const BenchConfig &cfg)
+{
+    if (system("nasm -v > /dev/null 2>&1") != 0)
+    {
+        LLOG(CYAN_TEXT("codegen"), ": skipped, nasm not found\n\n");
+        return true;
+    }
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("yzbench-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+
+    struct Kernel
+    {
+        const char *name;
+        std::string src;
+    };
+    ProgramGen gen;
+    std::vector<Kernel> kernels = {
+        {"counting", gen.counting_loop(20000000)},
+        {"nested", gen.nested_loops(2000, 5000)},
+        {"calls", gen.small_calls(10000000)},
+        {"single", gen.single_call(2000000)},
+        {"arrays", gen.array_kernel(1024, 50000)},
+        {"shared", gen.shared_subexprs(2000000)},
+        {"counters", gen.counters(200000, false)},
+        {"sized", gen.counters(200000, true)},
+    };
+
+    int runs = std::max(cfg.reps, 5);
+    CodegenResults baseline = read_baseline(cfg.baseline);
+    CodegenResults results;
+    std::vector<std::string> order;
+    bool counted_any = false;
+
+    char line[240];
+    snprintf(line, sizeof(line), "%-10s %7s %7s %7s %14s %14s %13s %13s %10s %10s\n", "kernel", "insns", "stack",
+             "text B", "cycles", "instructions", "L1 loads", "L1 stores", "min ms", "median ms");
+    LLOG(CYAN_TEXT("codegen"), "\n", line);
+    for (const Kernel &kernel : kernels)
+    {
+        Options opts;
+        opts.cache_tos = cfg.tos_cache;
+        std::map<std::string, double> &metrics = results[kernel.name];
+        order.push_back(kernel.name);
+        std::vector<PerfSample> samples;
+        try
+        {
+            std::string assembly = generate_asm(kernel.src, opts.gen_options());
+            size_t insns, calls;
+            count_asm(assembly, insns, calls);
+            metrics["insns"] = insns;
+            metrics["stack_ops"] = count_stack_ops(assembly);
+
+            std::string input = (dir / (std::string(kernel.name) + ".yz")).string();
+            std::ofstream(input) << kernel.src;
+            CompileStats stats;
+            OutputPaths paths = CompileContext(opts).compile(input, stats);
+            metrics["text_bytes"] = text_bytes(paths.exe_path);
+            for (int i = 0; i < runs; i++)
+            {
+                samples.push_back(perf_run(paths.exe_path));
+                if (!samples.back().ok)
+                {
+                    LLOG(RED_TEXT(kernel.name), ": the program failed\n");
+                    return false;
+                }
+            }
+        }
+        catch (const CompileError &err)
+        {
+            report_failure(kernel.name, err);
+            return false;
+        }
+
+        auto summarize = [&](const std::string &name, std::vector<u64> values)
+        {
+            std::sort(values.begin(), values.end());
+            metrics[name + "_min"] = values.front();
+            metrics[name + "_median"] = values[values.size() / 2];
+        };
+        std::vector<u64> wall;
+        for (const PerfSample &sample : samples)
+            wall.push_back(sample.wall_ns);
+        summarize("wall_ns", wall);
+        std::string medians[PERF_EVENT_COUNT];
+        for (size_t e = 0; e < PERF_EVENT_COUNT; e++)
+        {
+            std::vector<u64> counts;
+            for (const PerfSample &sample : samples)
+            {
+                if (sample.counted[e])
+                    counts.push_back(sample.counts[e]);
+            }
+            medians[e] = "-";
+            if (counts.size() != samples.size())
+                continue;
+            summarize(PERF_EVENTS[e].name, counts);
+            medians[e] = std::to_string(static_cast<u64>(metrics[std::string(PERF_EVENTS[e].name) + "_median"]));
+            counted_any = true;
+        }
+
+        snprintf(line, sizeof(line), "%-10s %7.0f %7.0f %7.0f %14s %14s %13s %13s %10.3f %10.3f\n", kernel.name,
+                 metrics["insns"], metrics["stack_ops"], metrics["text_bytes"], medians[0].c_str(), medians[1].c_str(),
+                 medians[2].c_str(), medians[3].c_str(), metrics["wall_ns_min"] / 1e6, metrics["wall_ns_median"] / 1e6);
+        LLOG(line);
+
+        auto old = baseline.find(kernel.name);
+        if (old == baseline.end())
+            continue;
+        std::string changes;
+        for (const auto &[metric, value] : metrics)
+        {
+            auto before = old->second.find(metric);
+            if (metric.size() >= 4 && metric.compare(metric.size() - 4, 4, "_min") == 0)
+                continue;
+            if (before == old->second.end() || before->second == 0 || before->second == value)
+                continue;
+            char change[80];
+            snprintf(change, sizeof(change), "%s%s %+.1f%%", changes.empty() ? "" : ", ", metric.c_str(),
+                     100 * (value / before->second - 1));
+            changes += change;
+        }
+        LLOG("           vs baseline: ", changes.empty() ? "unchanged" : changes, "\n");
+    }
+    if (!counted_any)
+        LLOG("hardware counters unavailable (perf_event_open), wall time only\n");
+
+    bool ok = write_baseline(cfg.baseline, order, results);
+    LLOG(ok ? "results written to " : "could not write ", cfg.baseline, "\n\n");
+
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    return ok;
+}
+
+// Inliner benchmark: each kernel is generated with every call kept a call
+// (--no-inline) and with the inliner on, both at -O1. Emitted instructions
+// and remaining calls are always reported; with nasm and ld on the PATH the
+// programs are also built, run and timed.
+static bool run_calls(const BenchConfig &cfg)
+{
+    struct Kernel
+    {
+        const char *name;
+        std::string src;
+    };
+    ProgramGen gen;
+    std::vector<Kernel> kernels = {
+        {"small", gen.small_calls(50000000)},
+        {"single", gen.single_call(10000000)},
+    };
+
+    bool run = system("nasm -v > /dev/null 2>&1") == 0;
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("yzbench-" + std::to_string(getpid()));
+    if (run)
+        std::filesystem::create_directories(dir);
+
+    bool ok = true;
+    char line[200];
+    snprintf(line, sizeof(line), "%-8s %10s %10s %7s %7s %12s %12s %8s\n", "kernel", "insns out", "insns in",
+             "calls", "calls", "outlined ms", "inlined ms", "speedup");
+    LLOG(CYAN_TEXT("calls"), run ? "" : " (nasm not found, not running the programs)", "\n", line);
+    for (const Kernel &kernel : kernels)
+    {
+        size_t insns[2], calls[2];
+        double ns[2] = {0, 0};
+        std::string output[2];
+        for (int inlined = 0; inlined < 2; inlined++)
+        {
+            Options opts;
+            opts.inline_functions = inlined;
+            try
+            {
+                count_asm(generate_asm(kernel.src, opts.gen_options()), insns[inlined], calls[inlined]);
+                if (!run)
+                    continue;
+                std::string input = (dir / (std::string(kernel.name) + (inlined ? "_inline" : "_call") + ".yz")).string();
+                std::ofstream(input) << kernel.src;
+                CompileStats stats;
+                OutputPaths paths = CompileContext(opts).compile(input, stats);
+                output[inlined] = run_program(paths.exe_path, cfg.reps, ns[inlined]);
+            }
+            catch (const CompileError &err)
+            {
+                report_failure(kernel.name, err);
+                return false;
+            }
+        }
+
+        if (run)
+            snprintf(line, sizeof(line), "%-8s %10zu %10zu %7zu %7zu %12.3f %12.3f %7.2fx", kernel.name, insns[0],
+                     insns[1], calls[0], calls[1], ns[0] / 1e6, ns[1] / 1e6, ns[0] / ns[1]);
+        else
+            snprintf(line, sizeof(line), "%-8s %10zu %10zu %7zu %7zu", kernel.name, insns[0], insns[1], calls[0],
+                     calls[1]);
+        if (output[0] != output[1])
+        {
+            ok = false;
+            LLOG(line, "  ", RED_TEXT("OUTPUT DIFFERS"), "\n");
+        }
+        else
+            LLOG(line, "\n");
+    }
+    LLOG("\n");
+
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    return ok;
+}
+
+// Generated-code benchmark for element-wise array code, built with scalar
+// code only, SSE2 and (if the CPU has it) AVX2. Needs nasm and ld on the PATH.
+static bool run_arrays(const BenchConfig &cfg)
+{
+    if (system("nasm -v > /dev/null 2>&1") != 0)
+    {
+        LLOG(CYAN_TEXT("arrays"), ": skipped, nasm not found\n\n");
+        return true;
+    }
+
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("yzbench-" + std::to_string(getpid()));
+    std::filesystem::create_directories(dir);
+
+    struct Level
+    {
+        const char *name;
+        SimdLevel simd;
+    };
+    std::vector<Level> levels = {{"none", SimdLevel::NONE}, {"sse2", SimdLevel::SSE2}};
+    if (__builtin_cpu_supports("avx2"))
+        levels.push_back({"avx2", SimdLevel::AVX2});
+
+    ProgramGen gen;
+    std::string src = gen.array_kernel(4099, 20000);
+    std::string input = (dir / "arrays.yz").string();
+    std::ofstream(input) << src;
+
+    bool ok = true;
+    char line[160];
+    snprintf(line, sizeof(line), "%-8s %12s %8s\n", "simd", "ms", "speedup");
+    LLOG(CYAN_TEXT("arrays"), " (4099 elements, c = a + b * k - c, 20000 times)\n", line);
+    double base_ns = 0;
+    std::string base_output;
+    for (const Level &level : levels)
+    {
+        Options opts;
+        opts.simd = level.simd;
+        double ns;
+        std::string output;
+        try
+        {
+            CompileStats stats;
+            OutputPaths paths = CompileContext(opts).compile(input, stats);
+            output = run_program(paths.exe_path, cfg.reps, ns);
+        }
+        catch (const CompileError &err)
+        {
+            report_failure(input, err);
+            return false;
+        }
+        if (level.simd == SimdLevel::NONE)
+        {
+            base_ns = ns;
+            base_output = output;
+        }
+
+        snprintf(line, sizeof(line), "%-8s %12.3f %7.2fx", level.name, ns / 1e6, base_ns / ns);
+        if (output != base_output)
+        {
+            ok = false;
+            LLOG(line, "  ", RED_TEXT("OUTPUT DIFFERS"), "\n");
+        }
+        else
+            LLOG(line, "\n");
+    }
+    LLOG("\n");
+
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    return ok;
+}
+
+// Source locations on multi-megabyte programs. Tokens only record a byte
+// offset; line starts are scanned for when a diagnostic is printed, so the
+// scan (SSE2 against a byte loop) and a lookup are what an error costs, and
+// "eager" is the share the scan would add to every tokenize if lines were
+// tracked up front.
+static bool run_locations(const BenchConfig &cfg)
+{
+    bool correct = true;
+    char line[160];
+    snprintf(line, sizeof(line), "%-10s %8s %12s %10s %12s %10s %8s\n", "shape", "MiB", "tokenize ms", "scan ms",
+             "bytewise ms", "locate us", "eager");
+    LLOG(CYAN_TEXT("locations"), " (sizeof(Token) = ", sizeof(Token), ")\n", line);
+
+    for (const Shape &shape : shapes())
+    {
+        ProgramGen gen;
+        std::string src;
+        for (size_t n = cfg.min_n; src.size() < 8 * 1024 * 1024; n *= 2)
+            src = shape.make(gen, n);
+
+        std::vector<Token> tokens;
+        double tokenize_ns = time_min(cfg.reps, [&]
+                                      { Tokenizer(src).tokenize(tokens); });
+        size_t lines = 0;
+        double scan_ns = time_min(cfg.reps, [&]
+                                  { lines = LineMap(src).lines(); });
+        size_t bytewise_lines = 0;
+        double bytewise_ns = time_min(cfg.reps, [&]
+                                      {
+            std::vector<u32> starts{0};
+            for (size_t i = 0; i < src.size(); i++)
+            {
+                if (src[i] == '\n')
+                    starts.push_back(static_cast<u32>(i + 1));
+            }
+            bytewise_lines = starts.size(); });
+        SourceLocation last{};
+        double locate_ns = time_min(cfg.reps, [&]
+                                    { last = LineMap(src).locate(tokens.back().offset); });
+
+        snprintf(line, sizeof(line), "%-10s %8.1f %12.3f %10.3f %12.3f %10.1f %7.1f%%", shape.name,
+                 src.size() / (1024.0 * 1024.0), tokenize_ns / 1e6, scan_ns / 1e6, bytewise_ns / 1e6, locate_ns / 1e3,
+                 100.0 * scan_ns / tokenize_ns);
+        if (lines != bytewise_lines || last.line != lines - (src.back() == '\n'))
+        {
+            correct = false;
+            LLOG(line, "  ", RED_TEXT("LINE COUNT DIFFERS"), "\n");
+        }
+        else
+            LLOG(line, "\n");
+    }
+    LLOG("\n");
+    return correct;
+}
+
+// Parser memory and time with and without hash-consing, on every shape at
+// --max-n: AST nodes allocated, arena bytes, and the parse and generate times.
+static bool run_hashcons(const BenchConfig &cfg)
+{
+    ArenaAlloc arena(1024ull * 1024 * 1024);
+    char line[200];
+    snprintf(line, sizeof(line), "%-10s %9s %9s %10s %10s %9s %9s %9s %9s\n", "shape", "nodes", "shared",
+             "KiB", "KiB shared", "parse ms", "shared", "gen ms", "shared");
+    LLOG(CYAN_TEXT("hashcons"), " (n = ", cfg.max_n, ")\n", line);
+    for (const Shape &shape : shapes())
+    {
+        ProgramGen gen;
+        std::string src = shape.make(gen, cfg.max_n);
+        std::vector<Token> tokens;
+        Tokenizer(src).tokenize(tokens);
+
+        size_t nodes[2], bytes[2];
+        double parse_ns[2], gen_ns[2];
+        for (int hashed = 0; hashed < 2; hashed++)
+        {
+            NodeProg prog;
+            parse_ns[hashed] = time_min(cfg.reps, [&]
+                                        {
+                arena.reset();
+                HashCons table;
+                Parser parser(tokens, arena, hashed ? &table : nullptr);
+                prog = parser.parse_prog().value(); });
+            nodes[hashed] = arena.allocations();
+            bytes[hashed] = arena.bytes_used();
+            gen_ns[hashed] = time_min(cfg.reps, [&]
+                                      { (void)Generator(prog).generate(); });
+        }
+        snprintf(line, sizeof(line), "%-10s %9zu %9zu %10zu %10zu %9.3f %9.3f %9.3f %9.3f\n", shape.name, nodes[0],
+                 nodes[1], bytes[0] / 1024, bytes[1] / 1024, parse_ns[0] / 1e6, parse_ns[1] / 1e6, gen_ns[0] / 1e6,
+                 gen_ns[1] / 1e6);
+        LLOG(line);
+    }
+    LLOG("\n");
+    return true;
+}
+
+// Value-numbering benchmark over test/main.yz and the generated shapes:
+// the operators it removed and the instructions emitted with --no-cse and
+// without, at -O1. With nasm and ld on the PATH the programs are also run and timed.
+static bool run_cse(const BenchConfig &cfg)
+{
+    struct Program
+    {
+        std::string name;
+        std::string src;
+    };
+    std::vector<Program> corpus;
+    std::ifstream main_file("test/main.yz", std::ios::binary);
+    if (main_file.is_open())
+        corpus.push_back({"main.yz", std::string(std::istreambuf_iterator<char>(main_file), {})});
+    ProgramGen gen;
+    for (const Shape &shape : shapes())
+        corpus.push_back({shape.name, shape.make(gen, 2000)});
+    corpus.push_back({"loop", gen.counting_loop(1000000)});
+    corpus.push_back({"shared", gen.shared_subexprs(1000000)});
+
+    bool run = system("nasm -v > /dev/null 2>&1") == 0;
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / ("yzbench-" + std::to_string(getpid()));
+    if (run)
+        std::filesystem::create_directories(dir);
+
+    bool ok = true;
+    char line[200];
+    snprintf(line, sizeof(line), "%-10s %8s %10s %10s %12s %12s %8s\n", "program", "removed", "insns off",
+             "insns on", "off ms", "on ms", "speedup");
+    LLOG(CYAN_TEXT("cse"), run ? "" : " (nasm not found, not running the programs)", "\n", line);
+    u64 total_removed = 0;
+    for (const Program &program : corpus)
+    {
+        size_t insns[2], calls;
+        double ns[2] = {0, 0};
+        std::string output[2];
+        u64 removed = 0;
+        for (int numbered = 0; numbered < 2; numbered++)
+        {
+            Options opts;
+            opts.value_numbering = numbered;
+            try
+            {
+                std::vector<Token> tokens;
+                Tokenizer(program.src).tokenize(tokens);
+                ArenaAlloc arena(1024 * 1024);
+                Parser parser(tokens, arena);
+                Generator generator(parser.parse_prog().value(), opts.gen_options());
+                count_asm(generator.generate().str(), insns[numbered], calls);
+                if (numbered)
+                    removed = generator.ops_removed();
+                if (!run)
+                    continue;
+                std::string input = (dir / (program.name + (numbered ? "_on" : "_off") + ".yz")).string();
+                std::ofstream(input) << program.src;
+                CompileStats stats;
+                OutputPaths paths = CompileContext(opts).compile(input, stats);
+                output[numbered] = run_program(paths.exe_path, cfg.reps, ns[numbered]);
+            }
+            catch (const CompileError &err)
+            {
+                report_failure(program.name, err);
+                return false;
+            }
+        }
+        total_removed += removed;
+
+        if (run)
+            snprintf(line, sizeof(line), "%-10s %8llu %10zu %10zu %12.3f %12.3f %7.2fx", program.name.c_str(),
+                     (unsigned long long)removed, insns[0], insns[1], ns[0] / 1e6, ns[1] / 1e6, ns[0] / ns[1]);
+        else
+            snprintf(line, sizeof(line), "%-10s %8llu %10zu %10zu", program.name.c_str(),
+                     (unsigned long long)removed, insns[0], insns[1]);
+        if (output[0] != output[1])
+        {
+            ok = false;
+            LLOG(line, "  ", RED_TEXT("OUTPUT DIFFERS"), "\n");
+        }
+        else
+            LLOG(line, "\n");
+    }
+    LLOG("total removed: ", total_removed, "\n\n");
+
+    std::error_code ec;
+    std::filesystem::remove_all(dir, ec);
+    return ok;
+}
+
+// Compiling from an --emit-ast-bin snapshot against compiling from source:
+// tokenize and parse, map the snapshot (which checks only its header), and
+// map it and link the nodes the generator needs. The assembly generated from
+// the linked nodes has to be identical to that from the parsed ones.
+static bool run_ast(const BenchConfig &cfg)
+{
+    ArenaAlloc arena(1024ull * 1024 * 1024);
+    bool identical = true;
+    char line[200];
+    snprintf(line, sizeof(line), "%-10s %8s %10s %10s %10s %10s %10s %8s\n", "shape", "n", "src KiB", "ast KiB",
+             "parse ms", "map ms", "load ms", "speedup");
+    LLOG(CYAN_TEXT("ast"), "\n", line);
+    for (const Shape &shape : shapes())
+    {
+        for (size_t n = cfg.min_n; n <= cfg.max_n; n *= 2)
+        {
+            ProgramGen gen;
+            std::string src = shape.make(gen, n);
+            std::vector<Token> tokens;
+            NodeProg parsed;
+            double parse_ns = time_min(cfg.reps, [&]
+                                       {
+                arena.reset();
+                Tokenizer(src).tokenize(tokens);
+                Parser parser(tokens, arena);
+                parsed = parser.parse_prog().value(); });
+            std::string expected = Generator(parsed).generate().str();
+
+            TempFile file(temp_path(".yzast"));
+            AstWriter writer;
+            writer.add(parsed.stmts);
+            writer.write(file.path(), xxh64(src.data(), src.size()), static_cast<u32>(src.size()));
+            size_t ast_bytes = 0;
+            double map_ns = time_min(cfg.reps, [&]
+                                     { ast_bytes = AstSnapshot(file.path()).bytes().size(); });
+            NodeProg loaded;
+            double load_ns = time_min(cfg.reps, [&]
+                                      {
+                arena.reset();
+                loaded = AstSnapshot(file.path()).link(arena); });
+
+            snprintf(line, sizeof(line), "%-10s %8zu %10zu %10zu %10.3f %10.3f %10.3f %7.2fx", shape.name, n,
+                     src.size() / 1024, ast_bytes / 1024, parse_ns / 1e6, map_ns / 1e6, load_ns / 1e6,
+                     parse_ns / load_ns);
+            if (Generator(loaded).generate().str() != expected)
+            {
+                identical = false;
+                LLOG(line, "  ", RED_TEXT("OUTPUT DIFFERS"), "\n");
+            }
+            else
+                LLOG(line, "\n");
+        }
+    }
+    LLOG("\n");
+    return identical;
+}
+
+static void print_usage()
+{
+    LLOG("yzbench [--min-n <n>] [--max-n <n>] [--reps <r>] [--threshold <k>]\n");
+    LLOG("        [stages] [logger] [pipeline] [loops] [calls] [arrays] [cse]\n");
+    LLOG("        [hashcons] [locations] [profile] [codegen] [ast] [--baseline <file>] [--tos-cache]\n");
+    LLOG("yzbench --emit <vals|nested|chain|shadowing> <n>   print a generated program\n");
+}
+
+i32 main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    std::vector<std::string> suites;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--min-n" && has_value)
+            cfg.min_n = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--max-n" && has_value)
+            cfg.max_n = std::strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--reps" && has_value)
+            cfg.reps = std::atoi(argv[++i]);
+        else if (arg == "--threshold" && has_value)
+            cfg.threshold = std::atof(argv[++i]);
+        else if (arg == "--baseline" && has_value)
+            cfg.baseline = argv[++i];
+        else if (arg == "--tos-cache")
+            cfg.tos_cache = true;
+        else if (arg == "--emit" && i + 2 < argc)
+        {
+            std::string name = argv[++i];
+            size_t n = std::strtoul(argv[++i], nullptr, 10);
+            for (const Shape &shape : shapes())
+            {
+                if (name == shape.name)
+                {
+                    ProgramGen gen;
+                    fputs(shape.make(gen, n).c_str(), stdout);
+                    return EXIT_SUCCESS;
+                }
+            }
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        else if (arg == "stages" || arg == "logger" || arg == "pipeline" || arg == "loops" ||
+                 arg == "calls" || arg == "arrays" || arg == "cse" || arg == "hashcons" ||
+                 arg == "locations" || arg == "profile" || arg == "codegen" || arg == "ast")
+            suites.push_back(arg);
+        else
+        {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (cfg.min_n == 0 || cfg.min_n > cfg.max_n || cfg.reps < 1)
+    {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    if (suites.empty())
+        suites.push_back("stages");
+
+    bool ok = true;
+    for (const std::string &suite : suites)
+    {
+        if (suite == "stages")
+            ok &= run_stages(cfg);
+        else if (suite == "logger")
+            ok &= run_logger(cfg);
+        else if (suite == "pipeline")
+            ok &= run_pipeline(cfg);
+        else if (suite == "loops")
+            ok &= run_loops(cfg);
+        else if (suite == "calls")
+            ok &= run_calls(cfg);
+        else if (suite == "arrays")
+            ok &= run_arrays(cfg);
+        else if (suite == "cse")
+            ok &= run_cse(cfg);
+        else if (suite == "hashcons")
+            ok &= run_hashcons(cfg);
+        else if (suite == "locations")
+            ok &= run_locations(cfg);
+        else if (suite == "profile")
+            ok &= run_profile(cfg);
+        else if (suite == "codegen")
+            ok &= run_codegen(cfg);
+        else if (suite == "ast")
+            ok &= run_ast(cfg);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
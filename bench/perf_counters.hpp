@@ -0,0 +1,139 @@
+#pragma once
+#include <chrono>
+#include <string>
+#include "core/defines.h"
+#include "process.hpp"
+
+#if defined(IPLATFORM_LINUX)
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Hardware counters for single runs of a program, read with perf_event_open.
+// A counter the kernel or the CPU does not offer (no PMU in a VM, or
+// perf_event_paranoid above 2) is left out of the sample, so without any of
+// them a run is measured by its wall time alone.
+
+struct PerfEvent
+{
+    const char *name;
+    u32 type;
+    u64 config;
+};
+
+#if defined(IPLATFORM_LINUX)
+static constexpr u64 L1D_READ = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16);
+static constexpr u64 L1D_WRITE = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_WRITE << 8) |
+                                 (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16);
+
+static const PerfEvent PERF_EVENTS[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"l1_loads", PERF_TYPE_HW_CACHE, L1D_READ},
+    {"l1_stores", PERF_TYPE_HW_CACHE, L1D_WRITE},
+};
+#else
+static const PerfEvent PERF_EVENTS[] = {
+    {"cycles", 0, 0},
+    {"instructions", 0, 0},
+    {"l1_loads", 0, 0},
+    {"l1_stores", 0, 0},
+};
+#endif
+
+static constexpr size_t PERF_EVENT_COUNT = sizeof(PERF_EVENTS) / sizeof(PERF_EVENTS[0]);
+
+struct PerfSample
+{
+    bool ok = false; // the program ran and exited with 0
+    u64 wall_ns = 0;
+    bool counted[PERF_EVENT_COUNT] = {};
+    u64 counts[PERF_EVENT_COUNT] = {}; // user-space events, scaled up if the kernel multiplexed them
+};
+
+// Runs `exe` once with its output sent to /dev/null. The counters are opened
+// on the child while it waits on a pipe and are enabled by its exec, so they
+// see the program and nothing of the fork.
+inline PerfSample perf_run(const std::string &exe)
+{
+    PerfSample sample;
+#if defined(IPLATFORM_LINUX)
+    const char *path = exe.c_str();
+    int gate[2];
+    if (pipe2(gate, O_CLOEXEC) != 0)
+        return sample;
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(gate[0]);
+        close(gate[1]);
+        return sample;
+    }
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (null > STDERR_FILENO)
+            close(null);
+        close(gate[1]);
+        char go;
+        if (read(gate[0], &go, 1) != 1)
+            _exit(127);
+        execl(path, path, static_cast<char *>(nullptr));
+        _exit(127);
+    }
+    close(gate[0]);
+
+    int fds[PERF_EVENT_COUNT];
+    for (size_t i = 0; i < PERF_EVENT_COUNT; i++)
+    {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_EVENTS[i].type;
+        attr.config = PERF_EVENTS[i].config;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool released = write(gate[1], "g", 1) == 1;
+    close(gate[1]);
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    sample.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    sample.ok = released && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    for (size_t i = 0; i < PERF_EVENT_COUNT; i++)
+    {
+        if (fds[i] < 0)
+            continue;
+        u64 values[3]; // count, time enabled, time running
+        if (read(fds[i], values, sizeof(values)) == sizeof(values) && values[2] > 0)
+        {
+            sample.counted[i] = true;
+            sample.counts[i] = values[2] < values[1]
+                                   ? static_cast<u64>(static_cast<double>(values[0]) * values[1] / values[2])
+                                   : values[0];
+        }
+        close(fds[i]);
+    }
+#elif defined(IPLATFORM_WINDOWS)
+    ChildProcess child({exe});
+    ProcessResult result = child.wait();
+    sample.ok = result.exited && result.exit_code == 0;
+    sample.wall_ns = result.wall_ns;
+#endif
+    return sample;
+}
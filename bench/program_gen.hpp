@@ -0,0 +1,282 @@
+#pragma once
+#include <algorithm>
+#include <string>
+#include "core/defines.h"
+
+// Deterministic generator of large, valid YZ programs for the benchmarks.
+// The same seed and size always produce byte-identical sources.
+class ProgramGen
+{
+public:
+    inline explicit ProgramGen(u64 seed = 0x5eed)
+        : m_state(seed ? seed : 1)
+    {
+    }
+
+    // `n` top-level vals, each an expression over a few earlier ones.
+    std::string top_level_vals(size_t n)
+    {
+        std::string src;
+        for (size_t i = 0; i < n; i++)
+        {
+            src += "val v" + std::to_string(i) + " = ";
+            src += i == 0 ? literal() : expr_over("v", i, 4);
+            src += ";\n";
+            if (i % 16 == 15)
+                src += "out(v" + std::to_string(i) + ");\n";
+        }
+        src += "exit(0);\n";
+        return src;
+    }
+
+    // Towers of blocks nested `depth` deep until `n` vals have been declared.
+    std::string nested_blocks(size_t n, size_t depth = 64)
+    {
+        std::string src = "val base = " + literal() + ";\n";
+        size_t declared = 0;
+        while (declared < n)
+        {
+            size_t levels = 0;
+            for (; levels < depth && declared < n; levels++, declared++)
+            {
+                indent(src, levels);
+                src += "{\n";
+                indent(src, levels + 1);
+                src += "val d" + std::to_string(levels) + " = ";
+                src += levels == 0 ? "base + " + literal() : expr_over("d", levels, 3);
+                src += ";\n";
+            }
+            while (levels-- > 0)
+            {
+                indent(src, levels + 1);
+                src += "out(d" + std::to_string(levels) + ");\n";
+                indent(src, levels);
+                src += "}\n";
+            }
+        }
+        src += "exit(0);\n";
+        return src;
+    }
+
+    // A single val whose initializer is one operator chain with `n` operands.
+    std::string operator_chain(size_t n)
+    {
+        std::string src = "val a = " + literal() + ";\nval b = " + literal() + ";\nval c = ";
+        for (size_t i = 0; i < n; i++)
+        {
+            if (i)
+                src += binop();
+            switch (next() % 4)
+            {
+            case 0:
+                src += "a";
+                break;
+            case 1:
+                src += "b";
+                break;
+            case 2:
+                src += "(a " + binop() + "b)";
+                break;
+            default:
+                src += literal();
+                break;
+            }
+        }
+        src += ";\nout(c);\nexit(0);\n";
+        return src;
+    }
+
+    // The same handful of names re-declared over and over in sibling and nested blocks.
+    std::string shadowing(size_t n)
+    {
+        static const char *names[] = {"x", "y", "z", "w"};
+        std::string src;
+        for (const char *name : names)
+            src += std::string("val ") + name + " = " + literal() + ";\n";
+
+        size_t declared = 0;
+        while (declared < n)
+        {
+            src += "{\n";
+            size_t opened = 0;
+            for (size_t level = 0; level < 4 && declared < n; level++, opened++)
+            {
+                for (const char *name : names)
+                {
+                    indent(src, level + 1);
+                    src += std::string("val ") + name + " = " + names[next() % 4] + " " + binop() +
+                           names[next() % 4] + ";\n";
+                    declared++;
+                }
+                indent(src, level + 1);
+                src += "{\n";
+            }
+            for (size_t level = opened; level-- > 0;)
+            {
+                indent(src, level + 2);
+                src += std::string("out(") + names[next() % 4] + ");\n";
+                indent(src, level + 1);
+                src += "}\n";
+            }
+            src += "}\n";
+        }
+        src += "exit(0);\n";
+        return src;
+    }
+
+    // A counting loop whose body is dominated by loop-invariant arithmetic.
+    std::string counting_loop(size_t n)
+    {
+        std::string src = "val n = " + std::to_string(n) + ";\n";
+        src += "val a = " + literal() + ";\nval b = " + literal() + ";\n";
+        src += "var i = 0;\nvar acc = 0;\n";
+        src += "while (i < n) {\n";
+        src += "    acc = acc + a * b + (a - b) * 2;\n";
+        src += "    i = i + 1;\n";
+        src += "}\nout(acc);\nexit(0);\n";
+        return src;
+    }
+
+    // Two nested loops; `r * cols` is invariant in the inner one only.
+    std::string nested_loops(size_t rows, size_t cols)
+    {
+        std::string src = "val rows = " + std::to_string(rows) + ";\n";
+        src += "val cols = " + std::to_string(cols) + ";\n";
+        src += "var r = 0;\nvar total = 0;\n";
+        src += "while (r < rows) {\n";
+        src += "    var c = 0;\n";
+        src += "    while (c < cols) {\n";
+        src += "        total = total + r * cols + c;\n";
+        src += "        c = c + 1;\n";
+        src += "    }\n";
+        src += "    r = r + 1;\n";
+        src += "}\nout(total);\nexit(0);\n";
+        return src;
+    }
+
+    // A hot loop calling a function small enough to be inlined everywhere.
+    std::string small_calls(size_t n)
+    {
+        std::string src = "fn mix(a, b) {\n    return a * 3 + b;\n}\n";
+        src += "val n = " + std::to_string(n) + ";\n";
+        src += "var i = 0;\nvar acc = 0;\n";
+        src += "while (i < n) {\n";
+        src += "    acc = mix(acc, i) - acc * 2;\n";
+        src += "    i = i + 1;\n";
+        src += "}\nout(acc);\nexit(0);\n";
+        return src;
+    }
+
+    // A hot loop calling a function with a loop of its own from its only call site.
+    std::string single_call(size_t n)
+    {
+        std::string src = "fn step(x, k) {\n";
+        src += "    var j = 0;\n    var s = x;\n";
+        src += "    while (j < k) {\n        s = s + j * x;\n        j = j + 1;\n    }\n";
+        src += "    return s - x * 2;\n}\n";
+        src += "val n = " + std::to_string(n) + ";\n";
+        src += "var i = 0;\nvar acc = 0;\n";
+        src += "while (i < n) {\n";
+        src += "    acc = acc + step(i, 4);\n";
+        src += "    i = i + 1;\n";
+        src += "}\nout(acc);\nexit(0);\n";
+        return src;
+    }
+
+    // Element-wise array arithmetic repeated `reps` times over `len` elements.
+    std::string array_kernel(size_t len, size_t reps)
+    {
+        std::string n = std::to_string(len);
+        std::string src = "var a[" + n + "];\nvar b[" + n + "];\nvar c[" + n + "];\n";
+        src += "var i = 0;\nwhile (i < " + n + ") {\n    a[i] = i;\n    b[i] = i * 3 + 1;\n    i = i + 1;\n}\n";
+        src += "val k = " + literal() + ";\n";
+        src += "var r = 0;\nwhile (r < " + std::to_string(reps) + ") {\n";
+        src += "    c = a + b * k - c;\n";
+        src += "    r = r + 1;\n";
+        src += "}\nout(c[0]);\nout(c[" + std::to_string(len - 1) + "]);\nexit(0);\n";
+        return src;
+    }
+
+    // A hot loop whose body repeats the same expressions over a `val`.
+    std::string shared_subexprs(size_t n)
+    {
+        std::string src = "val n = " + std::to_string(n) + ";\n";
+        src += "val a = " + literal() + ";\nval b = " + literal() + ";\n";
+        src += "var i = 0;\nvar acc = 0;\n";
+        src += "while (i < n) {\n";
+        src += "    val k = i * 3;\n";
+        src += "    acc = acc + (k + a) * (k + a) + (k + a) * b - k * b;\n";
+        src += "    out(k * b + (k + a));\n";
+        src += "    i = i + 1;\n";
+        src += "}\nout(acc);\nexit(0);\n";
+        return src;
+    }
+
+    // Nested loops over small counters and a flag, declared with the sized
+    // types i32, i16 and i8 when `sized` is set and as plain 64-bit values otherwise.
+    std::string counters(size_t n, bool sized)
+    {
+        auto type = [&](const char *name)
+        { return sized ? std::string(": ") + name : std::string(); };
+        std::string src = "var total" + type("i32") + " = 0;\nvar i" + type("i32") + " = 0;\n";
+        src += "while (i < " + std::to_string(n) + ") {\n";
+        src += "    var j" + type("i16") + " = 0;\n";
+        src += "    var hits" + type("i16") + " = 0;\n";
+        src += "    var flag" + type("i8") + " = 0;\n";
+        src += "    while (j < 100) {\n";
+        src += "        hits = hits + (j < 50);\n";
+        src += "        flag = 1 - flag;\n";
+        src += "        j = j + 1;\n";
+        src += "    }\n";
+        src += "    total = total + hits + flag;\n";
+        src += "    i = i + 1;\n";
+        src += "}\nout(total);\nexit(0);\n";
+        return src;
+    }
+
+private:
+    u64 next()
+    {
+        // xorshift64*
+        m_state ^= m_state >> 12;
+        m_state ^= m_state << 25;
+        m_state ^= m_state >> 27;
+        return m_state * 2685821657736338717ULL;
+    }
+
+    std::string literal()
+    {
+        return std::to_string(1 + next() % 1000);
+    }
+
+    // Never emits `/`, so the generated programs cannot divide by zero.
+    std::string binop()
+    {
+        static const char *ops[] = {"+ ", "- ", "* "};
+        return ops[next() % 3];
+    }
+
+    // An expression over up to `terms` names `<prefix><k>` with k < limit.
+    std::string expr_over(const char *prefix, size_t limit, size_t terms)
+    {
+        std::string expr;
+        size_t count = 1 + next() % terms;
+        for (size_t t = 0; t < count; t++)
+        {
+            if (t)
+                expr += " " + binop();
+            if (next() % 4 == 0)
+                expr += literal();
+            else
+                expr += prefix + std::to_string(limit - 1 - next() % std::min<size_t>(limit, 8));
+        }
+        return expr;
+    }
+
+    static void indent(std::string &src, size_t levels)
+    {
+        src.append(levels * 4, ' ');
+    }
+
+    u64 m_state;
+};
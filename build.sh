@@ -24,7 +24,7 @@ includeDirs="-I./src -I./lib/tomlplusplus/include"
 cppFiles=$(find src -name "*.cpp")
 
 # Compiler flags
-compilerFlags="-std=c++17"
+compilerFlags="-std=c++17 -pthread"
 
 # Defines (if any)
 defines=""
@@ -6,4 +6,7 @@ OutputType Logger::outType = (OutputType)LOG_CONSOLE;
 std::string Logger::filePath = LOG_DEFAULT_FILE;
 std::ofstream Logger::fileStream;
 
-std::mutex Logger::mut;
\ No newline at end of file
+std::mutex Logger::mut;
+
+// Defined last so it is destroyed first: the writer drains into the streams above.
+std::unique_ptr<AsyncLog> Logger::asyncLog;
\ No newline at end of file
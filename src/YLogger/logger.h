@@ -11,6 +11,13 @@
 #include <time.h>
 #include <vector>
 
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+#include "core/defines.h"
+
 #define LOCK_MUTEX(x) std::lock_guard<std::mutex> lock(x)
 
 #include <chrono>
@@ -58,6 +65,7 @@ using std::chrono::system_clock;
 #define LOG_ALL 3
 
 #define LOG_DEFAULT_FILE "log.txt"
+#define LOG_ASYNC_CAPACITY 4096
 #define __FILENAME__ (strstr(__FILE__, "src") ? strstr(__FILE__, "src") + 3 : __FILE__)
 #define FILE_INFO __FILENAME__, __LINE__
 #define NO_FILE_INFO nulllptr, nullptr
@@ -72,21 +80,35 @@ using std::chrono::system_clock;
     info.linenumber = _LIBCPP_TOSTRING2(z);
 
 #define LOG_CHANGE_PRIORITY(x) Logger::priority = (LogLevel)x;
+#define LOG_ENABLE_ASYNC() Logger::EnableAsync();
+#define LOG_FLUSH() Logger::Flush();
 
+// Calls above YZ_LOG_LEVEL (core/defines.h) expand to an empty block, so
+// neither the call nor its arguments are compiled in.
+#if YZ_LOG_LEVEL >= LOG_FATAL
 #define LFATAL(x...)                               \
     {                                              \
         LOGINIT();                                 \
         LOGINFO(LOG_FATAL, __FILENAME__, __LINE__) \
         log.Log(info, x);                          \
+        Logger::Flush();                           \
     }
+#else
+#define LFATAL(x...) {}
+#endif
 
+#if YZ_LOG_LEVEL >= LOG_ERROR
 #define LERROR(x...)                               \
     {                                              \
         LOGINIT();                                 \
         LOGINFO(LOG_FATAL, __FILENAME__, __LINE__) \
         log.Log(info, x);                          \
     }
+#else
+#define LERROR(x...) {}
+#endif
 
+#if YZ_LOG_LEVEL >= LOG_WARN
 #define LWARN(x, y...)                                \
     {                                                 \
         LOGINIT();                                    \
@@ -101,7 +123,11 @@ using std::chrono::system_clock;
             log.Log(info, y);                         \
         }                                             \
     }
+#else
+#define LWARN(x, y...) {}
+#endif
 
+#if YZ_LOG_LEVEL >= LOG_DEBUG
 #define LDEBUG(x, y...)                                \
     {                                                  \
         LOGINIT();                                     \
@@ -116,7 +142,11 @@ using std::chrono::system_clock;
             log.Log(info, y);                          \
         }                                              \
     }
+#else
+#define LDEBUG(x, y...) {}
+#endif
 
+#if YZ_LOG_LEVEL >= LOG_TRACE
 #define LTRACE(x, y...)                                \
     {                                                  \
         LOGINIT();                                     \
@@ -131,7 +161,11 @@ using std::chrono::system_clock;
             log.Log(info, y);                          \
         }                                              \
     }
+#else
+#define LTRACE(x, y...) {}
+#endif
 
+#if YZ_LOG_LEVEL >= LOG_INFO
 #define LINFO(x, y...)                                \
     {                                                 \
         LOGINIT();                                    \
@@ -146,6 +180,9 @@ using std::chrono::system_clock;
             log.Log(info, y);                         \
         }                                             \
     }
+#else
+#define LINFO(x, y...) {}
+#endif
 
 #define LASSERT(x, y)  \
     {                  \
@@ -187,8 +224,139 @@ enum class OutputType
 struct LogInfo
 {
     LogLevel level;
-    std::string filename;
-    std::string linenumber;
+    const char *filename;
+    const char *linenumber;
+};
+
+// std::streambuf that appends into a std::string, so a thread can format
+// messages into one buffer that keeps its capacity between calls.
+class StringAppendBuf : public std::streambuf
+{
+public:
+    std::string str;
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (ch != traits_type::eof())
+            str.push_back(static_cast<char>(ch));
+        return ch;
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n) override
+    {
+        str.append(s, static_cast<size_t>(n));
+        return n;
+    }
+};
+
+struct ThreadBuffer
+{
+    StringAppendBuf buf;
+    std::ostream out{&buf};
+};
+
+//___________________ ASYNC BACKEND _____________________
+// Bounded multi-producer/single-consumer ring (Vyukov's sequence-number
+// queue). Producers claim a slot with one CAS and copy their message into it;
+// the slot strings keep their capacity, so steady-state logging does not
+// allocate. A single writer thread drains the ring and writes each batch with
+// one call per output.
+class AsyncLog
+{
+public:
+    explicit AsyncLog(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        m_mask = size - 1;
+        m_slots = std::make_unique<Slot[]>(size);
+        for (size_t i = 0; i < size; i++)
+            m_slots[i].seq.store(i, std::memory_order_relaxed);
+
+        m_writer = std::thread([this]
+                               { Run(); });
+    }
+
+    AsyncLog(const AsyncLog &other) = delete;
+    AsyncLog operator=(const AsyncLog &other) = delete;
+
+    ~AsyncLog()
+    {
+        Flush();
+        m_running.store(false, std::memory_order_release);
+        m_writer.join();
+    }
+
+    // Waits for a free slot if the ring is full rather than dropping the message.
+    void Push(const std::string &msg)
+    {
+        size_t pos = m_enqueue.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true)
+        {
+            slot = &m_slots[pos & m_mask];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                std::this_thread::yield();
+                pos = m_enqueue.load(std::memory_order_relaxed);
+            }
+            else
+                pos = m_enqueue.load(std::memory_order_relaxed);
+        }
+
+        slot->msg.assign(msg);
+        slot->seq.store(pos + 1, std::memory_order_release);
+    }
+
+    void Flush()
+    {
+        size_t target = m_enqueue.load(std::memory_order_acquire);
+        while (m_written.load(std::memory_order_acquire) < target)
+            std::this_thread::yield();
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> seq{0};
+        std::string msg;
+    };
+
+    // Moves every ready message into `batch`; returns how many were taken.
+    size_t Drain(std::string &batch)
+    {
+        size_t count = 0;
+        while (true)
+        {
+            Slot &slot = m_slots[m_dequeue & m_mask];
+            if (slot.seq.load(std::memory_order_acquire) != m_dequeue + 1)
+                break;
+            batch.append(slot.msg);
+            slot.seq.store(m_dequeue + m_mask + 1, std::memory_order_release);
+            m_dequeue++;
+            count++;
+        }
+        return count;
+    }
+
+    void Run();
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask = 0;
+    alignas(64) std::atomic<size_t> m_enqueue{0};
+    alignas(64) size_t m_dequeue = 0;
+    alignas(64) std::atomic<size_t> m_written{0};
+    std::atomic<bool> m_running{true};
+    std::thread m_writer;
 };
 
 //___________________ LOGGER CLASS _____________________
@@ -199,6 +367,13 @@ private:
     static std::ofstream fileStream;
 
     static std::mutex mut;
+    static std::unique_ptr<AsyncLog> asyncLog;
+
+    static inline ThreadBuffer &GetThreadBuffer()
+    {
+        thread_local ThreadBuffer tb;
+        return tb;
+    }
 
 public:
     static LogLevel priority;
@@ -222,122 +397,65 @@ private:
             fileStream.close();
     }
 
-    static inline std::string GetTitle(LogLevel ll, bool colored)
+    static inline const char *GetTitle(LogLevel ll)
     {
-        std::string output;
-        switch (ll)
-        {
-        case LogLevel::NONE:
-            break;
-        case LogLevel::FATAL:
-            output = "";
-            if (colored)
-                output.append(TEXT_RED);
-            output.append("FATAL");
-            return output;
-            break;
-        case LogLevel::ERROR:
-            if (colored)
-                output = TEXT_RED;
-            output.append("ERROR");
-            return output;
-            break;
-        case LogLevel::WARN:
-            if (colored)
-                output = TEXT_YELLOW;
-            output.append("WARN");
-            return output;
-            break;
-        case LogLevel::DEBUG:
-            if (colored)
-                output = TEXT_BLUE;
-            output.append("DEBUG");
-            return output;
-            break;
-        case LogLevel::TRACE:
-            if (colored)
-                output = TEXT_CYAN;
-            output.append("TRACE");
-            return output;
-            break;
-        case LogLevel::INFO:
-            if (colored)
-                output = TEXT_PURPLE;
-            output.append("INFO");
-            return output;
-            break;
-        case LogLevel::INFO_ONLY:
-            if (colored)
-                output = TEXT_PURPLE;
-            output.append("INFO");
-            break;
-        }
-        return output;
+        static const char *titles[] = {"", "FATAL", "ERROR", "WARN", "DEBUG", "TRACE", "INFO", "INFO"};
+        return titles[(int)ll];
     }
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
-    static inline std::string GetTimestamp()
+    static inline const char *GetTitleColor(LogLevel ll)
     {
-        auto now = system_clock::now();
-        auto inTime = system_clock::to_time_t(now);
-
-        std::stringstream ss;
-        ss << std::put_time(std::localtime(&inTime), "%X");
-        return ss.str();
+        static const char *colors[] = {"", TEXT_RED, TEXT_RED, TEXT_YELLOW, TEXT_BLUE, TEXT_CYAN, TEXT_PURPLE, TEXT_PURPLE};
+        return colors[(int)ll];
     }
-#pragma GCC diagnostic pop
 
-    // clang-format off
-    template<typename F, typename L>
-    static inline std::string GetFileInfo(F file, L line)
+    // "%X" of the current second, formatted again only when the second changes.
+    static inline const char *GetTimestamp()
     {
-        std::stringstream ss;
-        ss << file << ":" << line;
+        thread_local time_t cachedTime = -1;
+        thread_local char cached[32];
 
-        return ss.str();
-    }
-
-    static inline std::string ResetColor()
-    {
-        return TEXT_WHITE;
+        time_t now = time(nullptr);
+        if (now != cachedTime)
+        {
+            struct tm local;
+#if defined(IPLATFORM_WINDOWS)
+            localtime_s(&local, &now);
+#else
+            localtime_r(&now, &local);
+#endif
+            if (strftime(cached, sizeof(cached), "%X", &local) == 0)
+                cached[0] = '\0';
+            cachedTime = now;
+        }
+        return cached;
     }
 
-    template<typename F, typename L>
-    static inline std::string GetFullHeader(LogLevel lvl , bool colored, F file, L line)
+    // clang-format off
+    // Appends "[TITLE file:line time]\t" (file info only when `file` is set)
+    // without building any temporaries.
+    static inline void AppendHeader(std::string &out, LogLevel lvl, bool colored, const char *file, const char *line)
     {
-        std::stringstream ss;
-        ss << '[';
-
-        ss << GetTitle(lvl, colored) << ' ';
-        
-        ss << GetFileInfo(file, line) << ' ';
-        
-        ss << GetTimestamp();
-
+        out += '[';
         if(colored)
-            ss << ResetColor();
-
-        ss << "]\t";
+            out += GetTitleColor(lvl);
+        out += GetTitle(lvl);
+        out += ' ';
 
-        return ss.str();
-    }
-    
-    static inline std::string GetFullHeader(LogLevel lvl, bool colored)
-    {
-        std::stringstream ss;
-        ss << '[';
+        if(file && file[0] != '\0')
+        {
+            out += file;
+            out += ':';
+            out += line;
+            out += ' ';
+        }
 
-        ss << GetTitle(lvl, colored) << ' ';
-        
-        ss << GetTimestamp();
+        out += GetTimestamp();
 
         if(colored)
-            ss << ResetColor();
-
-        ss << "]\t";
+            out += TEXT_WHITE;
 
-        return ss.str();
+        out += "]\t";
     }
 
     public:
@@ -373,106 +491,132 @@ private:
     template<typename Arg, typename... Args>
     void Log(LogInfo info, Arg&& arg, Args&&... args)
     {
-        LOCK_MUTEX(mut);
-        std::stringstream out;
-
         if(info.level > Logger::priority)
             return;
 
         if(Logger::priority == LogLevel::INFO_ONLY && info.level < LogLevel::INFO)
             return;
 
-        switch(Logger::outType)
-        {
-        case OutputType::NONE:
+        if(Logger::outType == OutputType::NONE)
             return;
-        case OutputType::CONSOLE:
-            if(info.level != LogLevel::NONE)
-            {
-                if(info.filename != "")
-                    out << GetFullHeader(info.level, true, info.filename, info.linenumber);
-                else
-                    out << GetFullHeader(info.level, true);
-            }
 
-            out << std::forward<Arg>(arg);
-            using expander = int[];
-            (void) expander{0, (void(out << std::forward<Args>(args)), 0)...};
+        // Formatted once into this thread's buffer, whatever the output type.
+        ThreadBuffer &tb = GetThreadBuffer();
+        tb.buf.str.clear();
 
-            std::cout << out.str();
-            break;
+        if(info.level != LogLevel::NONE)
+            AppendHeader(tb.buf.str, info.level, true, info.filename, info.linenumber);
 
-        case OutputType::FILE:
-            if(info.level != LogLevel::NONE)
-            {
-                if(info.filename != "")
-                    out << GetFullHeader(info.level, true, info.filename, info.linenumber);
-                else
-                    out << GetFullHeader(info.level, true);
-            }
+        tb.out << std::forward<Arg>(arg);
+        using expander = int[];
+        (void) expander{0, (void(tb.out << std::forward<Args>(args)), 0)...};
 
-            out << std::forward<Arg>(arg);
-            using expander = int[];
-            (void) expander{0, (void(out << std::forward<Args>(args)), 0)...};
+        if(asyncLog)
+        {
+            asyncLog->Push(tb.buf.str);
+            return;
+        }
 
-            if(fileStream.is_open())
-                fileStream << out.str();
-            else
-            {
-                fileStream.open(filePath, std::ios::app);
-                fileStream << out.str();
-            }
+        LOCK_MUTEX(mut);
+        Emit(tb.buf.str);
+    }
 
+    // Writes a formatted message to the current outputs. Callers hold `mut`
+    // or are the async writer thread.
+    static inline void Emit(const std::string &text)
+    {
+        switch(Logger::outType)
+        {
+        case OutputType::NONE:
+            break;
+        case OutputType::CONSOLE:
+            std::cout << text;
+            break;
+        case OutputType::FILE:
+            if(!fileStream.is_open())
+                fileStream.open(filePath, std::ios::app);
+            fileStream << text;
             break;
-
         case OutputType::ALL:
-            // console
-            if(info.level != LogLevel::NONE)
-            {
-                if(info.filename != "")
-                    out << GetFullHeader(info.level, true, info.filename, info.linenumber);
-                else
-                    out << GetFullHeader(info.level, true);
-            }
+            std::cout << text;
+            if(!fileStream.is_open())
+                fileStream.open(filePath, std::ios::app);
+            fileStream << text;
+            break;
+        }
+    }
 
-            out << std::forward<Arg>(arg);
-            using expander = int[];
-            (void) expander{0, (void(out << std::forward<Args>(args)), 0)...};
+    static inline void FlushStreams()
+    {
+        std::cout.flush();
+        if(fileStream.is_open())
+            fileStream.flush();
+    }
 
-            std::cout << out.str();
+    // Switches to asynchronous logging: Log() only formats and enqueues, and a
+    // background thread writes the messages out in batches.
+    static inline void EnableAsync(size_t capacity = LOG_ASYNC_CAPACITY)
+    {
+        LOCK_MUTEX(mut);
+        if(!asyncLog)
+            asyncLog = std::make_unique<AsyncLog>(capacity);
+    }
 
-            out.str(std::string());
+    // Drains the queue and stops the writer thread; Log() writes synchronously again.
+    // Like EnableAsync(), call it while no other thread is logging.
+    static inline void DisableAsync()
+    {
+        std::unique_ptr<AsyncLog> stopping;
+        {
+            LOCK_MUTEX(mut);
+            stopping = std::move(asyncLog);
+        }
+    }
 
-            // file
-            std::stringstream out; 
-            if(info.level != LogLevel::NONE)
-            {
-                if(info.filename != "")
-                    out << GetFullHeader(info.level, true, info.filename, info.linenumber);
-                else
-                    out << GetFullHeader(info.level, true);
-            }
+    static inline std::mutex &WriterMutex()
+    {
+        return mut;
+    }
 
-            out << std::forward<Arg>(arg);
-            using expander = int[];
-            (void) expander{0, (void(out << std::forward<Args>(args)), 0)...};
-            
-            if(fileStream.is_open())
-                fileStream << out.str();
-            else
-            {
-                fileStream.open(filePath, std::ios::app);
-                fileStream << out.str();
-            }
-            
-            break;
+    // Blocks until every message logged so far has been written and the streams flushed.
+    static inline void Flush()
+    {
+        if(asyncLog)
+            asyncLog->Flush();
+        else
+        {
+            LOCK_MUTEX(mut);
+            FlushStreams();
         }
     }
     // clang-format on
 
-    ~Logger()
+    // The file stays open across Logger instances; it is closed through
+    // ChangeOutputType() or when the program ends.
+    ~Logger() {}
+};
+
+// Defined after Logger because the writer thread calls into it.
+inline void AsyncLog::Run()
+{
+    std::string batch;
+    while (true)
     {
-        if (fileStream.is_open())
-            fileStream.close();
+        batch.clear();
+        size_t count = Drain(batch);
+        if (count == 0)
+        {
+            if (!m_running.load(std::memory_order_acquire))
+                return;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            continue;
+        }
+
+        {
+            LOCK_MUTEX(Logger::WriterMutex());
+            Logger::Emit(batch);
+            Logger::FlushStreams();
+        }
+        m_written.fetch_add(count, std::memory_order_release);
     }
-};
\ No newline at end of file
+}
@@ -0,0 +1,757 @@
+#pragma once
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+#include "core/defines.h"
+#include "core/arena.hpp"
+#include "core/error.hpp"
+#include "core/nodes.hpp"
+#include "process.hpp"
+
+#if defined(IPLATFORM_LINUX)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Binary snapshot of a parsed program, written by --emit-ast-bin as
+// <name>.yzast and compiled like a source file. The file is four flat,
+// 8-byte aligned sections after a fixed header, and everything in it refers
+// to everything else by index, never by address, so it is used where it is
+// mapped:
+//
+//   nodes    AstNode[], children always before their parents
+//   lists    u32[], each list a length and then that many words
+//   symbols  AstSymbol[], every distinct name and literal text once
+//   strings  the symbol text, each NUL-terminated
+//
+// Numbers are little-endian, as on every target. A node shared by
+// hash-consing is written once, so the snapshot of a DAG is a DAG.
+
+static constexpr char AST_MAGIC[8] = {'Y', 'Z', 'A', 'S', 'T', 0, 0, 0};
+static constexpr u32 AST_VERSION = 1;
+static constexpr u32 AST_NONE = ~0u;
+
+// The term and operator kinds are in the order of NodeTerm's and NodeBinExpr's
+// variants, and the statements in NodeStmt's.
+enum class AstKind : u8
+{
+    INT_LIT,
+    IDENT,
+    PAREN,
+    CALL,
+    INDEX,
+    ADD,
+    MUL,
+    DIV,
+    SUB,
+    LESS,
+    EXIT,
+    LET,
+    OUT,
+    BLOCK,
+    ASSIGN,
+    WHILE,
+    FN,
+    RETURN,
+    EXPR,
+    ARRAY,
+    INDEX_ASSIGN,
+    COUNT
+};
+
+enum AstFlags : u8
+{
+    AST_MUTABLE = 1, // LET declared with `var`
+    AST_BODY = 2,    // BLOCK that is the body of a WHILE or FN, not a statement
+};
+
+// One node in 24 bytes. `symbol` and `symbol_offset` are the node's name or
+// literal text and where that token is; `a` and `b` are:
+//
+//   PAREN, INDEX      a: expr                   LET, ASSIGN, RETURN,
+//   CALL              a: list of args           EXIT, OUT, EXPR   a: expr
+//   ADD .. LESS       a: lhs, b: rhs            WHILE             a: cond, b: body
+//   INDEX_ASSIGN      a: index, b: expr         BLOCK             a: list of stmts
+//   ARRAY             a: init or AST_NONE, b: list of the size token
+//   FN                a: list of the parameter tokens, b: body
+//
+// A list of tokens has two words per token, its symbol and its offset.
+struct AstNode
+{
+    u8 kind;
+    u8 flags;
+    u8 size; // bytes of a LET's type
+    u8 reserved;
+    u32 offset;
+    u32 symbol;
+    u32 symbol_offset;
+    u32 a;
+    u32 b;
+};
+static_assert(sizeof(AstNode) == 24, "AstNode is part of the file format");
+
+struct AstSymbol
+{
+    u32 offset; // in the strings section
+    u32 size;
+};
+
+// Where a section starts, from the start of the file, and how many entries it has.
+struct AstSection
+{
+    u32 offset;
+    u32 count;
+};
+
+struct AstHeader
+{
+    char magic[8];
+    u32 version;
+    u32 flags; // AST_SHARED
+    u64 source_hash;
+    u64 file_bytes;
+    u32 source_bytes;
+    u32 root; // list of the top-level statements
+    AstSection nodes;
+    AstSection lists;
+    AstSection symbols;
+    AstSection strings;
+};
+static_assert(sizeof(AstHeader) == 72, "AstHeader is part of the file format");
+
+static constexpr u32 AST_SHARED = 1; // some nodes have more than one parent
+
+inline bool is_snapshot_path(const std::string &path)
+{
+    return path.size() > 6 && path.compare(path.size() - 6, 6, ".yzast") == 0;
+}
+
+// Flattens statements into a snapshot. Statements can be added in batches, as
+// the pipeline parses them; the nodes they share with earlier batches are
+// written only once.
+class AstWriter
+{
+public:
+    inline void add(const std::vector<NodeStmt *> &stmts)
+    {
+        for (const NodeStmt *stmt : stmts)
+            m_root.push_back(write_stmt(stmt));
+    }
+
+    [[nodiscard]] std::string finish(u64 source_hash, u32 source_bytes) const
+    {
+        AstHeader header{};
+        memcpy(header.magic, AST_MAGIC, sizeof(AST_MAGIC));
+        header.version = AST_VERSION;
+        header.flags = m_shared ? AST_SHARED : 0;
+        header.source_hash = source_hash;
+        header.source_bytes = source_bytes;
+        header.root = static_cast<u32>(m_lists.size());
+
+        size_t end = sizeof(AstHeader);
+        auto section = [&end](size_t count, size_t size)
+        {
+            AstSection placed{static_cast<u32>(end), static_cast<u32>(count)};
+            end = (end + count * size + 7) & ~size_t(7);
+            return placed;
+        };
+        header.nodes = section(m_nodes.size(), sizeof(AstNode));
+        header.lists = section(m_lists.size() + 1 + m_root.size(), sizeof(u32));
+        header.symbols = section(m_symbols.size(), sizeof(AstSymbol));
+        header.strings = section(m_strings.size(), 1);
+        header.file_bytes = end;
+
+        std::string out(end, '\0');
+        u32 root_size = static_cast<u32>(m_root.size());
+        char *lists = out.data() + header.lists.offset;
+        memcpy(out.data(), &header, sizeof(header));
+        memcpy(out.data() + header.nodes.offset, m_nodes.data(), m_nodes.size() * sizeof(AstNode));
+        memcpy(lists, m_lists.data(), m_lists.size() * sizeof(u32));
+        memcpy(lists + m_lists.size() * sizeof(u32), &root_size, sizeof(u32));
+        memcpy(lists + (m_lists.size() + 1) * sizeof(u32), m_root.data(), m_root.size() * sizeof(u32));
+        memcpy(out.data() + header.symbols.offset, m_symbols.data(), m_symbols.size() * sizeof(AstSymbol));
+        memcpy(out.data() + header.strings.offset, m_strings.data(), m_strings.size());
+        return out;
+    }
+
+    // Written under a unique name and renamed into place, so a compiler
+    // that has the old snapshot mapped keeps reading the old one.
+    inline void write(const std::string &path, u64 source_hash, u32 source_bytes) const
+    {
+        std::string bytes = finish(source_hash, source_bytes);
+        TempFile temp(unique_path(path, ""));
+        {
+            std::ofstream file(temp.path(), std::ios::binary);
+            file.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+            if (!file.good())
+                throw CompileError("Could not write file: " + path);
+        }
+        std::error_code ec;
+        std::filesystem::rename(temp.path(), path, ec);
+        if (ec)
+            throw CompileError("Could not write file: " + path);
+    }
+
+private:
+    u32 push(AstKind kind, u32 offset, const Token *token = nullptr, u32 a = AST_NONE, u32 b = AST_NONE)
+    {
+        AstNode node{};
+        node.kind = static_cast<u8>(kind);
+        node.offset = offset;
+        node.symbol = token ? symbol(token->value.value()) : AST_NONE;
+        node.symbol_offset = token ? token->offset : 0;
+        node.a = a;
+        node.b = b;
+        m_nodes.push_back(node);
+        return static_cast<u32>(m_nodes.size() - 1);
+    }
+
+    u32 symbol(const std::string &text)
+    {
+        auto [it, inserted] = m_symbol_index.try_emplace(text, static_cast<u32>(m_symbols.size()));
+        if (inserted)
+        {
+            m_symbols.push_back({static_cast<u32>(m_strings.size()), static_cast<u32>(text.size())});
+            m_strings.append(text);
+            m_strings.push_back('\0');
+        }
+        return it->second;
+    }
+
+    u32 list(const std::vector<u32> &words)
+    {
+        m_lists.push_back(static_cast<u32>(words.size()));
+        m_lists.insert(m_lists.end(), words.begin(), words.end());
+        return static_cast<u32>(m_lists.size() - words.size() - 1);
+    }
+
+    u32 token_list(const std::vector<Token> &tokens)
+    {
+        std::vector<u32> words;
+        for (const Token &token : tokens)
+        {
+            words.push_back(symbol(token.value.value()));
+            words.push_back(token.offset);
+        }
+        return list(words);
+    }
+
+    u32 write_expr(const NodeExpr *expr)
+    {
+        auto found = m_exprs.find(expr);
+        if (found != m_exprs.end())
+        {
+            m_shared = true;
+            return found->second;
+        }
+        u32 index;
+        if (auto term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            const NodeTerm *t = *term;
+            if (auto lit = std::get_if<NodeTermIntLit *>(&t->var))
+                index = push(AstKind::INT_LIT, expr->offset, &(*lit)->int_lit);
+            else if (auto ident = std::get_if<NodeTermIdent *>(&t->var))
+                index = push(AstKind::IDENT, expr->offset, &(*ident)->ident);
+            else if (auto paren = std::get_if<NodeTermParen *>(&t->var))
+                index = push(AstKind::PAREN, expr->offset, nullptr, write_expr((*paren)->expr));
+            else if (auto call = std::get_if<NodeTermCall *>(&t->var))
+            {
+                std::vector<u32> args;
+                for (const NodeExpr *arg : (*call)->args)
+                    args.push_back(write_expr(arg));
+                index = push(AstKind::CALL, expr->offset, &(*call)->ident, list(args));
+            }
+            else
+            {
+                const NodeTermIndex *element = std::get<NodeTermIndex *>(t->var);
+                index = push(AstKind::INDEX, expr->offset, &element->ident, write_expr(element->index));
+            }
+        }
+        else
+        {
+            const NodeBinExpr *bin = std::get<NodeBinExpr *>(expr->var);
+            AstKind kind = static_cast<AstKind>(static_cast<size_t>(AstKind::ADD) + bin->var.index());
+            std::visit([&](const auto *op)
+                       {
+                u32 lhs = write_expr(op->lhs);
+                u32 rhs = write_expr(op->rhs);
+                index = push(kind, expr->offset, nullptr, lhs, rhs); },
+                       bin->var);
+        }
+        m_exprs.emplace(expr, index);
+        return index;
+    }
+
+    u32 write_block(const NodeStmtBlock *block, u32 offset, bool body)
+    {
+        std::vector<u32> stmts;
+        for (const NodeStmt *stmt : block->stmts)
+            stmts.push_back(write_stmt(stmt));
+        u32 index = push(AstKind::BLOCK, offset, nullptr, list(stmts));
+        if (body)
+            m_nodes[index].flags = AST_BODY;
+        return index;
+    }
+
+    u32 write_stmt(const NodeStmt *stmt)
+    {
+        u32 at = stmt->offset;
+        if (auto exit = std::get_if<NodeStmtExit *>(&stmt->var))
+            return push(AstKind::EXIT, at, nullptr, write_expr((*exit)->expr));
+        if (auto let = std::get_if<NodeStmtLet *>(&stmt->var))
+        {
+            u32 index = push(AstKind::LET, at, &(*let)->ident, write_expr((*let)->expr));
+            m_nodes[index].flags = (*let)->is_mutable ? AST_MUTABLE : 0;
+            m_nodes[index].size = (*let)->size;
+            return index;
+        }
+        if (auto print = std::get_if<NodeStmtOut *>(&stmt->var))
+            return push(AstKind::OUT, at, nullptr, write_expr((*print)->expr));
+        if (auto block = std::get_if<NodeStmtBlock *>(&stmt->var))
+            return write_block(*block, at, false);
+        if (auto assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+            return push(AstKind::ASSIGN, at, &(*assign)->ident, write_expr((*assign)->expr));
+        if (auto loop = std::get_if<NodeStmtWhile *>(&stmt->var))
+        {
+            u32 cond = write_expr((*loop)->cond);
+            return push(AstKind::WHILE, at, nullptr, cond, write_block((*loop)->body, 0, true));
+        }
+        if (auto fn = std::get_if<NodeStmtFn *>(&stmt->var))
+        {
+            u32 params = token_list((*fn)->params);
+            return push(AstKind::FN, at, &(*fn)->ident, params, write_block((*fn)->body, 0, true));
+        }
+        if (auto ret = std::get_if<NodeStmtReturn *>(&stmt->var))
+            return push(AstKind::RETURN, at, nullptr, write_expr((*ret)->expr));
+        if (auto expr_stmt = std::get_if<NodeStmtExpr *>(&stmt->var))
+            return push(AstKind::EXPR, at, nullptr, write_expr((*expr_stmt)->expr));
+        if (auto array = std::get_if<NodeStmtArray *>(&stmt->var))
+        {
+            u32 init = (*array)->init ? write_expr((*array)->init) : AST_NONE;
+            return push(AstKind::ARRAY, at, &(*array)->ident, init, token_list({(*array)->size}));
+        }
+        const NodeStmtIndexAssign *element = std::get<NodeStmtIndexAssign *>(stmt->var);
+        u32 index = write_expr(element->index);
+        return push(AstKind::INDEX_ASSIGN, at, &element->ident, index, write_expr(element->expr));
+    }
+
+    std::vector<AstNode> m_nodes;
+    std::vector<u32> m_lists;
+    std::vector<AstSymbol> m_symbols;
+    std::string m_strings;
+    std::unordered_map<std::string, u32> m_symbol_index;
+    std::unordered_map<const NodeExpr *, u32> m_exprs;
+    std::vector<u32> m_root;
+    bool m_shared = false;
+};
+
+// The words of one list in a mapped snapshot.
+struct AstList
+{
+    const u32 *items;
+    u32 size;
+
+    [[nodiscard]] const u32 *begin() const
+    {
+        return items;
+    }
+
+    [[nodiscard]] const u32 *end() const
+    {
+        return items + size;
+    }
+};
+
+// A snapshot mapped read-only. Opening it checks the header and that every
+// section lies inside the file, and nothing more: nodes, lists and symbols
+// are read in place, and each accessor checks the index it is given. link()
+// builds the Generator's nodes from it in one pass over the node table.
+class AstSnapshot
+{
+public:
+    inline explicit AstSnapshot(std::string path) : m_path(std::move(path))
+    {
+#if defined(IPLATFORM_LINUX)
+        int fd = open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw CompileError("Could not open file: " + m_path);
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            throw CompileError("Could not open file: " + m_path);
+        }
+        m_size = static_cast<size_t>(st.st_size);
+        void *mapped = m_size ? mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (mapped == MAP_FAILED)
+            throw corrupt();
+        m_data = static_cast<const char *>(mapped);
+#elif defined(IPLATFORM_WINDOWS)
+        std::ifstream file(m_path, std::ios::binary);
+        if (!file.is_open())
+            throw CompileError("Could not open file: " + m_path);
+        file.seekg(0, std::ios::end);
+        m_size = static_cast<size_t>(file.tellg());
+        file.seekg(0, std::ios::beg);
+        m_buffer.reset(new u64[(m_size + 7) / 8]);
+        file.read(reinterpret_cast<char *>(m_buffer.get()), static_cast<std::streamsize>(m_size));
+        m_data = reinterpret_cast<const char *>(m_buffer.get());
+#endif
+        check_header();
+    }
+
+    inline AstSnapshot(const AstSnapshot &other) = delete;
+
+    inline AstSnapshot operator=(const AstSnapshot &other) = delete;
+
+    inline ~AstSnapshot()
+    {
+#if defined(IPLATFORM_LINUX)
+        if (m_data)
+            munmap(const_cast<char *>(m_data), m_size);
+#endif
+    }
+
+    [[nodiscard]] const AstHeader &header() const
+    {
+        return *reinterpret_cast<const AstHeader *>(m_data);
+    }
+
+    // The whole file, for the compile cache's key.
+    [[nodiscard]] std::string_view bytes() const
+    {
+        return {m_data, m_size};
+    }
+
+    [[nodiscard]] u32 node_count() const
+    {
+        return header().nodes.count;
+    }
+
+    [[nodiscard]] const AstNode &node(u32 index) const
+    {
+        if (index >= header().nodes.count)
+            throw corrupt();
+        return reinterpret_cast<const AstNode *>(m_data + header().nodes.offset)[index];
+    }
+
+    [[nodiscard]] AstList list(u32 index) const
+    {
+        const u32 *words = reinterpret_cast<const u32 *>(m_data + header().lists.offset);
+        u32 count = header().lists.count;
+        if (index >= count || words[index] > count - index - 1)
+            throw corrupt();
+        return {words + index + 1, words[index]};
+    }
+
+    [[nodiscard]] std::string_view symbol(u32 index) const
+    {
+        if (index >= header().symbols.count)
+            throw corrupt();
+        const AstSymbol &sym = reinterpret_cast<const AstSymbol *>(m_data + header().symbols.offset)[index];
+        if (sym.offset >= header().strings.count || sym.size >= header().strings.count - sym.offset)
+            throw corrupt();
+        return {m_data + header().strings.offset + sym.offset, sym.size};
+    }
+
+    // The program as the parser would have built it, in `alloc`. Every child
+    // is checked to come before its parent and to be of the kind its place
+    // calls for, so a damaged file is an error and never a cycle.
+    [[nodiscard]] NodeProg link(ArenaAlloc &alloc) const
+    {
+        std::vector<void *> linked(node_count());
+        for (u32 i = 0; i < linked.size(); i++)
+        {
+            const AstNode &node = this->node(i);
+            switch (static_cast<AstKind>(node.kind))
+            {
+            case AstKind::INT_LIT:
+            {
+                auto lit = alloc.alloc<NodeTermIntLit>();
+                lit->int_lit = token(TokenType::_int_lit, node.symbol, node.symbol_offset);
+                linked[i] = term(alloc, lit, node.offset);
+                break;
+            }
+            case AstKind::IDENT:
+            {
+                auto ident = alloc.alloc<NodeTermIdent>();
+                ident->ident = token(TokenType::ident, node.symbol, node.symbol_offset);
+                linked[i] = term(alloc, ident, node.offset);
+                break;
+            }
+            case AstKind::PAREN:
+            {
+                auto paren = alloc.alloc<NodeTermParen>();
+                paren->expr = expr(linked, i, node.a);
+                linked[i] = term(alloc, paren, node.offset);
+                break;
+            }
+            case AstKind::CALL:
+            {
+                auto call = alloc.alloc<NodeTermCall>();
+                call->ident = token(TokenType::ident, node.symbol, node.symbol_offset);
+                for (u32 arg : list(node.a))
+                    call->args.push_back(expr(linked, i, arg));
+                linked[i] = term(alloc, call, node.offset);
+                break;
+            }
+            case AstKind::INDEX:
+            {
+                auto element = alloc.alloc<NodeTermIndex>();
+                element->ident = token(TokenType::ident, node.symbol, node.symbol_offset);
+                element->index = expr(linked, i, node.a);
+                linked[i] = term(alloc, element, node.offset);
+                break;
+            }
+            case AstKind::ADD:
+                linked[i] = bin<NodeBinExprAdd>(alloc, linked, i, node);
+                break;
+            case AstKind::MUL:
+                linked[i] = bin<NodeBinExprMulti>(alloc, linked, i, node);
+                break;
+            case AstKind::DIV:
+                linked[i] = bin<NodeBinExprDiv>(alloc, linked, i, node);
+                break;
+            case AstKind::SUB:
+                linked[i] = bin<NodeBinExprSub>(alloc, linked, i, node);
+                break;
+            case AstKind::LESS:
+                linked[i] = bin<NodeBinExprLess>(alloc, linked, i, node);
+                break;
+            case AstKind::EXIT:
+            {
+                auto exit = alloc.alloc<NodeStmtExit>();
+                exit->expr = expr(linked, i, node.a);
+                linked[i] = stmt(alloc, exit, node.offset);
+                break;
+            }
+            case AstKind::LET:
+            {
+                if (node.size != 1 && node.size != 2 && node.size != 4 && node.size != 8)
+                    throw corrupt();
+                auto let = alloc.alloc<NodeStmtLet>();
+                let->ident = token(TokenType::ident, node.symbol, node.symbol_offset);
+                let->expr = expr(linked, i, node.a);
+                let->is_mutable = node.flags & AST_MUTABLE;
+                let->size = node.size;
+                linked[i] = stmt(alloc, let, node.offset);
+                break;
+            }
+            case AstKind::OUT:
+            {
+                auto print = alloc.alloc<NodeStmtOut>();
+                print->expr = expr(linked, i, node.a);
+                linked[i] = stmt(alloc, print, node.offset);
+                break;
+            }
+            case AstKind::BLOCK:
+            {
+                auto block = alloc.alloc<NodeStmtBlock>();
+                for (u32 inner : list(node.a))
+                    block->stmts.push_back(stmt(linked, i, inner));
+                linked[i] = node.flags & AST_BODY ? static_cast<void *>(block) : stmt(alloc, block, node.offset);
+                break;
+            }
+            case AstKind::ASSIGN:
+            {
+                auto assign = alloc.alloc<NodeStmtAssign>();
+                assign->ident = token(TokenType::ident, node.symbol, node.symbol_offset);
+                assign->expr = expr(linked, i, node.a);
+                linked[i] = stmt(alloc, assign, node.offset);
+                break;
+            }
+            case AstKind::WHILE:
+            {
+                auto loop = alloc.alloc<NodeStmtWhile>();
+                loop->cond = expr(linked, i, node.a);
+                loop->body = body(linked, i, node.b);
+                linked[i] = stmt(alloc, loop, node.offset);
+                break;
+            }
+            case AstKind::FN:
+            {
+                auto fn = alloc.alloc<NodeStmtFn>();
+                fn->ident = token(TokenType::ident, node.symbol, node.symbol_offset);
+                AstList params = list(node.a);
+                if (params.size % 2 != 0)
+                    throw corrupt();
+                for (u32 p = 0; p < params.size; p += 2)
+                    fn->params.push_back(token(TokenType::ident, params.items[p], params.items[p + 1]));
+                fn->body = body(linked, i, node.b);
+                linked[i] = stmt(alloc, fn, node.offset);
+                break;
+            }
+            case AstKind::RETURN:
+            {
+                auto ret = alloc.alloc<NodeStmtReturn>();
+                ret->expr = expr(linked, i, node.a);
+                linked[i] = stmt(alloc, ret, node.offset);
+                break;
+            }
+            case AstKind::EXPR:
+            {
+                auto expr_stmt = alloc.alloc<NodeStmtExpr>();
+                expr_stmt->expr = expr(linked, i, node.a);
+                linked[i] = stmt(alloc, expr_stmt, node.offset);
+                break;
+            }
+            case AstKind::ARRAY:
+            {
+                auto array = alloc.alloc<NodeStmtArray>();
+                array->ident = token(TokenType::ident, node.symbol, node.symbol_offset);
+                AstList size = list(node.b);
+                if (size.size != 2)
+                    throw corrupt();
+                array->size = token(TokenType::_int_lit, size.items[0], size.items[1]);
+                array->init = node.a == AST_NONE ? nullptr : expr(linked, i, node.a);
+                linked[i] = stmt(alloc, array, node.offset);
+                break;
+            }
+            case AstKind::INDEX_ASSIGN:
+            {
+                auto element = alloc.alloc<NodeStmtIndexAssign>();
+                element->ident = token(TokenType::ident, node.symbol, node.symbol_offset);
+                element->index = expr(linked, i, node.a);
+                element->expr = expr(linked, i, node.b);
+                linked[i] = stmt(alloc, element, node.offset);
+                break;
+            }
+            default:
+                throw corrupt();
+            }
+        }
+
+        NodeProg prog;
+        u32 all = node_count();
+        for (u32 top : list(header().root))
+            prog.stmts.push_back(stmt(linked, all, top));
+        return prog;
+    }
+
+private:
+    CompileError corrupt() const
+    {
+        return CompileError("Not a valid AST snapshot: " + m_path);
+    }
+
+    void check_header() const
+    {
+        if (m_size < sizeof(AstHeader) || memcmp(m_data, AST_MAGIC, sizeof(AST_MAGIC)) != 0)
+            throw corrupt();
+        const AstHeader &h = header();
+        if (h.version != AST_VERSION)
+            throw CompileError(m_path + " is an AST snapshot of version " + std::to_string(h.version) +
+                               ", this compiler reads version " + std::to_string(AST_VERSION));
+        if (h.file_bytes != m_size)
+            throw corrupt();
+        auto inside = [this](const AstSection &section, size_t size)
+        {
+            return section.offset % 8 == 0 && section.offset >= sizeof(AstHeader) &&
+                   section.offset <= m_size && section.count <= (m_size - section.offset) / size;
+        };
+        if (!inside(h.nodes, sizeof(AstNode)) || !inside(h.lists, sizeof(u32)) ||
+            !inside(h.symbols, sizeof(AstSymbol)) || !inside(h.strings, 1))
+            throw corrupt();
+    }
+
+    // The text is checked to be what the tokenizer makes a token of this
+    // type from, since the generator takes that for granted.
+    Token token(TokenType type, u32 symbol, u32 offset) const
+    {
+        std::string_view text = this->symbol(symbol);
+        bool valid = !text.empty();
+        for (size_t i = 0; i < text.size() && valid; i++)
+        {
+            unsigned char c = static_cast<unsigned char>(text[i]);
+            valid = type == TokenType::_int_lit ? std::isdigit(c) : i == 0 ? std::isalpha(c) : std::isalnum(c);
+        }
+        if (!valid)
+            throw corrupt();
+        return Token{type, offset, std::string(text)};
+    }
+
+    // `child` of node `parent`, checked to be built already and to be of the
+    // kind asked for.
+    const AstNode &child(u32 parent, u32 index) const
+    {
+        if (index >= parent)
+            throw corrupt();
+        return node(index);
+    }
+
+    NodeExpr *expr(const std::vector<void *> &linked, u32 parent, u32 index) const
+    {
+        if (child(parent, index).kind > static_cast<u8>(AstKind::LESS))
+            throw corrupt();
+        return static_cast<NodeExpr *>(linked[index]);
+    }
+
+    NodeStmt *stmt(const std::vector<void *> &linked, u32 parent, u32 index) const
+    {
+        const AstNode &node = child(parent, index);
+        if (node.kind < static_cast<u8>(AstKind::EXIT) ||
+            (node.kind == static_cast<u8>(AstKind::BLOCK) && (node.flags & AST_BODY)))
+            throw corrupt();
+        return static_cast<NodeStmt *>(linked[index]);
+    }
+
+    NodeStmtBlock *body(const std::vector<void *> &linked, u32 parent, u32 index) const
+    {
+        const AstNode &node = child(parent, index);
+        if (node.kind != static_cast<u8>(AstKind::BLOCK) || !(node.flags & AST_BODY))
+            throw corrupt();
+        return static_cast<NodeStmtBlock *>(linked[index]);
+    }
+
+    template <typename T>
+    static NodeExpr *term(ArenaAlloc &alloc, T *leaf, u32 offset)
+    {
+        auto term = alloc.alloc<NodeTerm>();
+        term->var = leaf;
+        term->offset = offset;
+        auto expr = alloc.alloc<NodeExpr>();
+        expr->var = term;
+        expr->offset = offset;
+        return expr;
+    }
+
+    template <typename T>
+    NodeExpr *bin(ArenaAlloc &alloc, const std::vector<void *> &linked, u32 index, const AstNode &node) const
+    {
+        auto op = alloc.alloc<T>();
+        op->lhs = expr(linked, index, node.a);
+        op->rhs = expr(linked, index, node.b);
+        auto bin_expr = alloc.alloc<NodeBinExpr>();
+        bin_expr->var = op;
+        auto expr = alloc.alloc<NodeExpr>();
+        expr->var = bin_expr;
+        expr->offset = node.offset;
+        return expr;
+    }
+
+    template <typename T>
+    static NodeStmt *stmt(ArenaAlloc &alloc, T *inner, u32 offset)
+    {
+        auto stmt = alloc.alloc<NodeStmt>();
+        stmt->var = inner;
+        stmt->offset = offset;
+        return stmt;
+    }
+
+    std::string m_path;
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+#if defined(IPLATFORM_WINDOWS)
+    std::unique_ptr<u64[]> m_buffer;
+#endif
+};
@@ -0,0 +1,213 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "core/defines.h"
+#include "core/hash.hpp"
+
+#if defined(IPLATFORM_WINDOWS)
+#include <process.h>
+#define YZ_GETPID _getpid
+#else
+#include <unistd.h>
+#define YZ_GETPID getpid
+#endif
+
+namespace fs = std::filesystem;
+
+// On-disk cache of compiler outputs addressed by the hash of everything that
+// can change them: source bytes, compiler version, target and codegen flags.
+// Every entry is a pair of files, <key>.s and <key>.bin. Files are published
+// with a rename so concurrent compilers sharing a directory never see a
+// partial entry, and the least recently used entries are evicted (hits bump
+// the mtime) once the directory grows past its size budget.
+class CompileCache
+{
+public:
+    static constexpr u64 DEFAULT_MAX_BYTES = 256ull * 1024 * 1024;
+
+    inline explicit CompileCache(std::string dir, u64 max_bytes = DEFAULT_MAX_BYTES)
+        : m_dir(std::move(dir)), m_max_bytes(max_bytes)
+    {
+        std::error_code ec;
+        fs::create_directories(m_dir, ec);
+        m_size = scan_size();
+    }
+
+    // $YZ_CACHE_DIR, then $XDG_CACHE_HOME/yzlang, then ~/.cache/yzlang.
+    static std::string default_dir()
+    {
+        if (const char *dir = getenv("YZ_CACHE_DIR"))
+            return dir;
+        if (const char *xdg = getenv("XDG_CACHE_HOME"))
+            return std::string(xdg) + "/yzlang";
+#if defined(IPLATFORM_WINDOWS)
+        if (const char *local = getenv("LOCALAPPDATA"))
+            return std::string(local) + "/yzlang/cache";
+#endif
+        if (const char *home = getenv("HOME"))
+            return std::string(home) + "/.cache/yzlang";
+        return ".yzcache";
+    }
+
+    [[nodiscard]] static std::string key(std::string_view source, const std::string &target,
+                                         const std::string &flags)
+    {
+        char header[64];
+        snprintf(header, sizeof(header), "yz %d.%d.%d|", VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+        std::string material = header + target + "|" + flags + "|";
+
+        u64 h = xxh64(source.data(), source.size(), xxh64(material.data(), material.size()));
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(h));
+        return hex;
+    }
+
+    // Copies a cached entry to `asm_path`/`exe_path`. Returns false on a miss.
+    bool fetch(const std::string &key, const std::string &asm_path, const std::string &exe_path)
+    {
+        std::error_code ec;
+        fs::path cached_asm = entry(key, ".s");
+        fs::path cached_exe = entry(key, ".bin");
+
+        if (!fs::exists(cached_exe, ec) || !fs::exists(cached_asm, ec) ||
+            !publish(cached_asm, asm_path) || !publish(cached_exe, exe_path))
+        {
+            m_misses++;
+            return false;
+        }
+
+        auto now = fs::file_time_type::clock::now();
+        fs::last_write_time(cached_asm, now, ec);
+        fs::last_write_time(cached_exe, now, ec);
+        m_hits++;
+        return true;
+    }
+
+    void store(const std::string &key, const std::string &asm_path, const std::string &exe_path)
+    {
+        if (!publish(asm_path, entry(key, ".s")) || !publish(exe_path, entry(key, ".bin")))
+            return;
+        m_stores++;
+
+        std::error_code asm_ec, exe_ec;
+        u64 added = fs::file_size(entry(key, ".s"), asm_ec) + fs::file_size(entry(key, ".bin"), exe_ec);
+        if (asm_ec || exe_ec || (m_size += added) > m_max_bytes)
+            evict();
+    }
+
+    [[nodiscard]] u64 hits() const { return m_hits; }
+    [[nodiscard]] u64 misses() const { return m_misses; }
+    [[nodiscard]] u64 stores() const { return m_stores; }
+    [[nodiscard]] u64 evictions() const { return m_evictions; }
+
+private:
+    [[nodiscard]] fs::path entry(const std::string &key, const char *ext) const
+    {
+        return fs::path(m_dir) / (key + ext);
+    }
+
+    // Copies `from` next to `to` under a unique name, then renames it over `to`.
+    static bool publish(const fs::path &from, const fs::path &to)
+    {
+        static std::atomic<u64> counter{0};
+        std::error_code ec;
+        fs::path tmp = to;
+        tmp += ".tmp." + std::to_string(YZ_GETPID()) + "." +
+               std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) + "." +
+               std::to_string(counter++);
+
+        if (!fs::copy_file(from, tmp, fs::copy_options::overwrite_existing, ec))
+            return false;
+        fs::permissions(tmp, fs::status(from, ec).permissions(), ec);
+        fs::rename(tmp, to, ec);
+        if (ec)
+        {
+            fs::remove(tmp, ec);
+            return false;
+        }
+        return true;
+    }
+
+    u64 scan_size() const
+    {
+        u64 total = 0;
+        std::error_code ec;
+        for (const auto &file : fs::directory_iterator(m_dir, ec))
+            if (file.is_regular_file(ec))
+                total += file.file_size(ec);
+        return total;
+    }
+
+    // Drops whole entries, oldest first, until the cache is at 3/4 of its budget.
+    void evict()
+    {
+        std::lock_guard<std::mutex> lock(m_evict_mut);
+
+        struct Entry
+        {
+            std::string key;
+            fs::file_time_type time;
+            u64 bytes = 0;
+        };
+        std::unordered_map<std::string, Entry> by_key;
+        u64 total = 0;
+        std::error_code ec;
+
+        for (const auto &file : fs::directory_iterator(m_dir, ec))
+        {
+            if (!file.is_regular_file(ec))
+                continue;
+            u64 bytes = file.file_size(ec);
+            total += bytes;
+
+            fs::path path = file.path();
+            if (path.extension() != ".s" && path.extension() != ".bin")
+                continue;
+            std::string key = path.stem().string();
+            auto time = file.last_write_time(ec);
+
+            auto it = by_key.try_emplace(key, Entry{.key = key, .time = time}).first;
+            it->second.time = std::max(it->second.time, time);
+            it->second.bytes += bytes;
+        }
+
+        std::vector<Entry> entries;
+        entries.reserve(by_key.size());
+        for (auto &[key, e] : by_key)
+            entries.push_back(std::move(e));
+
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+                  { return a.time < b.time; });
+
+        u64 target = m_max_bytes / 4 * 3;
+        for (const Entry &e : entries)
+        {
+            if (total <= target)
+                break;
+            fs::remove(entry(e.key, ".s"), ec);
+            fs::remove(entry(e.key, ".bin"), ec);
+            total -= e.bytes;
+            m_evictions++;
+        }
+        m_size = total;
+    }
+
+    const std::string m_dir;
+    const u64 m_max_bytes;
+    std::atomic<u64> m_size{0};
+    std::atomic<u64> m_hits{0};
+    std::atomic<u64> m_misses{0};
+    std::atomic<u64> m_stores{0};
+    std::atomic<u64> m_evictions{0};
+    std::mutex m_evict_mut;
+};
@@ -1,29 +1,73 @@
 #pragma once
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
-#include <iostream>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "core/error.hpp"
 
+// Bump allocator. It starts with one block of the given size and chains more
+// blocks of that size when a file needs them; objects never move.
 class ArenaAlloc
 {
 public:
     inline explicit ArenaAlloc(size_t bytes)
-        : m_size(bytes)
+        : m_block_size(bytes), m_size(bytes)
     {
         m_buff = static_cast<std::byte *>(malloc(m_size));
+        if (!m_buff)
+            throw CompileError("Arena allocator out of memory!");
         m_offset = m_buff;
+        m_blocks.push_back(m_buff);
     }
 
+    // Returns a value-initialized T. Destructors of non-trivial types run on
+    // reset() or when the arena goes away.
     template <typename T>
     inline T *alloc()
     {
-        if (m_offset + sizeof(T) > m_buff + m_size)
+        uintptr_t addr = reinterpret_cast<uintptr_t>(m_offset);
+        std::byte *offset = m_offset + ((alignof(T) - addr % alignof(T)) % alignof(T));
+        if (offset + sizeof(T) > m_buff + m_size)
         {
-            std::cerr << "Arena allocator out of memory!" << std::endl;
-            exit(EXIT_FAILURE);
+            grow(sizeof(T) + alignof(T));
+            return alloc<T>();
         }
-        void *offset = m_offset;
-        m_offset += sizeof(T);
-        return static_cast<T *>(offset);
+        m_offset = offset + sizeof(T);
+        m_allocations++;
+        T *obj = new (offset) T();
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            m_dtors.push_back({[](void *p)
+                               { static_cast<T *>(p)->~T(); },
+                               obj});
+        return obj;
+    }
+
+    // Releases every allocation at once so the buffer can be reused for the next file.
+    inline void reset()
+    {
+        destroy();
+        for (size_t i = 1; i < m_blocks.size(); i++)
+            free(m_blocks[i]);
+        m_blocks.resize(1);
+        m_buff = m_blocks[0];
+        m_size = m_block_size;
+        m_offset = m_buff;
+        m_used_before = 0;
+        m_allocations = 0;
+    }
+
+    [[nodiscard]] inline size_t bytes_used() const
+    {
+        return m_used_before + static_cast<size_t>(m_offset - m_buff);
+    }
+
+    [[nodiscard]] inline size_t allocations() const
+    {
+        return m_allocations;
     }
 
     inline ArenaAlloc(const ArenaAlloc &other) = delete;
@@ -32,11 +76,38 @@ public:
 
     inline ~ArenaAlloc()
     {
-        free(m_buff);
+        destroy();
+        for (std::byte *block : m_blocks)
+            free(block);
     }
 
 private:
+    inline void grow(size_t min_bytes)
+    {
+        size_t size = std::max(m_block_size, min_bytes);
+        auto *block = static_cast<std::byte *>(malloc(size));
+        if (!block)
+            throw CompileError("Arena allocator out of memory!");
+        m_used_before += static_cast<size_t>(m_offset - m_buff);
+        m_blocks.push_back(block);
+        m_buff = block;
+        m_size = size;
+        m_offset = block;
+    }
+
+    inline void destroy()
+    {
+        for (auto it = m_dtors.rbegin(); it != m_dtors.rend(); ++it)
+            it->first(it->second);
+        m_dtors.clear();
+    }
+
+    const size_t m_block_size;
     size_t m_size;
     std::byte *m_buff;
     std::byte *m_offset;
-};
\ No newline at end of file
+    size_t m_used_before = 0; // bytes in the blocks before m_buff
+    std::vector<std::byte *> m_blocks;
+    size_t m_allocations = 0;
+    std::vector<std::pair<void (*)(void *), void *>> m_dtors;
+};
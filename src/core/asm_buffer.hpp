@@ -0,0 +1,238 @@
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "core/defines.h"
+
+#if defined(IPLATFORM_LINUX)
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
+#endif
+
+// Append-only text buffer the generator writes assembly into. Text goes into
+// chunks that never move, so appending never copies what is already there,
+// and the chunks are handed to writev as they are. Chunks start small, since
+// the generator keeps a buffer per function and call site, and double up to
+// MAX_CHUNK. Numbers are formatted with std::to_chars.
+class AsmBuffer
+{
+public:
+    static constexpr size_t FIRST_CHUNK = 4 * 1024;
+    static constexpr size_t MAX_CHUNK = 1024 * 1024;
+
+    inline AsmBuffer() = default;
+
+    inline AsmBuffer(AsmBuffer &&other) noexcept
+    {
+        swap(other);
+    }
+
+    inline AsmBuffer &operator=(AsmBuffer &&other) noexcept
+    {
+        if (this != &other)
+        {
+            clear();
+            swap(other);
+        }
+        return *this;
+    }
+
+    inline AsmBuffer(const AsmBuffer &other) = delete;
+
+    inline AsmBuffer operator=(const AsmBuffer &other) = delete;
+
+    inline void append(const char *data, size_t size)
+    {
+        if (size <= static_cast<size_t>(m_end - m_cur))
+        {
+            memcpy(m_cur, data, size);
+            m_cur += size;
+            return;
+        }
+        append_slow(data, size);
+    }
+
+    inline AsmBuffer &operator<<(std::string_view text)
+    {
+        append(text.data(), text.size());
+        return *this;
+    }
+
+    inline AsmBuffer &operator<<(const char *text)
+    {
+        return *this << std::string_view(text);
+    }
+
+    inline AsmBuffer &operator<<(const std::string &text)
+    {
+        return *this << std::string_view(text);
+    }
+
+    inline AsmBuffer &operator<<(char c)
+    {
+        if (m_cur == m_end)
+            next_chunk();
+        *m_cur++ = c;
+        return *this;
+    }
+
+    // Integers print as decimal, and single bytes as the character, as
+    // an ostream would print them.
+    template <typename T, typename = std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>>
+    inline AsmBuffer &operator<<(T value)
+    {
+        if constexpr (sizeof(T) == 1)
+            return *this << static_cast<char>(value);
+        else
+        {
+            char digits[24];
+            char *end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+            append(digits, static_cast<size_t>(end - digits));
+            return *this;
+        }
+    }
+
+    inline AsmBuffer &operator<<(const AsmBuffer &other)
+    {
+        for (size_t i = 0; i < other.m_chunks.size(); i++)
+            append(other.m_chunks[i].data.get(), other.chunk_size(i));
+        return *this;
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return m_chunks.empty() ? 0 : m_full_bytes + chunk_size(m_chunks.size() - 1);
+    }
+
+    [[nodiscard]] bool empty() const
+    {
+        return size() == 0;
+    }
+
+    // Copies the text into one string, for callers that need it contiguous.
+    [[nodiscard]] std::string str() const
+    {
+        std::string out;
+        out.reserve(size());
+        for (size_t i = 0; i < m_chunks.size(); i++)
+            out.append(m_chunks[i].data.get(), chunk_size(i));
+        return out;
+    }
+
+    // Drops the text past `size` if all of it is in the last chunk, which
+    // is where text just appended is unless it started a chunk. Returns
+    // whether it did.
+    inline bool truncate(size_t size)
+    {
+        if (m_chunks.empty() || size < m_full_bytes || size > this->size())
+            return false;
+        m_cur = m_chunks.back().data.get() + (size - m_full_bytes);
+        return true;
+    }
+
+    inline void clear()
+    {
+        m_chunks.clear();
+        m_full_bytes = 0;
+        m_cur = m_end = nullptr;
+    }
+
+    inline void swap(AsmBuffer &other) noexcept
+    {
+        m_chunks.swap(other.m_chunks);
+        std::swap(m_full_bytes, other.m_full_bytes);
+        std::swap(m_cur, other.m_cur);
+        std::swap(m_end, other.m_end);
+    }
+
+#if defined(IPLATFORM_LINUX)
+    // Writes the whole text to `fd`, up to IOV_MAX chunks per writev. Returns
+    // false with errno set if a write fails.
+    [[nodiscard]] bool write_to(int fd) const
+    {
+        std::vector<iovec> iov;
+        for (size_t i = 0; i < m_chunks.size(); i++)
+        {
+            if (chunk_size(i) > 0)
+                iov.push_back({m_chunks[i].data.get(), chunk_size(i)});
+        }
+        for (size_t first = 0; first < iov.size();)
+        {
+            int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+            ssize_t n = writev(fd, iov.data() + first, count);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            // Skip what went out; a short write leaves the rest of a chunk.
+            size_t written = static_cast<size_t>(n);
+            while (first < iov.size() && written >= iov[first].iov_len)
+                written -= iov[first++].iov_len;
+            if (written > 0)
+            {
+                iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + written;
+                iov[first].iov_len -= written;
+            }
+        }
+        return true;
+    }
+#endif
+
+    inline void write_to(std::ostream &out) const
+    {
+        for (size_t i = 0; i < m_chunks.size(); i++)
+            out.write(m_chunks[i].data.get(), static_cast<std::streamsize>(chunk_size(i)));
+    }
+
+private:
+    struct Chunk
+    {
+        std::unique_ptr<char[]> data;
+        size_t size = 0; // set once the chunk is full; the last one ends at m_cur
+    };
+
+    [[nodiscard]] size_t chunk_size(size_t i) const
+    {
+        return i + 1 == m_chunks.size() ? static_cast<size_t>(m_cur - m_chunks[i].data.get()) : m_chunks[i].size;
+    }
+
+    void next_chunk()
+    {
+        if (!m_chunks.empty())
+        {
+            m_chunks.back().size = chunk_size(m_chunks.size() - 1);
+            m_full_bytes += m_chunks.back().size;
+        }
+        size_t capacity = std::min(FIRST_CHUNK << std::min<size_t>(m_chunks.size(), 8), MAX_CHUNK);
+        m_chunks.push_back({std::unique_ptr<char[]>(new char[capacity])});
+        m_cur = m_chunks.back().data.get();
+        m_end = m_cur + capacity;
+    }
+
+    void append_slow(const char *data, size_t size)
+    {
+        while (size > 0)
+        {
+            if (m_cur == m_end)
+                next_chunk();
+            size_t n = std::min(size, static_cast<size_t>(m_end - m_cur));
+            memcpy(m_cur, data, n);
+            m_cur += n;
+            data += n;
+            size -= n;
+        }
+    }
+
+    std::vector<Chunk> m_chunks;
+    size_t m_full_bytes = 0; // in every chunk but the last
+    char *m_cur = nullptr;
+    char *m_end = nullptr;
+};
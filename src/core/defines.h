@@ -8,6 +8,13 @@
 
 #define YZDEBUG true
 
+// Compile-time log level (LOG_* in YLogger/logger.h): log calls above it are
+// removed together with their arguments. The default keeps everything up to
+// LDEBUG; build with -DYZ_LOG_LEVEL=5 to get the parser/generator traces.
+#ifndef YZ_LOG_LEVEL
+    #define YZ_LOG_LEVEL 4
+#endif
+
 // unsigned int types
 typedef unsigned char u8;
 typedef unsigned short u16;
@@ -0,0 +1,56 @@
+#pragma once
+#include <stdexcept>
+#include <string>
+#include "core/defines.h"
+
+// Raised by the tokenizer, parser and generator when a source file cannot be
+// compiled. The driver reports it against the file and moves on to the next one.
+// An error may carry the byte offset it was found at; the driver turns that
+// into a line and column only when it reports the error.
+class CompileError : public std::runtime_error
+{
+public:
+    static constexpr u32 NO_OFFSET = ~0u;
+
+    inline explicit CompileError(const std::string &msg, u32 offset = NO_OFFSET)
+        : std::runtime_error(msg), m_offset(offset)
+    {
+    }
+
+    [[nodiscard]] bool has_offset() const
+    {
+        return m_offset != NO_OFFSET;
+    }
+
+    [[nodiscard]] u32 offset() const
+    {
+        return m_offset;
+    }
+
+    inline void set_offset(u32 offset)
+    {
+        m_offset = offset;
+    }
+
+    // "line:column" and the source line with a caret under the column.
+    inline void set_location(std::string location, std::string excerpt)
+    {
+        m_location = std::move(location);
+        m_excerpt = std::move(excerpt);
+    }
+
+    [[nodiscard]] const std::string &location() const
+    {
+        return m_location;
+    }
+
+    [[nodiscard]] const std::string &excerpt() const
+    {
+        return m_excerpt;
+    }
+
+private:
+    u32 m_offset;
+    std::string m_location;
+    std::string m_excerpt;
+};
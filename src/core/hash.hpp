@@ -0,0 +1,107 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include "core/defines.h"
+
+// XXH64 (https://github.com/Cyan4973/xxHash), used for content addressing.
+namespace hash_detail
+{
+    constexpr u64 P1 = 11400714785074694791ULL;
+    constexpr u64 P2 = 14029467366897019727ULL;
+    constexpr u64 P3 = 1609587929392839161ULL;
+    constexpr u64 P4 = 9650029242287828579ULL;
+    constexpr u64 P5 = 2870177450012600261ULL;
+
+    inline u64 rotl(u64 x, int r)
+    {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    inline u64 read64(const u8 *p)
+    {
+        u64 v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline u32 read32(const u8 *p)
+    {
+        u32 v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline u64 round(u64 acc, u64 input)
+    {
+        acc += input * P2;
+        acc = rotl(acc, 31);
+        return acc * P1;
+    }
+
+    inline u64 merge(u64 acc, u64 val)
+    {
+        acc ^= round(0, val);
+        return acc * P1 + P4;
+    }
+}
+
+inline u64 xxh64(const void *data, size_t len, u64 seed = 0)
+{
+    using namespace hash_detail;
+    const u8 *p = static_cast<const u8 *>(data);
+    const u8 *end = p + len;
+    u64 h;
+
+    if (len >= 32)
+    {
+        u64 v1 = seed + P1 + P2;
+        u64 v2 = seed + P2;
+        u64 v3 = seed;
+        u64 v4 = seed - P1;
+        const u8 *limit = end - 32;
+        do
+        {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    }
+    else
+    {
+        h = seed + P5;
+    }
+
+    h += static_cast<u64>(len);
+
+    for (; p + 8 <= end; p += 8)
+    {
+        h ^= round(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= static_cast<u64>(read32(p)) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h ^= static_cast<u64>(*p) * P5;
+        h = rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include "core/defines.h"
+
+// The expression nodes a parser has built, by structure, so that structurally
+// identical subtrees are built once and shared and the AST becomes a DAG.
+// Children are interned before their parents, so two subtrees are identical
+// exactly when their roots have the same kind and the same child pointers, or
+// the same text for a leaf. Nodes are immutable once built and live in the
+// parser's arena, which has to outlive the table.
+class HashCons
+{
+public:
+    struct Key
+    {
+        char kind;
+        const void *lhs;
+        const void *rhs;
+        std::string text;
+
+        bool operator==(const Key &other) const
+        {
+            return kind == other.kind && lhs == other.lhs && rhs == other.rhs && text == other.text;
+        }
+    };
+
+    // The node with `key`, or the one `make` builds, which is remembered.
+    template <typename T, typename Make>
+    T *intern(Key key, Make &&make)
+    {
+        auto it = m_nodes.find(key);
+        if (it != m_nodes.end())
+        {
+            m_shared++;
+            return static_cast<T *>(it->second);
+        }
+        T *node = make();
+        m_nodes.emplace(std::move(key), node);
+        return node;
+    }
+
+    // Room for `nodes` entries without rehashing. Grows at least twofold, so
+    // reserving a little more for every pipeline batch stays linear.
+    void reserve(size_t nodes)
+    {
+        if (nodes > m_nodes.bucket_count() * m_nodes.max_load_factor())
+            m_nodes.reserve(std::max(nodes, 2 * m_nodes.size()));
+    }
+
+    // Lookups that returned an existing node instead of building a new one.
+    [[nodiscard]] u64 shared() const
+    {
+        return m_shared;
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return m_nodes.size();
+    }
+
+private:
+    struct KeyHash
+    {
+        size_t operator()(const Key &key) const
+        {
+            // Node addresses share their low bits, so they are mixed in with
+            // a multiply instead of being added as they are.
+            u64 hash = key.text.empty() ? 0 : std::hash<std::string>()(key.text);
+            hash = (hash ^ reinterpret_cast<uintptr_t>(key.lhs)) * 0x9e3779b97f4a7c15ULL;
+            hash = (hash ^ reinterpret_cast<uintptr_t>(key.rhs)) * 0xff51afd7ed558ccdULL;
+            hash ^= static_cast<u64>(key.kind);
+            return static_cast<size_t>(hash ^ (hash >> 32));
+        }
+    };
+
+    std::unordered_map<Key, void *, KeyHash> m_nodes;
+    u64 m_shared = 0;
+};
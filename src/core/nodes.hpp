@@ -3,6 +3,7 @@
 #include <vector>
 #include <optional>
 #include <string>
+#include "core/defines.h"
 
 enum class TokenType
 {
@@ -20,12 +21,24 @@ enum class TokenType
     div,
     out,
     open_curly,
-    close_curly
-};
-
+    close_curly,
+    var,
+    _while,
+    lt,
+    fn,
+    _return,
+    comma,
+    open_bracket,
+    close_bracket,
+    colon
+};
+
+// `offset` is the byte offset of the token's first character in the source.
+// It fits in the padding after `type`, so it costs nothing per token.
 struct Token
 {
     TokenType type;
+    u32 offset = 0;
     std::optional<std::string> value;
 };
 
@@ -46,6 +59,20 @@ struct NodeTermParen
     NodeExpr *expr;
 };
 
+// name(args...)
+struct NodeTermCall
+{
+    Token ident;
+    std::vector<NodeExpr *> args;
+};
+
+// name[index]
+struct NodeTermIndex
+{
+    Token ident;
+    NodeExpr *index;
+};
+
 struct NodeBinExprAdd
 {
     NodeExpr *lhs;
@@ -70,19 +97,31 @@ struct NodeBinExprDiv
     NodeExpr *rhs;
 };
 
+// lhs < rhs, evaluates to 1 or 0
+struct NodeBinExprLess
+{
+    NodeExpr *lhs;
+    NodeExpr *rhs;
+};
+
 struct NodeBinExpr
 {
-    std::variant<NodeBinExprAdd *, NodeBinExprMulti *, NodeBinExprDiv *, NodeBinExprSub *> var;
+    std::variant<NodeBinExprAdd *, NodeBinExprMulti *, NodeBinExprDiv *, NodeBinExprSub *, NodeBinExprLess *> var;
 };
 
+// The wrappers below carry the byte offset where the node starts, in the
+// padding after the variant's index. A node shared by hash-consing keeps the
+// offset of its first occurrence.
 struct NodeTerm
 {
-    std::variant<NodeTermIntLit *, NodeTermIdent *, NodeTermParen *> var;
+    std::variant<NodeTermIntLit *, NodeTermIdent *, NodeTermParen *, NodeTermCall *, NodeTermIndex *> var;
+    u32 offset = 0;
 };
 
 struct NodeExpr
 {
     std::variant<NodeTerm *, NodeBinExpr *> var;
+    u32 offset = 0;
 };
 
 struct NodeStmtExit
@@ -90,10 +129,34 @@ struct NodeStmtExit
     NodeExpr *expr;
 };
 
+// val name = expr; or val name: i8|i16|i32|i64 = expr; (and the same with `var`)
 struct NodeStmtLet
 {
     Token ident;
     NodeExpr *expr;
+    bool is_mutable = false; // declared with `var`
+    u8 size = 8;             // bytes of its type; a sized value wraps around on every store
+};
+
+struct NodeStmtAssign
+{
+    Token ident;
+    NodeExpr *expr;
+};
+
+// var name[size]; or var name[size] = expr; with expr applied element-wise
+struct NodeStmtArray
+{
+    Token ident;
+    Token size;
+    NodeExpr *init = nullptr;
+};
+
+struct NodeStmtIndexAssign
+{
+    Token ident;
+    NodeExpr *index;
+    NodeExpr *expr;
 };
 
 struct NodeStmtOut
@@ -108,14 +171,47 @@ struct NodeStmtBlock
     std::vector<NodeStmt *> stmts;
 };
 
+struct NodeStmtWhile
+{
+    NodeExpr *cond;
+    NodeStmtBlock *body;
+};
+
+// fn name(params...) { body }, only at the top level
+struct NodeStmtFn
+{
+    Token ident;
+    std::vector<Token> params;
+    NodeStmtBlock *body;
+};
+
+struct NodeStmtReturn
+{
+    NodeExpr *expr;
+};
+
+// An expression evaluated for its side effects, e.g. `show(x);`
+struct NodeStmtExpr
+{
+    NodeExpr *expr;
+};
+
 struct NodeStmt
 {
     std::variant<
         NodeStmtExit *,
         NodeStmtLet *,
         NodeStmtOut *,
-        NodeStmtBlock *>
+        NodeStmtBlock *,
+        NodeStmtAssign *,
+        NodeStmtWhile *,
+        NodeStmtFn *,
+        NodeStmtReturn *,
+        NodeStmtExpr *,
+        NodeStmtArray *,
+        NodeStmtIndexAssign *>
         var;
+    u32 offset = 0;
 };
 
 struct NodeProg
@@ -127,12 +223,14 @@ std::optional<int> bin_prec(TokenType type)
 {
     switch (type)
     {
+    case TokenType::lt:
+        return 0;
     case TokenType::sub:
     case TokenType::plus:
-        return 0;
+        return 1;
     case TokenType::div:
     case TokenType::star:
-        return 1;
+        return 2;
     default:
         return {};
     }
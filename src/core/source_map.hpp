@@ -0,0 +1,71 @@
+#pragma once
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "core/defines.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// 1-based; the column counts bytes.
+struct SourceLocation
+{
+    u32 line;
+    u32 column;
+};
+
+// Line starts of a source file. Nothing tracks lines while compiling: tokens
+// and nodes keep only a byte offset, and this table is built from the source
+// when a diagnostic has to be printed.
+class LineMap
+{
+public:
+    inline explicit LineMap(const std::string &src)
+        : m_src(src)
+    {
+        m_starts.push_back(0);
+        size_t i = 0;
+#if defined(__SSE2__)
+        // 16 bytes per compare; the set bits of the mask are the newlines.
+        const __m128i newline = _mm_set1_epi8('\n');
+        for (; i + 16 <= src.size(); i += 16)
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src.data() + i));
+            u32 mask = static_cast<u32>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+            for (; mask; mask &= mask - 1)
+                m_starts.push_back(static_cast<u32>(i + __builtin_ctz(mask) + 1));
+        }
+#endif
+        for (; i < src.size(); i++)
+        {
+            if (src[i] == '\n')
+                m_starts.push_back(static_cast<u32>(i + 1));
+        }
+    }
+
+    [[nodiscard]] SourceLocation locate(u32 offset) const
+    {
+        size_t line = std::upper_bound(m_starts.begin(), m_starts.end(), offset) - m_starts.begin();
+        return {static_cast<u32>(line), offset - m_starts[line - 1] + 1};
+    }
+
+    // The text of a line, without its line break.
+    [[nodiscard]] std::string line_text(u32 line) const
+    {
+        size_t start = m_starts[line - 1];
+        size_t end = line < m_starts.size() ? m_starts[line] - 1 : m_src.size();
+        if (end > start && m_src[end - 1] == '\r')
+            end--;
+        return m_src.substr(start, end - start);
+    }
+
+    [[nodiscard]] size_t lines() const
+    {
+        return m_starts.size();
+    }
+
+private:
+    const std::string &m_src;
+    std::vector<u32> m_starts;
+};
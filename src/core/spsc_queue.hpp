@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <utility>
+
+// Bounded single-producer/single-consumer ring. push() waits while the ring is
+// full and pop() while it is empty, so a fast stage is throttled by a slow one
+// instead of buffering its whole output. Each side caches the other side's
+// index and only re-reads it when the ring looks full (or empty).
+template <typename T>
+class SpscQueue
+{
+public:
+    inline explicit SpscQueue(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        m_mask = size - 1;
+        m_slots = std::make_unique<T[]>(size);
+    }
+
+    inline SpscQueue(const SpscQueue &other) = delete;
+
+    inline SpscQueue operator=(const SpscQueue &other) = delete;
+
+    inline void push(T value)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        while (tail - m_head_cache > m_mask)
+        {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail - m_head_cache > m_mask)
+                std::this_thread::yield();
+        }
+        m_slots[tail & m_mask] = std::move(value);
+        m_tail.store(tail + 1, std::memory_order_release);
+    }
+
+    inline T pop()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        while (head == m_tail_cache)
+        {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tail_cache)
+                std::this_thread::yield();
+        }
+        T value = std::move(m_slots[head & m_mask]);
+        m_head.store(head + 1, std::memory_order_release);
+        return value;
+    }
+
+private:
+    std::unique_ptr<T[]> m_slots;
+    size_t m_mask = 0;
+    alignas(64) std::atomic<size_t> m_head{0};
+    size_t m_tail_cache = 0; // consumer side
+    alignas(64) std::atomic<size_t> m_tail{0};
+    size_t m_head_cache = 0; // producer side
+};
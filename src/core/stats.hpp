@@ -0,0 +1,305 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "core/defines.h"
+
+#if defined(IPLATFORM_LINUX)
+#include <sys/resource.h>
+#endif
+
+struct PhaseTime
+{
+    const char *name;
+    u64 ns;
+};
+
+// What one optimization pass cost and did. `runs` counts the files it ran on
+// and `changed` the ones it changed anything in; `changes` is in the pass's
+// own unit (operators folded, calls inlined, ...).
+struct PassStat
+{
+    const char *name;
+    const char *unit;
+    bool timed; // false for a pass whose work is spread over all of code generation
+    u64 ns = 0;
+    u64 runs = 0;
+    u64 changed = 0;
+    u64 changes = 0;
+};
+
+// What one compile cost: wall time per pipeline stage plus the sizes that
+// explain it.
+struct CompileStats
+{
+    std::string input;
+    bool cache_hit = false;
+    std::vector<PhaseTime> phases;
+    std::vector<PassStat> passes; // in pipeline order
+    u64 source_bytes = 0;
+    u64 tokens = 0;
+    u64 nodes = 0;
+    u64 arena_bytes = 0;
+    u64 asm_bytes = 0;
+    u64 ops_removed = 0; // operators value numbering did not have to emit
+    bool precomputed = false; // -O3 ran the program and emitted its output
+    u64 eval_steps = 0;
+    u64 run_user_ns = 0;  // the compiled program's own CPU time, from wait4
+    u64 run_sys_ns = 0;
+    u64 run_max_rss_kib = 0;
+
+    inline void add_phase(const char *name, u64 ns)
+    {
+        for (PhaseTime &phase : phases)
+        {
+            if (strcmp(phase.name, name) == 0)
+            {
+                phase.ns += ns;
+                return;
+            }
+        }
+        phases.push_back({name, ns});
+    }
+
+    inline void add_pass(const PassStat &stat)
+    {
+        for (PassStat &pass : passes)
+        {
+            if (strcmp(pass.name, stat.name) == 0)
+            {
+                pass.ns += stat.ns;
+                pass.runs += stat.runs;
+                pass.changed += stat.changed;
+                pass.changes += stat.changes;
+                return;
+            }
+        }
+        passes.push_back(stat);
+    }
+
+    [[nodiscard]] inline u64 total_ns() const
+    {
+        u64 total = 0;
+        for (const PhaseTime &phase : phases)
+            total += phase.ns;
+        return total;
+    }
+};
+
+// Adds the lifetime of the timer to `name` in `stats`, using the monotonic clock.
+class PhaseTimer
+{
+public:
+    inline PhaseTimer(CompileStats &stats, const char *name)
+        : m_stats(stats), m_name(name), m_start(std::chrono::steady_clock::now())
+    {
+    }
+
+    inline PhaseTimer(const PhaseTimer &other) = delete;
+
+    inline PhaseTimer operator=(const PhaseTimer &other) = delete;
+
+    inline ~PhaseTimer()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - m_start;
+        m_stats.add_phase(m_name, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+private:
+    CompileStats &m_stats;
+    const char *m_name;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+struct ResourceUsage
+{
+    u64 peak_rss_kib = 0;          // the compiler itself
+    u64 children_peak_rss_kib = 0; // largest of nasm, ld and the program
+};
+
+inline ResourceUsage resource_usage()
+{
+    ResourceUsage usage;
+#if defined(IPLATFORM_LINUX)
+    rusage ru{};
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        usage.peak_rss_kib = static_cast<u64>(ru.ru_maxrss);
+    if (getrusage(RUSAGE_CHILDREN, &ru) == 0)
+        usage.children_peak_rss_kib = static_cast<u64>(ru.ru_maxrss);
+#endif
+    return usage;
+}
+
+// Sums the per-file numbers phase by phase, keeping first-seen phase order.
+inline CompileStats total_stats(const std::vector<CompileStats> &all)
+{
+    CompileStats total;
+    total.input = "total";
+    for (const CompileStats &stats : all)
+    {
+        for (const PhaseTime &phase : stats.phases)
+            total.add_phase(phase.name, phase.ns);
+        for (const PassStat &pass : stats.passes)
+            total.add_pass(pass);
+        total.source_bytes += stats.source_bytes;
+        total.tokens += stats.tokens;
+        total.nodes += stats.nodes;
+        total.arena_bytes += stats.arena_bytes;
+        total.asm_bytes += stats.asm_bytes;
+        total.ops_removed += stats.ops_removed;
+        total.eval_steps += stats.eval_steps;
+        total.run_user_ns += stats.run_user_ns;
+        total.run_sys_ns += stats.run_sys_ns;
+        total.run_max_rss_kib = std::max(total.run_max_rss_kib, stats.run_max_rss_kib);
+    }
+    return total;
+}
+
+inline std::string stats_table(const std::vector<CompileStats> &all, const ResourceUsage &usage)
+{
+    CompileStats total = total_stats(all);
+    size_t hits = 0;
+    size_t precomputed = 0;
+    for (const CompileStats &stats : all)
+    {
+        hits += stats.cache_hit;
+        precomputed += stats.precomputed;
+    }
+
+    std::string out;
+    char line[128];
+    snprintf(line, sizeof(line), "%-12s %12s %8s\n", "phase", "time (ms)", "share");
+    out += line;
+    u64 total_ns = total.total_ns();
+    for (const PhaseTime &phase : total.phases)
+    {
+        snprintf(line, sizeof(line), "%-12s %12.3f %7.1f%%\n", phase.name, phase.ns / 1e6,
+                 total_ns ? 100.0 * phase.ns / total_ns : 0.0);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%-12s %12.3f\n\n", "total", total_ns / 1e6);
+    out += line;
+
+    if (!total.passes.empty())
+    {
+        snprintf(line, sizeof(line), "%-12s %12s %9s %10s\n", "pass", "time (ms)", "changed", "changes");
+        out += line;
+        for (const PassStat &pass : total.passes)
+        {
+            char time[16] = "-";
+            if (pass.timed)
+                snprintf(time, sizeof(time), "%.3f", pass.ns / 1e6);
+            std::string changed = std::to_string(pass.changed) + "/" + std::to_string(pass.runs);
+            snprintf(line, sizeof(line), "%-12s %12s %9s %10llu  %s\n", pass.name, time, changed.c_str(),
+                     (unsigned long long)pass.changes, pass.unit);
+            out += line;
+        }
+        out += "\n";
+    }
+
+    snprintf(line, sizeof(line), "%-16s %llu (%llu cached)\n", "files", (unsigned long long)all.size(),
+             (unsigned long long)hits);
+    out += line;
+    snprintf(line, sizeof(line), "%-16s %llu\n", "source bytes", (unsigned long long)total.source_bytes);
+    out += line;
+    snprintf(line, sizeof(line), "%-16s %llu\n", "tokens", (unsigned long long)total.tokens);
+    out += line;
+    snprintf(line, sizeof(line), "%-16s %llu\n", "ast nodes", (unsigned long long)total.nodes);
+    out += line;
+    snprintf(line, sizeof(line), "%-16s %llu\n", "arena bytes", (unsigned long long)total.arena_bytes);
+    out += line;
+    snprintf(line, sizeof(line), "%-16s %llu\n", "asm bytes", (unsigned long long)total.asm_bytes);
+    out += line;
+    snprintf(line, sizeof(line), "%-16s %llu\n", "ops removed", (unsigned long long)total.ops_removed);
+    out += line;
+    if (precomputed)
+    {
+        snprintf(line, sizeof(line), "%-16s %llu (%llu steps)\n", "precomputed", (unsigned long long)precomputed,
+                 (unsigned long long)total.eval_steps);
+        out += line;
+    }
+    if (total.run_max_rss_kib)
+    {
+        snprintf(line, sizeof(line), "%-16s %.3f ms user, %.3f ms sys, %llu KiB max rss\n", "program",
+                 total.run_user_ns / 1e6, total.run_sys_ns / 1e6, (unsigned long long)total.run_max_rss_kib);
+        out += line;
+    }
+    snprintf(line, sizeof(line), "%-16s %llu KiB (tools %llu KiB)\n", "peak rss",
+             (unsigned long long)usage.peak_rss_kib, (unsigned long long)usage.children_peak_rss_kib);
+    out += line;
+    return out;
+}
+
+inline std::string json_escape(const std::string &str)
+{
+    std::string out;
+    for (char c : str)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+            continue;
+        }
+        out += c;
+    }
+    return out;
+}
+
+inline std::string stats_json(const CompileStats &stats)
+{
+    std::string out = "{\"input\": \"" + json_escape(stats.input) + "\"";
+    out += ", \"cache_hit\": ";
+    out += stats.cache_hit ? "true" : "false";
+    out += ", \"phases_ns\": {";
+    for (size_t i = 0; i < stats.phases.size(); i++)
+    {
+        out += i ? ", " : "";
+        out += "\"" + std::string(stats.phases[i].name) + "\": " + std::to_string(stats.phases[i].ns);
+    }
+    out += "}, \"total_ns\": " + std::to_string(stats.total_ns());
+    out += ", \"source_bytes\": " + std::to_string(stats.source_bytes);
+    out += ", \"tokens\": " + std::to_string(stats.tokens);
+    out += ", \"nodes\": " + std::to_string(stats.nodes);
+    out += ", \"arena_bytes\": " + std::to_string(stats.arena_bytes);
+    out += ", \"asm_bytes\": " + std::to_string(stats.asm_bytes);
+    out += ", \"ops_removed\": " + std::to_string(stats.ops_removed);
+    out += ", \"passes\": {";
+    for (size_t i = 0; i < stats.passes.size(); i++)
+    {
+        const PassStat &pass = stats.passes[i];
+        out += i ? ", " : "";
+        out += "\"" + std::string(pass.name) + "\": {\"ns\": " + std::to_string(pass.ns) +
+               ", \"runs\": " + std::to_string(pass.runs) + ", \"changed\": " + std::to_string(pass.changed) +
+               ", \"changes\": " + std::to_string(pass.changes) + "}";
+    }
+    out += "}";
+    out += ", \"precomputed\": ";
+    out += stats.precomputed ? "true" : "false";
+    out += ", \"eval_steps\": " + std::to_string(stats.eval_steps);
+    out += ", \"run_user_ns\": " + std::to_string(stats.run_user_ns);
+    out += ", \"run_sys_ns\": " + std::to_string(stats.run_sys_ns);
+    out += ", \"run_max_rss_kib\": " + std::to_string(stats.run_max_rss_kib);
+    out += "}";
+    return out;
+}
+
+inline std::string stats_json(const std::vector<CompileStats> &all, const ResourceUsage &usage)
+{
+    std::string out = "{\n  \"version\": \"" + std::to_string(VERSION_MAJOR) + "." +
+                      std::to_string(VERSION_MINOR) + "." + std::to_string(VERSION_PATCH) + "\",\n";
+    out += "  \"peak_rss_kib\": " + std::to_string(usage.peak_rss_kib) + ",\n";
+    out += "  \"children_peak_rss_kib\": " + std::to_string(usage.children_peak_rss_kib) + ",\n";
+    out += "  \"total\": " + stats_json(total_stats(all)) + ",\n";
+    out += "  \"files\": [";
+    for (size_t i = 0; i < all.size(); i++)
+        out += (i ? ",\n    " : "\n    ") + stats_json(all[i]);
+    out += all.empty() ? "]\n}\n" : "\n  ]\n}\n";
+    return out;
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker owns a deque: it takes its own work
+// from the back and, once that runs dry, steals from the front of the others.
+// Tasks receive the index of the worker running them so callers can keep
+// per-worker state (arenas, buffers) alive across tasks.
+class ThreadPool
+{
+public:
+    using Task = std::function<void(size_t worker)>;
+
+    inline explicit ThreadPool(size_t threads = std::thread::hardware_concurrency())
+    {
+        if (threads == 0)
+            threads = 1;
+
+        for (size_t i = 0; i < threads; i++)
+            m_queues.push_back(std::make_unique<Queue>());
+        for (size_t i = 0; i < threads; i++)
+            m_threads.emplace_back([this, i]
+                                   { run(i); });
+    }
+
+    inline ThreadPool(const ThreadPool &other) = delete;
+
+    inline ThreadPool operator=(const ThreadPool &other) = delete;
+
+    inline ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            m_stop = true;
+        }
+        m_work_cv.notify_all();
+        for (auto &thread : m_threads)
+            thread.join();
+    }
+
+    [[nodiscard]] inline size_t size() const
+    {
+        return m_threads.size();
+    }
+
+    inline void submit(Task task)
+    {
+        Queue &queue = *m_queues[m_next++ % m_queues.size()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mut);
+            queue.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mut);
+            m_queued++;
+            m_pending++;
+        }
+        m_work_cv.notify_one();
+    }
+
+    // Blocks until every submitted task has finished.
+    inline void wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mut);
+        m_done_cv.wait(lock, [this]
+                       { return m_pending == 0; });
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mut;
+        std::deque<Task> tasks;
+    };
+
+    inline bool take(size_t worker, Task &task)
+    {
+        {
+            Queue &own = *m_queues[worker];
+            std::lock_guard<std::mutex> lock(own.mut);
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < m_queues.size(); i++)
+        {
+            Queue &victim = *m_queues[(worker + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mut);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline void run(size_t worker)
+    {
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mut);
+                m_work_cv.wait(lock, [this]
+                               { return m_stop || m_queued > 0; });
+                if (m_queued == 0)
+                    return;
+                m_queued--;
+            }
+
+            // A queued task is reserved for us above, so one of the deques holds it.
+            Task task;
+            while (!take(worker, task))
+                std::this_thread::yield();
+
+            task(worker);
+
+            {
+                std::lock_guard<std::mutex> lock(m_mut);
+                if (--m_pending == 0)
+                    m_done_cv.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_threads;
+    std::atomic<size_t> m_next{0};
+
+    std::mutex m_mut;
+    std::condition_variable m_work_cv;
+    std::condition_variable m_done_cv;
+    size_t m_queued = 0;
+    size_t m_pending = 0;
+    bool m_stop = false;
+};
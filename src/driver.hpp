@@ -0,0 +1,609 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "core/defines.h"
+#include "core/arena.hpp"
+#include "core/error.hpp"
+#include "core/source_map.hpp"
+#include "core/stats.hpp"
+#include "core/thread_pool.hpp"
+#include "YLogger/logger.h"
+#include "cache.hpp"
+#include "tokenizer.hpp"
+#include "parser.hpp"
+#include "ast_snapshot.hpp"
+#include "evaluator.hpp"
+#include "passes.hpp"
+#include "genration.hpp"
+#include "pipeline.hpp"
+#include "process.hpp"
+#include "profile.hpp"
+
+#if defined(IPLATFORM_LINUX)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(IPLATFORM_LINUX)
+constexpr const char *TARGET_NAME = "x86_64-linux-nasm";
+#elif defined(IPLATFORM_WINDOWS)
+constexpr const char *TARGET_NAME = "x86_64-windows-gas";
+#endif
+
+struct Options
+{
+    std::vector<std::string> inputs;
+    size_t jobs = 0; // 0 means one worker per core
+
+    bool cache = false;
+    std::string cache_dir;
+    u64 cache_max_bytes = CompileCache::DEFAULT_MAX_BYTES;
+
+    bool pipeline = false; // tokenize, parse and generate on three threads
+    bool hash_cons = false; // build identical expression subtrees once, making the AST a DAG
+    bool watch = false;     // stay resident, recompile and rerun inputs when they are saved
+    int opt_level = 1;             // -O0 to -O3 pick the passes, see PassSet::level()
+    std::optional<PassSet> passes; // --passes= runs these instead
+    bool verify_each = false;      // check the AST after every AST pass and the stack after every statement
+    EvalBudget eval_budget; // how far the evaluate pass runs a program before it is compiled as usual
+    bool inline_functions = true;
+    bool value_numbering = true;
+    bool cache_tos = false;  // --tos-cache: the top of the expression stack in registers
+    bool debug_info = false; // -g: DWARF line info and a local symbol per statement
+    bool profile = false;    // count statement executions into <name>.yzprof
+    bool report = false;     // print the hot statements of <name>.yzprof instead of compiling
+    bool emit_ast = false;   // --emit-ast-bin: write the parsed program to <name>.yzast
+    SimdLevel simd = SimdLevel::SSE2; // --simd=none|sse2|avx2|native
+
+    bool time_phases = false;
+    bool stats_json = false;
+    std::string stats_json_path; // empty means stderr
+
+    // The passes to run: the -O level's, or --passes=, less the ones a
+    // --no-* flag turns off and with --tos-cache added.
+    [[nodiscard]] PassSet pass_set() const
+    {
+        PassSet set = passes ? *passes : PassSet::level(opt_level);
+        if (!inline_functions)
+            set.remove(Pass::INLINE);
+        if (!value_numbering)
+            set.remove(Pass::CSE);
+        if (cache_tos)
+            set.add(Pass::TOS_CACHE);
+        if (simd == SimdLevel::NONE)
+            set.remove(Pass::SIMD);
+        return set;
+    }
+
+    [[nodiscard]] GenOptions gen_options() const
+    {
+        PassSet set = pass_set();
+        GenOptions gen;
+        gen.hoist_invariants = set.has(Pass::HOIST);
+        gen.loop_registers = set.has(Pass::LOOP_REGS);
+        gen.inline_functions = set.has(Pass::INLINE);
+        gen.value_numbering = set.has(Pass::CSE);
+        gen.cache_tos = set.has(Pass::TOS_CACHE);
+        gen.simd = set.has(Pass::SIMD) ? simd : SimdLevel::NONE;
+        gen.time_passes = time_phases || stats_json;
+        gen.verify = verify_each;
+        gen.shared_nodes = hash_cons;
+        return gen;
+    }
+
+    // Every option that changes the generated code, as part of the cache key.
+    [[nodiscard]] std::string codegen_flags() const
+    {
+        static const char *SIMD_NAMES[] = {"none", "sse2", "avx2"};
+        PassSet set = pass_set();
+        return "--passes=" + set.str() + (hash_cons ? " --hash-cons" : "") + (debug_info ? " -g" : "") +
+               (profile ? " --profile" : "") +
+               (set.has(Pass::EVALUATE) ? " --eval-steps=" + std::to_string(eval_budget.steps) +
+                                              " --eval-mem=" + std::to_string(eval_budget.bytes >> 20)
+                                        : "") +
+               " --simd=" + SIMD_NAMES[static_cast<int>(simd)];
+    }
+};
+
+// Files produced for one input: dir/name.yz -> dir/name.s, dir/name. On Linux
+// the object file is a temp file instead of dir/name.o. A program compiled
+// with --profile writes dir/name.yzprof when it exits. A dir/name.yzast input
+// makes the same files.
+struct OutputPaths
+{
+    std::string asm_path;
+    std::string obj_path; // Windows only
+    std::string exe_path;
+    std::string prof_path;
+    std::string ast_path; // --emit-ast-bin
+};
+
+inline OutputPaths output_paths(const std::string &input)
+{
+    std::string stem = input;
+    size_t slash = stem.find_last_of("/\\");
+    size_t dot = stem.find_last_of('.');
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+        stem.erase(dot);
+
+    OutputPaths paths;
+    paths.asm_path = stem + ".s";
+    paths.obj_path = stem + ".o";
+    paths.prof_path = stem + ".yzprof";
+    paths.ast_path = stem + ".yzast";
+#if defined(IPLATFORM_WINDOWS)
+    paths.exe_path = stem + ".exe";
+#else
+    paths.exe_path = stem;
+#endif
+    return paths;
+}
+
+inline std::string quote(const std::string &path)
+{
+    return "\"" + path + "\"";
+}
+
+// Command line that runs a freshly built executable from the current directory.
+inline std::string run_command(const std::string &exe_path)
+{
+#if defined(IPLATFORM_WINDOWS)
+    return quote(exe_path);
+#else
+    if (exe_path.find('/') == std::string::npos)
+        return quote("./" + exe_path);
+    return quote(exe_path);
+#endif
+}
+
+// Runs a freshly built executable and records its wall time as the "run"
+// phase, and its own CPU time and peak RSS, in `stats`.
+inline ProcessResult run_executable(const std::string &exe_path, CompileStats &stats)
+{
+#if defined(IPLATFORM_LINUX)
+    std::string path = exe_path.find('/') == std::string::npos ? "./" + exe_path : exe_path;
+#else
+    const std::string &path = exe_path;
+#endif
+    ChildProcess program({path});
+    ProcessResult result = program.wait();
+    stats.add_phase("run", result.wall_ns);
+    stats.run_user_ns += result.user_ns;
+    stats.run_sys_ns += result.sys_ns;
+    stats.run_max_rss_kib = std::max(stats.run_max_rss_kib, result.max_rss_kib);
+    return result;
+}
+
+// Per-worker compiler state. One context lives for a whole batch so the arena
+// and the source/token buffers are reused from one file to the next.
+class CompileContext
+{
+public:
+    inline explicit CompileContext(const Options &opts, CompileCache *cache = nullptr)
+        : m_opts(opts), m_cache(cache), m_alloc(1024 * 1024 * 4)
+    {
+    }
+
+    // Compiles `input` down to an executable, timing every stage into `stats`.
+    // Throws CompileError on failure.
+    OutputPaths compile(const std::string &input, CompileStats &stats)
+    {
+        stats.input = input;
+        // A snapshot is mapped instead of the source being read, and stands
+        // in for it in the cache key.
+        std::optional<AstSnapshot> snapshot;
+        if (is_snapshot_path(input))
+        {
+            PhaseTimer timer(stats, "map");
+            snapshot.emplace(input);
+            m_contents.clear();
+        }
+        else
+        {
+            PhaseTimer timer(stats, "read");
+            read_file(input);
+        }
+        if (snapshot && m_opts.debug_info)
+            throw CompileError("-g needs the source: compile the file " + input + " was written from");
+        stats.source_bytes = snapshot ? snapshot->header().source_bytes : m_contents.size();
+        std::string_view source = snapshot ? snapshot->bytes() : std::string_view(m_contents);
+        OutputPaths paths = output_paths(input);
+
+        std::string key;
+        if (m_cache)
+        {
+            PhaseTimer timer(stats, "cache");
+            // With -g and --profile, paths are part of the output.
+            std::string flags = m_opts.codegen_flags();
+            if (m_opts.debug_info)
+                flags += " " + absolute_path(input);
+            if (m_opts.profile)
+                flags += " " + absolute_path(paths.prof_path);
+            key = CompileCache::key(source, TARGET_NAME, flags);
+            // With --emit-ast-bin, a hit would skip the parse the snapshot is written from.
+            if (!m_opts.emit_ast && m_cache->fetch(key, paths.asm_path, paths.exe_path))
+            {
+                stats.cache_hit = true;
+                return paths;
+            }
+        }
+
+        m_alloc.reset();
+        m_hash_cons = HashCons();
+        bool shared = m_opts.hash_cons || (snapshot && (snapshot->header().flags & AST_SHARED));
+        PassManager passes(m_opts.pass_set(), m_opts.verify_each, m_alloc, shared);
+        std::optional<AstWriter> writer;
+        if (m_opts.emit_ast && !snapshot)
+            writer.emplace();
+        AsmBuffer assembly;
+        try
+        {
+            GenOptions gen = m_opts.gen_options();
+            gen.shared_nodes = shared;
+            std::optional<LineMap> lines;
+            if (m_opts.debug_info)
+            {
+                lines.emplace(m_contents);
+                gen.lines = &*lines;
+                gen.source_path = absolute_path(input);
+            }
+            if (m_opts.profile)
+            {
+                gen.profile_path = absolute_path(paths.prof_path);
+                gen.profile_source_hash =
+                    snapshot ? snapshot->header().source_hash : xxh64(m_contents.data(), m_contents.size());
+            }
+            if (snapshot)
+                assembly = front_end_snapshot(stats, gen, passes, *snapshot);
+            else if (m_opts.pipeline)
+                assembly = front_end_pipelined(stats, gen, passes, writer ? &*writer : nullptr);
+            else
+                assembly = front_end(stats, gen, passes, writer ? &*writer : nullptr);
+        }
+        catch (CompileError &err)
+        {
+            if (!snapshot)
+                locate(err);
+            throw;
+        }
+        if (writer)
+        {
+            PhaseTimer timer(stats, "snapshot");
+            writer->write(paths.ast_path, xxh64(m_contents.data(), m_contents.size()),
+                          static_cast<u32>(m_contents.size()));
+        }
+        stats.nodes = m_alloc.allocations();
+        stats.arena_bytes = m_alloc.bytes_used();
+#if defined(IPLATFORM_LINUX)
+        // The program is compiled as usual first, so it is checked in full
+        // even where it never runs. -g and --profile are about the code, so
+        // they keep it.
+        if (passes.passes().has(Pass::EVALUATE) && !m_opts.debug_info && !m_opts.profile)
+        {
+            auto start = std::chrono::steady_clock::now();
+            std::optional<Evaluation> result = Evaluator(m_stmts, m_opts.eval_budget).run();
+            if (result)
+            {
+                assembly = Generator::precomputed(result->output, result->index_error, result->status);
+                stats.precomputed = true;
+                stats.eval_steps = result->steps;
+            }
+            u64 ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            stats.add_phase("evaluate", ns);
+            passes.add(Pass::EVALUATE, ns, stats.precomputed);
+        }
+#endif
+        passes.report(stats);
+        stats.asm_bytes = assembly.size();
+
+#if defined(IPLATFORM_LINUX)
+        // nasm reads the assembly from a memfd, so the .s next to the input is
+        // only an artifact and is written while nasm runs. The object is a
+        // private temp file and the executable is linked under a unique name
+        // and renamed into place, so concurrent compiles never share a path.
+        TempFile obj(temp_path(".o"));
+        {
+            std::optional<MemFile> source;
+            std::optional<ChildProcess> nasm;
+            {
+                PhaseTimer timer(stats, "assemble");
+                source.emplace("yz-asm", assembly);
+                std::vector<std::string> argv = {"nasm", "-f", "elf64", MemFile::child_path(), "-o", obj.path()};
+                if (m_opts.debug_info)
+                    argv.insert(argv.end(), {"-g", "-F", "dwarf"});
+                nasm.emplace(argv, source->fd());
+            }
+            write_asm(paths.asm_path, assembly, stats);
+            PhaseTimer timer(stats, "assemble");
+            finish_tool(*nasm);
+        }
+        {
+            PhaseTimer timer(stats, "link");
+            TempFile exe(unique_path(paths.exe_path, ""));
+            run_tool({"ld", obj.path(), "-o", exe.path()});
+            std::error_code ec;
+            fs::rename(exe.path(), paths.exe_path, ec);
+            if (ec)
+                throw CompileError("Could not write file: " + paths.exe_path);
+        }
+#elif defined(IPLATFORM_WINDOWS)
+        write_asm(paths.asm_path, assembly, stats);
+        {
+            PhaseTimer timer(stats, "assemble");
+            run_tool({"gcc", "-c", paths.asm_path, "-o", paths.obj_path});
+        }
+        {
+            PhaseTimer timer(stats, "link");
+            run_tool({"gcc", paths.obj_path, "-o", paths.exe_path});
+        }
+#endif
+
+        if (m_cache)
+        {
+            PhaseTimer timer(stats, "cache");
+            m_cache->store(key, paths.asm_path, paths.exe_path);
+        }
+        return paths;
+    }
+
+private:
+    AsmBuffer front_end(CompileStats &stats, const GenOptions &gen, PassManager &passes, AstWriter *writer)
+    {
+        {
+            PhaseTimer timer(stats, "tokenize");
+            Tokenizer tokenizer(m_contents);
+            tokenizer.tokenize(m_tokens);
+        }
+        stats.tokens = m_tokens.size();
+
+        std::optional<NodeProg> tree;
+        {
+            PhaseTimer timer(stats, "parse");
+            Parser parser(m_tokens, m_alloc, m_opts.hash_cons ? &m_hash_cons : nullptr);
+            tree = parser.parse_prog();
+        }
+        if (writer)
+        {
+            PhaseTimer timer(stats, "snapshot");
+            writer->add(tree->stmts);
+        }
+        return optimize_and_generate(stats, gen, passes, *tree);
+    }
+
+    // The snapshot's nodes are linked instead of the source being tokenized
+    // and parsed; there is nothing left for a pipeline to overlap.
+    AsmBuffer front_end_snapshot(CompileStats &stats, const GenOptions &gen, PassManager &passes,
+                                 const AstSnapshot &snapshot)
+    {
+        NodeProg tree;
+        {
+            PhaseTimer timer(stats, "load");
+            tree = snapshot.link(m_alloc);
+        }
+        return optimize_and_generate(stats, gen, passes, tree);
+    }
+
+    AsmBuffer optimize_and_generate(CompileStats &stats, const GenOptions &gen, PassManager &passes, NodeProg &tree)
+    {
+        if (passes.passes().has_kind(PassKind::AST))
+        {
+            PhaseTimer timer(stats, "optimize");
+            passes.run_ast(tree.stmts);
+        }
+        if (passes.passes().has(Pass::EVALUATE))
+            m_stmts = tree.stmts;
+
+        PhaseTimer timer(stats, "generate");
+        Generator generator(tree, gen);
+        AsmBuffer assembly = generator.generate();
+        stats.ops_removed = generator.ops_removed();
+        passes.add_codegen(generator.pass_time(), generator.pass_changes());
+        return assembly;
+    }
+
+    // The three stages overlap, so they are timed together.
+    AsmBuffer front_end_pipelined(CompileStats &stats, const GenOptions &gen, PassManager &passes,
+                                  AstWriter *writer)
+    {
+        PhaseTimer timer(stats, "pipeline");
+        Pipeline pipeline(m_contents, m_alloc, gen, Pipeline::DEFAULT_BATCH_TOKENS,
+                          m_opts.hash_cons ? &m_hash_cons : nullptr, &passes, writer);
+        AsmBuffer assembly = pipeline.run();
+        if (passes.passes().has(Pass::EVALUATE))
+            m_stmts = pipeline.stmts();
+        stats.tokens = pipeline.tokens();
+        stats.ops_removed = pipeline.ops_removed();
+        return assembly;
+    }
+
+    // Paths baked into a program (the source for -g, the profile file for
+    // --profile) are absolute, so they work from any directory.
+    static std::string absolute_path(const std::string &path)
+    {
+        std::error_code ec;
+        fs::path absolute = fs::absolute(path, ec);
+        return ec ? path : absolute.lexically_normal().string();
+    }
+
+    // Resolves the error's byte offset to a line and column. The line starts
+    // are only scanned for here, once there is an error to place.
+    void locate(CompileError &err) const
+    {
+        if (!err.has_offset() || err.offset() > m_contents.size())
+            return;
+        LineMap lines(m_contents);
+        SourceLocation loc = lines.locate(err.offset());
+        std::string text = lines.line_text(loc.line);
+        std::string caret;
+        for (size_t i = 0; i + 1 < loc.column && i < text.size(); i++)
+            caret += text[i] == '\t' ? '\t' : ' ';
+        err.set_location(std::to_string(loc.line) + ":" + std::to_string(loc.column), text + "\n" + caret + "^");
+    }
+
+    void read_file(const std::string &path)
+    {
+        std::ifstream input(path, std::ios::binary);
+        if (!input.is_open())
+            throw CompileError("Could not open file: " + path);
+
+        // A directory opens, but cannot be read and reports either -1 or a
+        // huge size depending on the standard library.
+        std::error_code ec;
+        if (std::filesystem::is_directory(path, ec))
+            throw CompileError("Could not read file: " + path);
+        input.seekg(0, std::ios::end);
+        std::streamoff size = input.tellg();
+        if (size < 0)
+            throw CompileError("Could not read file: " + path);
+        m_contents.resize(static_cast<size_t>(size));
+        input.seekg(0, std::ios::beg);
+        input.read(m_contents.data(), static_cast<std::streamsize>(m_contents.size()));
+        if (input.fail())
+            throw CompileError("Could not read file: " + path);
+    }
+
+    static void write_asm(const std::string &path, const AsmBuffer &assembly, CompileStats &stats)
+    {
+        PhaseTimer timer(stats, "write");
+#if defined(IPLATFORM_LINUX)
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw CompileError("Could not write file: " + path);
+        bool written = assembly.write_to(fd);
+        if (close(fd) != 0 || !written)
+            throw CompileError("Could not write file: " + path);
+#elif defined(IPLATFORM_WINDOWS)
+        std::ofstream file(path, std::ios::binary);
+        if (!file.is_open())
+            throw CompileError("Could not write file: " + path);
+        assembly.write_to(file);
+#endif
+    }
+
+    const Options &m_opts;
+    CompileCache *m_cache;
+    ArenaAlloc m_alloc;
+    HashCons m_hash_cons; // points into m_alloc, so it is cleared with it
+    std::string m_contents;
+    std::vector<Token> m_tokens;
+    std::vector<NodeStmt *> m_stmts; // the top-level statements, kept for the evaluate pass
+};
+
+inline void report_failure(const std::string &input, const CompileError &err)
+{
+    if (err.location().empty())
+    {
+        LLOG(RED_TEXT(input), ": ", RED_TEXT(err.what()), "\n");
+        return;
+    }
+    LLOG(RED_TEXT(input + ":" + err.location()), ": ", RED_TEXT(err.what()), "\n", err.excerpt(), "\n");
+}
+
+// --report: the hot-statement table of every input's profile.
+inline int run_report(const Options &opts)
+{
+    int status = EXIT_SUCCESS;
+    for (const std::string &input : opts.inputs)
+    {
+        try
+        {
+            std::ifstream file(input, std::ios::binary);
+            if (!file.is_open())
+                throw CompileError("Could not open file: " + input);
+            std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            Profile profile = read_profile(output_paths(input).prof_path);
+            LLOG(CYAN_TEXT(input), "\n", profile_report(input, source, std::move(profile), 20), "\n");
+        }
+        catch (const CompileError &err)
+        {
+            report_failure(input, err);
+            status = EXIT_FAILURE;
+        }
+    }
+    return status;
+}
+
+// Compiles every input on a work-stealing pool. A failing file is reported and
+// counted; the rest of the batch keeps going. Returns the number of failures.
+inline size_t compile_batch(const Options &opts, CompileCache *cache, std::vector<CompileStats> &all_stats)
+{
+    std::mutex stats_mut;
+    ThreadPool pool(opts.jobs ? opts.jobs : std::thread::hardware_concurrency());
+
+    std::vector<std::unique_ptr<CompileContext>> contexts;
+    for (size_t i = 0; i < pool.size(); i++)
+        contexts.push_back(std::make_unique<CompileContext>(opts, cache));
+
+    std::atomic<size_t> failures{0};
+    for (const std::string &input : opts.inputs)
+    {
+        pool.submit([&, input](size_t worker)
+                    {
+            try
+            {
+                CompileStats stats;
+                contexts[worker]->compile(input, stats);
+                std::lock_guard<std::mutex> lock(stats_mut);
+                all_stats.push_back(std::move(stats));
+            }
+            catch (const CompileError &err)
+            {
+                report_failure(input, err);
+                failures++;
+            }
+            catch (const std::exception &err)
+            {
+                // Anything else, such as bad_alloc, still fails only this file.
+                report_failure(input, CompileError(err.what()));
+                failures++;
+            } });
+    }
+    pool.wait();
+
+    size_t failed = failures.load();
+    LLOG(BLUE_TEXT("Compiled: "), opts.inputs.size() - failed, "/", opts.inputs.size(),
+         " files on ", pool.size(), " threads\n");
+    return failed;
+}
+
+inline void report_cache(const CompileCache &cache)
+{
+    LLOG(BLUE_TEXT("Cache: "), cache.hits(), " hits, ", cache.misses(), " misses, ",
+         cache.stores(), " stored, ", cache.evictions(), " evicted\n");
+}
+
+// --time-phases prints a table, --stats-json writes JSON to stderr or a file.
+// stdout already carries the compiler's messages and the program's output, so
+// JSON on stderr stays parseable: `yz --stats-json x.yz 2>&1 >/dev/null | jq`.
+inline void report_stats(const Options &opts, const std::vector<CompileStats> &all_stats)
+{
+    ResourceUsage usage = resource_usage();
+    if (opts.time_phases)
+        LLOG(stats_table(all_stats, usage));
+
+    if (opts.stats_json)
+    {
+        std::string json = stats_json(all_stats, usage);
+        if (opts.stats_json_path.empty())
+        {
+            std::cerr << json;
+            std::cerr.flush();
+        }
+        else
+        {
+            std::ofstream file(opts.stats_json_path);
+            if (file.is_open())
+                file << json;
+            else
+                LLOG(RED_TEXT("Could not write file: "), opts.stats_json_path, "\n");
+        }
+    }
+}
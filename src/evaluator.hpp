@@ -0,0 +1,432 @@
+#pragma once
+#include <charconv>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "core/defines.h"
+#include "core/nodes.hpp"
+
+// How much of the compiler's time and memory running a program may take.
+struct EvalBudget
+{
+    u64 steps = 10000000;           // statements, operators and array elements
+    u64 bytes = 64ull * 1024 * 1024; // variables, arrays and output
+    size_t call_depth = 1000;
+};
+
+// Everything a program did: its stdout and how it ended.
+struct Evaluation
+{
+    std::string output;
+    u8 status = 0;
+    bool index_error = false; // it ended with "Index out of bounds" on stderr
+    u64 steps = 0;
+};
+
+// Runs a program inside the compiler. YZ programs read no input, so a program
+// that finishes within the budget has the same output and exit status every
+// time it runs. The program must have compiled: names, arities and array
+// lengths are not checked again. Evaluation follows the generated code, not
+// the intent: operands are evaluated right to left, `a / b` divides b by a
+// with the dividend zero-extended, and anything that would trap makes run()
+// give up, as does running out of budget.
+class Evaluator
+{
+public:
+    inline explicit Evaluator(const std::vector<NodeStmt *> &stmts, EvalBudget budget = {})
+        : m_stmts(stmts), m_budget(budget)
+    {
+    }
+
+    [[nodiscard]] std::optional<Evaluation> run()
+    {
+        for (const NodeStmt *stmt : m_stmts)
+            collect_fns(stmt);
+        try
+        {
+            for (const NodeStmt *stmt : m_stmts)
+                exec(stmt);
+        }
+        catch (const Halt &)
+        {
+        }
+        catch (const GiveUp &)
+        {
+            return {};
+        }
+        m_result.steps = m_steps;
+        return std::move(m_result);
+    }
+
+    // `lhs op rhs` in wrapping 64-bit arithmetic, as the machine does it, or
+    // nothing if the instruction would trap.
+    [[nodiscard]] static std::optional<i64> binary(const NodeBinExpr *bin, i64 lhs, i64 rhs)
+    {
+        u64 a = static_cast<u64>(lhs);
+        u64 b = static_cast<u64>(rhs);
+        if (std::holds_alternative<NodeBinExprAdd *>(bin->var))
+            return static_cast<i64>(a + b);
+        if (std::holds_alternative<NodeBinExprSub *>(bin->var))
+            return static_cast<i64>(a - b);
+        if (std::holds_alternative<NodeBinExprMulti *>(bin->var))
+            return static_cast<i64>(a * b);
+        if (std::holds_alternative<NodeBinExprLess *>(bin->var))
+            return lhs < rhs;
+        // idiv with rdx cleared and the operands the other way round; a zero
+        // divisor or a quotient past 64 bits raises #DE.
+        if (lhs == 0)
+            return {};
+        __int128 quotient = static_cast<__int128>(b) / lhs;
+        if (quotient > INT64_MAX || quotient < INT64_MIN)
+            return {};
+        return static_cast<i64>(quotient);
+    }
+
+    // The value of a literal's text: digits, taken modulo 2^64 as `mov` takes
+    // them, or a negative number the fold pass wrote.
+    [[nodiscard]] static std::optional<i64> literal(const std::string &text)
+    {
+        const char *end = text.data() + text.size();
+        if (!text.empty() && text[0] == '-')
+        {
+            i64 value = 0;
+            auto [ptr, ec] = std::from_chars(text.data(), end, value);
+            if (ec != std::errc() || ptr != end)
+                return {};
+            return value;
+        }
+        u64 value = 0;
+        auto [ptr, ec] = std::from_chars(text.data(), end, value);
+        if (ec != std::errc() || ptr != end)
+            return {};
+        return static_cast<i64>(value);
+    }
+
+private:
+    struct Halt // exit, an index error or the end of the program
+    {
+    };
+
+    struct GiveUp // out of budget, or the program would trap
+    {
+    };
+
+    enum class Flow
+    {
+        NEXT,
+        RETURN
+    };
+
+    struct Slot
+    {
+        const std::string *name;
+        i64 value = 0;
+        std::vector<i64> elems; // empty unless the slot is an array
+        u8 size = 8;            // bytes of a sized value, which wraps around on every store
+    };
+
+    void collect_fns(const NodeStmt *stmt)
+    {
+        if (auto fn = std::get_if<NodeStmtFn *>(&stmt->var))
+            m_fns[(*fn)->ident.value.value()] = *fn;
+    }
+
+    void step(u64 n = 1)
+    {
+        m_steps += n;
+        if (m_steps > m_budget.steps)
+            throw GiveUp();
+    }
+
+    void allocate(u64 bytes)
+    {
+        m_bytes += bytes;
+        if (m_bytes > m_budget.bytes)
+            throw GiveUp();
+    }
+
+    void push_slot(const std::string &name, i64 value, std::vector<i64> elems = {}, u8 size = 8)
+    {
+        allocate(sizeof(Slot) + elems.size() * sizeof(i64));
+        m_slots.push_back({&name, wrap(value, size), std::move(elems), size});
+    }
+
+    void pop_slots(size_t size)
+    {
+        while (m_slots.size() > size)
+        {
+            m_bytes -= sizeof(Slot) + m_slots.back().elems.size() * sizeof(i64);
+            m_slots.pop_back();
+        }
+    }
+
+    Slot &find(const std::string &name)
+    {
+        for (size_t i = m_slots.size(); i-- > m_frame_start;)
+        {
+            if (*m_slots[i].name == name)
+                return m_slots[i];
+        }
+        throw GiveUp();
+    }
+
+    Flow exec_block(const std::vector<NodeStmt *> &stmts)
+    {
+        size_t size = m_slots.size();
+        for (const NodeStmt *stmt : stmts)
+        {
+            if (exec(stmt) == Flow::RETURN)
+            {
+                pop_slots(size);
+                return Flow::RETURN;
+            }
+        }
+        pop_slots(size);
+        return Flow::NEXT;
+    }
+
+    Flow exec(const NodeStmt *stmt)
+    {
+        step();
+        if (auto exit = std::get_if<NodeStmtExit *>(&stmt->var))
+        {
+            m_result.status = static_cast<u8>(eval((*exit)->expr));
+            throw Halt();
+        }
+        if (auto let = std::get_if<NodeStmtLet *>(&stmt->var))
+            push_slot((*let)->ident.value.value(), eval((*let)->expr), {}, (*let)->size);
+        else if (auto assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+        {
+            Slot &slot = find((*assign)->ident.value.value());
+            if (slot.elems.empty())
+            {
+                i64 value = eval((*assign)->expr);
+                Slot &target = find((*assign)->ident.value.value());
+                target.value = wrap(value, target.size);
+            }
+            else
+            {
+                std::vector<i64> elems = elementwise(slot.elems.size(), (*assign)->expr);
+                find((*assign)->ident.value.value()).elems = std::move(elems);
+            }
+        }
+        else if (auto array = std::get_if<NodeStmtArray *>(&stmt->var))
+        {
+            size_t len = std::stoull((*array)->size.value.value());
+            allocate(len * sizeof(i64));
+            // The initializer cannot see the array it initializes.
+            std::vector<i64> elems = (*array)->init ? elementwise(len, (*array)->init) : std::vector<i64>(len);
+            m_bytes -= len * sizeof(i64);
+            push_slot((*array)->ident.value.value(), 0, std::move(elems));
+        }
+        else if (auto element = std::get_if<NodeStmtIndexAssign *>(&stmt->var))
+        {
+            i64 index = eval((*element)->index);
+            i64 value = eval((*element)->expr);
+            std::vector<i64> &elems = find((*element)->ident.value.value()).elems;
+            check_index(index, elems.size());
+            elems[index] = value;
+        }
+        else if (auto print = std::get_if<NodeStmtOut *>(&stmt->var))
+        {
+            char digits[24];
+            char *end = std::to_chars(digits, digits + sizeof(digits), eval((*print)->expr)).ptr;
+            *end++ = '\n';
+            allocate(end - digits);
+            m_result.output.append(digits, end);
+        }
+        else if (auto block = std::get_if<NodeStmtBlock *>(&stmt->var))
+            return exec_block((*block)->stmts);
+        else if (auto loop = std::get_if<NodeStmtWhile *>(&stmt->var))
+        {
+            while (eval((*loop)->cond))
+            {
+                if (exec_block((*loop)->body->stmts) == Flow::RETURN)
+                    return Flow::RETURN;
+            }
+        }
+        else if (auto ret = std::get_if<NodeStmtReturn *>(&stmt->var))
+        {
+            m_return = eval((*ret)->expr);
+            return Flow::RETURN;
+        }
+        else if (auto expr_stmt = std::get_if<NodeStmtExpr *>(&stmt->var))
+            eval((*expr_stmt)->expr);
+        return Flow::NEXT;
+    }
+
+    // Two's complement wrap-around to `size` bytes, sign-extended back.
+    static i64 wrap(i64 value, u8 size)
+    {
+        switch (size)
+        {
+        case 1:
+            return static_cast<i8>(value);
+        case 2:
+            return static_cast<i16>(value);
+        case 4:
+            return static_cast<i32>(value);
+        default:
+            return value;
+        }
+    }
+
+    void check_index(i64 index, size_t len)
+    {
+        if (static_cast<u64>(index) < len)
+            return;
+        m_result.index_error = true;
+        m_result.status = 1;
+        throw Halt();
+    }
+
+    i64 eval(const NodeExpr *expr)
+    {
+        step();
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+            return eval_term(*term);
+        const NodeBinExpr *bin = std::get<NodeBinExpr *>(expr->var);
+        return std::visit([&](const auto *op)
+                          {
+            i64 rhs = eval(op->rhs);
+            i64 lhs = eval(op->lhs);
+            return apply(bin, lhs, rhs); },
+                          bin->var);
+    }
+
+    i64 apply(const NodeBinExpr *bin, i64 lhs, i64 rhs)
+    {
+        std::optional<i64> value = binary(bin, lhs, rhs);
+        if (!value)
+            throw GiveUp();
+        return *value;
+    }
+
+    i64 eval_term(const NodeTerm *term)
+    {
+        if (auto lit = std::get_if<NodeTermIntLit *>(&term->var))
+        {
+            std::optional<i64> value = literal((*lit)->int_lit.value.value());
+            if (!value)
+                throw GiveUp();
+            return *value;
+        }
+        if (auto ident = std::get_if<NodeTermIdent *>(&term->var))
+            return find((*ident)->ident.value.value()).value;
+        if (auto paren = std::get_if<NodeTermParen *>(&term->var))
+            return eval((*paren)->expr);
+        if (auto index = std::get_if<NodeTermIndex *>(&term->var))
+        {
+            i64 at = eval((*index)->index);
+            const std::vector<i64> &elems = find((*index)->ident.value.value()).elems;
+            check_index(at, elems.size());
+            return elems[at];
+        }
+        return call(std::get<NodeTermCall *>(term->var));
+    }
+
+    i64 call(const NodeTermCall *call)
+    {
+        auto it = m_fns.find(call->ident.value.value());
+        if (it == m_fns.end() || m_depth >= m_budget.call_depth)
+            throw GiveUp();
+        const NodeStmtFn *fn = it->second;
+        std::vector<i64> args(call->args.size());
+        for (size_t i = args.size(); i-- > 0;)
+            args[i] = eval(call->args[i]);
+
+        // The callee sees its parameters and nothing of the caller.
+        size_t frame_start = m_frame_start;
+        size_t size = m_slots.size();
+        m_frame_start = size;
+        m_depth++;
+        for (size_t i = 0; i < args.size(); i++)
+            push_slot(fn->params[i].value.value(), args[i]);
+        i64 result = exec_block(fn->body->stmts) == Flow::RETURN ? m_return : 0;
+        pop_slots(size);
+        m_depth--;
+        m_frame_start = frame_start;
+        return result;
+    }
+
+    // The elements of `expr` over arrays of `len` elements. Its largest
+    // subexpressions that read no array are evaluated once, first, left to
+    // right; then every element is computed on its own.
+    std::vector<i64> elementwise(size_t len, const NodeExpr *expr)
+    {
+        std::unordered_map<const NodeExpr *, i64> scalars;
+        collect_scalars(expr, scalars);
+        std::vector<i64> elems(len);
+        for (size_t i = 0; i < len; i++)
+            elems[i] = eval_element(expr, i, scalars);
+        return elems;
+    }
+
+    bool has_array(const NodeExpr *expr)
+    {
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (auto paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                return has_array((*paren)->expr);
+            auto ident = std::get_if<NodeTermIdent *>(&(*term)->var);
+            return ident && !find((*ident)->ident.value.value()).elems.empty();
+        }
+        return std::visit([&](const auto *op)
+                          { return has_array(op->lhs) || has_array(op->rhs); },
+                          std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    void collect_scalars(const NodeExpr *expr, std::unordered_map<const NodeExpr *, i64> &scalars)
+    {
+        if (!has_array(expr))
+        {
+            if (!scalars.count(expr))
+                scalars[expr] = eval(expr);
+            return;
+        }
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (auto paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                collect_scalars((*paren)->expr, scalars);
+            return;
+        }
+        std::visit([&](const auto *op)
+                   {
+            collect_scalars(op->lhs, scalars);
+            collect_scalars(op->rhs, scalars); },
+                   std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    i64 eval_element(const NodeExpr *expr, size_t i, const std::unordered_map<const NodeExpr *, i64> &scalars)
+    {
+        step();
+        auto scalar = scalars.find(expr);
+        if (scalar != scalars.end())
+            return scalar->second;
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (auto paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                return eval_element((*paren)->expr, i, scalars);
+            return find(std::get<NodeTermIdent *>((*term)->var)->ident.value.value()).elems[i];
+        }
+        const NodeBinExpr *bin = std::get<NodeBinExpr *>(expr->var);
+        return std::visit([&](const auto *op)
+                          {
+            i64 rhs = eval_element(op->rhs, i, scalars);
+            i64 lhs = eval_element(op->lhs, i, scalars);
+            return apply(bin, lhs, rhs); },
+                          bin->var);
+    }
+
+    const std::vector<NodeStmt *> &m_stmts;
+    const EvalBudget m_budget;
+    std::unordered_map<std::string, const NodeStmtFn *> m_fns;
+    std::vector<Slot> m_slots;
+    size_t m_frame_start = 0;
+    size_t m_depth = 0;
+    i64 m_return = 0;
+    u64 m_steps = 0;
+    u64 m_bytes = 0;
+    Evaluation m_result;
+};
@@ -2,17 +2,61 @@
 
 #include "YLogger/logger.h"
 #include "parser.hpp"
+#include "passes.hpp"
 #include <cassert>
-#include <sstream>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <string_view>
 #include <vector>
 #include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include "core/asm_buffer.hpp"
 #include "core/defines.h"
+#include "core/error.hpp"
+#include "core/source_map.hpp"
+
+// Vector instructions element-wise array code may use.
+enum class SimdLevel
+{
+    NONE,
+    SSE2,
+    AVX2
+};
+
+// Optimizations the generator may apply; the driver derives them from the
+// code generation passes in its PassSet.
+struct GenOptions
+{
+    bool hoist_invariants = true; // evaluate loop-invariant expressions once, before the loop
+    bool loop_registers = true;   // keep the variables a loop assigns in r12-r15 (Linux)
+    bool inline_functions = true; // expand small and single-call functions at their call sites
+    bool value_numbering = true;  // compute a pure expression over `val`s once per scope
+    bool cache_tos = false;       // keep the top two expression stack entries in r10 and r11 (Linux)
+    SimdLevel simd = SimdLevel::SSE2;
+    bool time_passes = false; // time each pass, for pass_time()
+    bool verify = false;      // --verify-each: check the stack after every statement
+    bool shared_nodes = false; // expression nodes may be shared, see expr_offset()
+    // Set for -g: every statement's code is tagged with its line in
+    // `source_path` (NASM %line, DWARF with nasm -g -F dwarf) and starts
+    // at a local symbol yz_L<line>_<n>.
+    const LineMap *lines = nullptr;
+    std::string source_path;
+    // Set for --profile (Linux): every statement bumps a 64-bit counter in
+    // .bss, and the counters are written to this file when the program exits.
+    std::string profile_path;
+    u64 profile_source_hash = 0; // lets the report notice an edited source
+};
 
 class Generator
 {
 public:
-    inline explicit Generator(NodeProg prog)
-        : m_prog(std::move(prog))
+    inline explicit Generator(NodeProg prog, GenOptions opts = {})
+        : m_prog(std::move(prog)), m_opts(opts), m_cache_tos(opts.cache_tos)
     {
     }
 
@@ -39,22 +83,53 @@ public:
                 const Var *var = gen.find_var(name, &offset);
                 if (!var)
                 {
-                    LLOG(RED_TEXT("Undeclared identifier: "), name, "\n");
-                    exit(EXIT_FAILURE);
+                    throw CompileError("Undeclared identifier: " + name, gen.expr_offset(term_ident->ident.offset));
                 }
-#if defined(IPLATFORM_WINDOWS)
-                gen.m_output << "    movl -" << offset << "(%rbp), %eax\n";
-                gen.push("rax");
-#elif defined(IPLATFORM_LINUX)
-                gen.m_output << "    mov rax, QWORD [rsp + " << offset << "]\n";
-                gen.push("rax");
-#endif
+                if (var->base_reg)
+                {
+                    // An array operand inside an element-wise loop.
+                    gen.m_output << "    mov rax, QWORD [" << var->base_reg << " + rcx * 8]\n";
+                    gen.push("rax");
+                    return;
+                }
+                if (var->array_len)
+                {
+                    throw CompileError("Array used as a value: " + name, gen.expr_offset(term_ident->ident.offset));
+                }
+                gen.push_var(*var);
             }
 
             void operator()(const NodeTermParen *term_paren) const
             {
                 gen.gen_expr(term_paren->expr);
             }
+
+            void operator()(const NodeTermCall *term_call) const
+            {
+                bool narrow = gen.m_narrow;
+                gen.m_narrow = false;
+                gen.gen_call(term_call);
+                gen.m_narrow = narrow;
+            }
+
+            void operator()(const NodeTermIndex *term_index) const
+            {
+                // Copied, since a call inlined into the index may grow m_vars.
+                const Var var = gen.array_var(term_index->ident, gen.expr_offset(term_index->ident.offset));
+                std::optional<size_t> index = gen.const_index(var, term_index->index);
+                if (!index)
+                {
+                    bool narrow = gen.m_narrow;
+                    gen.m_narrow = false;
+                    gen.gen_expr(term_index->index);
+                    gen.m_narrow = narrow;
+                    gen.pop("rax");
+                    gen.check_index(var);
+                }
+                std::string src = gen.element(var, index);
+                gen.m_output << "    mov rax, " << src << "\n";
+                gen.push("rax");
+            }
         };
 
         TermVisitor visitor({.gen = *this});
@@ -73,7 +148,7 @@ public:
 #if defined(IPLATFORM_LINUX)
                 gen.pop("rbx");
                 gen.pop("rax");
-                gen.m_output << "    add rax, rbx\n";
+                gen.m_output << (gen.m_narrow ? "    add eax, ebx\n" : "    add rax, rbx\n");
                 gen.push("rax");
 #elif defined(IPLATFORM_WINDOWS)
                 gen.pop("rcx");
@@ -89,7 +164,7 @@ public:
 #if defined(IPLATFORM_LINUX)
                 gen.pop("rbx");
                 gen.pop("rax");
-                gen.m_output << "    sub rbx, rax\n";
+                gen.m_output << (gen.m_narrow ? "    sub ebx, eax\n" : "    sub rbx, rax\n");
                 gen.push("rbx");
 #elif defined(IPLATFORM_WINDOWS)
                 gen.pop("rcx");
@@ -105,7 +180,7 @@ public:
 #if defined(IPLATFORM_LINUX)
                 gen.pop("rbx");
                 gen.pop("rax");
-                gen.m_output << "    mul rbx\n";
+                gen.m_output << (gen.m_narrow ? "    imul eax, ebx\n" : "    mul rbx\n");
                 gen.push("rax");
 #elif defined(IPLATFORM_WINDOWS)
                 gen.pop("rcx");
@@ -116,8 +191,11 @@ public:
             }
             void operator()(const NodeBinExprDiv *div)
             {
+                bool narrow = gen.m_narrow;
+                gen.m_narrow = false;
                 gen.gen_expr(div->rhs);
                 gen.gen_expr(div->lhs);
+                gen.m_narrow = narrow;
 #if defined(IPLATFORM_LINUX)
                 gen.pop("rbx");
                 gen.pop("rax");
@@ -130,6 +208,29 @@ public:
                 gen.m_output << "    xorl %edx, %edx\n";
                 gen.m_output << "    idivl %ecx\n";
                 gen.push("rax");
+#endif
+            }
+            void operator()(const NodeBinExprLess *less)
+            {
+                bool narrow = gen.m_narrow;
+                gen.m_narrow = false;
+                gen.gen_expr(less->rhs);
+                gen.gen_expr(less->lhs);
+                gen.m_narrow = narrow;
+#if defined(IPLATFORM_LINUX)
+                gen.pop("rbx");
+                gen.pop("rax");
+                gen.m_output << "    cmp rbx, rax\n";
+                gen.m_output << "    setl al\n";
+                gen.m_output << "    movzx rax, al\n";
+                gen.push("rax");
+#elif defined(IPLATFORM_WINDOWS)
+                gen.pop("rcx");
+                gen.pop("rax");
+                gen.m_output << "    cmpl %eax, %ecx\n";
+                gen.m_output << "    setl %al\n";
+                gen.m_output << "    movzbl %al, %eax\n";
+                gen.push("rax");
 #endif
             }
         };
@@ -139,6 +240,27 @@ public:
 
     void gen_expr(const NodeExpr *expr)
     {
+        LTRACE(false, "gen_expr stack ", m_stack_size, "\n");
+        if (!m_hoisted.empty())
+        {
+            auto hoisted = m_hoisted.find(expr);
+            if (hoisted != m_hoisted.end())
+            {
+                push_var(m_vars[hoisted->second]);
+                return;
+            }
+        }
+        if (!m_available.empty())
+        {
+            auto number = m_value_of.find(expr);
+            auto slot = number != m_value_of.end() ? m_available.find(number->second) : m_available.end();
+            if (slot != m_available.end())
+            {
+                m_changes[Pass::CSE] += static_cast<i64>(operations(expr));
+                push_var(m_vars[slot->second]);
+                return;
+            }
+        }
         struct ExprVisitor
         {
             Generator &gen;
@@ -159,6 +281,7 @@ public:
 
     void gen_stmt(const NodeStmt *stmt)
     {
+        LTRACE(false, "gen_stmt stack ", m_stack_size, " vars ", m_vars.size(), " scopes ", m_scopes.size(), "\n");
         struct StmtVisitor
         {
             Generator &gen;
@@ -168,38 +291,116 @@ public:
 #if defined(IPLATFORM_WINDOWS)
                 gen.pop("rax");
 #elif defined(IPLATFORM_LINUX)
-                // For linux, the exit code is moved to rdi before syscall
+                // Buffered output has to reach stdout before the process is gone.
+                gen.spill_cache();
+                gen.gen_exit_flush();
+                gen.pop("rdi");
+                gen.m_output << "    mov rax, 60\n";
+                gen.m_output << "    syscall\n";
 #endif
                 gen.m_has_explicit_exit = true;
             }
 
             void operator()(const NodeStmtLet *stmt_let) const
             {
-                // Check if identifier is already used in the current scope.
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var &var)
-                                       {
-                    bool in_current_scope = false;
-                    if (!gen.m_scopes.empty()) {
-                        size_t current_scope_start_index = gen.m_scopes.back();
-                        // This determines if the variable 'var' is inside the current scope
-                        size_t var_index = &var - &gen.m_vars[0];
-                        if (var_index >= current_scope_start_index) {
-                            in_current_scope = true;
-                        }
-                    } else { // Global scope
-                        in_current_scope = true;
-                    }
-                    return in_current_scope && var.name == stmt_let->ident.value.value(); });
+                gen.check_new_name(stmt_let->ident);
+                if (stmt_let->size < 8)
+                {
+                    gen.gen_sized_let(stmt_let);
+                    return;
+                }
+                gen.gen_expr(stmt_let->expr);
+                gen.m_vars.push_back({.name = stmt_let->ident.value.value(),
+                                      .stack_loc = gen.top_slot(),
+                                      .is_mutable = stmt_let->is_mutable});
+                if (!stmt_let->is_mutable)
+                    gen.make_available(stmt_let->expr);
+            }
 
-                if (it != gen.m_vars.cend())
+            void operator()(const NodeStmtAssign *stmt_assign) const
+            {
+                const auto &name = stmt_assign->ident.value.value();
+                size_t offset;
+                const Var *var = gen.find_var(name, &offset);
+                if (!var)
+                {
+                    throw CompileError("Undeclared identifier: " + name, stmt_assign->ident.offset);
+                }
+                if (!var->is_mutable)
+                {
+                    throw CompileError("Cannot assign to `val`: " + name, stmt_assign->ident.offset);
+                }
+                if (var->array_len)
+                {
+                    gen.gen_elementwise(*var, stmt_assign->expr);
+                    return;
+                }
+#if defined(IPLATFORM_LINUX)
+                // A call inlined into the expression may grow m_vars.
+                const Var target = *var;
+                if (gen.gen_update(target, stmt_assign->expr))
+                    return;
+                gen.m_narrow = target.size <= 4;
+                gen.gen_expr(stmt_assign->expr);
+                gen.m_narrow = false;
+                if (target.reg && target.size == 8)
+                    gen.pop(target.reg);
+                else
                 {
-                    LLOG(RED_TEXT("Identifier already used in this scope: "), stmt_let->ident.value.value(), "\n");
-                    exit(EXIT_FAILURE);
+                    gen.pop("rax");
+                    gen.store_rax(target);
                 }
+#elif defined(IPLATFORM_WINDOWS)
+                gen.gen_expr(stmt_assign->expr);
+                gen.pop("rax");
+                gen.m_output << "    movq %rax, -" << gen.var_offset(*var) << "(%rbp)\n";
+#endif
+            }
 
-                gen.gen_expr(stmt_let->expr);
-                gen.m_vars.push_back({.name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size - 1});
+            void operator()(const NodeStmtWhile *stmt_while) const
+            {
+                gen.gen_while(stmt_while);
             }
+
+            void operator()(const NodeStmtArray *stmt_array) const
+            {
+                gen.gen_array(stmt_array);
+            }
+
+            void operator()(const NodeStmtIndexAssign *stmt_index) const
+            {
+                // Copied, since a call inlined into the operands may grow m_vars.
+                const Var var = gen.array_var(stmt_index->ident, stmt_index->ident.offset);
+                std::optional<size_t> index = gen.const_index(var, stmt_index->index);
+                if (!index)
+                    gen.gen_expr(stmt_index->index);
+                gen.gen_expr(stmt_index->expr);
+                gen.pop("rdx");
+                if (!index)
+                {
+                    gen.pop("rax");
+                    gen.check_index(var);
+                }
+                std::string dst = gen.element(var, index);
+                gen.m_output << "    mov " << dst << ", rdx\n";
+            }
+
+            void operator()(const NodeStmtFn *stmt_fn) const
+            {
+                gen.gen_fn(stmt_fn);
+            }
+
+            void operator()(const NodeStmtReturn *stmt_return) const
+            {
+                gen.gen_return(stmt_return);
+            }
+
+            void operator()(const NodeStmtExpr *stmt_expr) const
+            {
+                gen.gen_expr(stmt_expr->expr);
+                gen.pop("rax");
+            }
+
             void operator()(const NodeStmtOut *stmt_out) const
             {
                 gen.gen_expr(stmt_out->expr);
@@ -225,12 +426,13 @@ public:
                 else
                     gen.m_output << "    addq $32, %rsp\n";
 #elif defined(IPLATFORM_LINUX)
-                gen.m_output << "    ; out not implemented for linux yet\n";
+                gen.m_output << "    call yz_out\n";
 #endif
             }
 
             void operator()(const NodeStmtBlock *block) const
             {
+                gen.m_prof_run = gen.m_prof_nested_run;
                 gen.push_scope();
                 for (auto *s : block->stmts)
                     gen.gen_stmt(s);
@@ -239,10 +441,39 @@ public:
         };
 
         StmtVisitor visitor{.gen = *this};
-        std::visit(visitor, stmt->var);
+        if (m_opts.lines)
+            mark_stmt(stmt->offset);
+        bool is_fn = std::holds_alternative<NodeStmtFn *>(stmt->var);
+        size_t run = m_prof_run;
+        size_t nested_run = m_prof_nested_run;
+        if (!m_opts.profile_path.empty() && !is_fn)
+            run = count_stmt(stmt->offset);
+        // Bodies nested in this statement start their own run, except a block
+        // or a function inlined into it: those start once per execution too.
+        m_prof_run = NO_COUNTER;
+        m_prof_nested_run = is_fn ? NO_COUNTER : run;
+        try
+        {
+            with_value_numbers(stmt, [&]
+                               { std::visit(visitor, stmt->var); });
+            if (m_opts.verify)
+                verify_stack();
+        }
+        catch (CompileError &err)
+        {
+            // Errors without a token of their own are placed at the innermost
+            // statement they came from.
+            if (!err.has_offset())
+                err.set_offset(stmt->offset);
+            throw;
+        }
+        m_prof_run = ends_run(stmt) ? NO_COUNTER : run;
+        m_prof_nested_run = nested_run;
     }
 
-    [[nodiscard]] std::string generate()
+    // Callers that receive the program a statement at a time use begin(), then
+    // gen_stmt() for every top-level statement, then finish().
+    void begin()
     {
 #if defined(IPLATFORM_WINDOWS)
         m_output << ".section .rodata\n";
@@ -256,9 +487,21 @@ public:
 #elif defined(IPLATFORM_LINUX)
         m_output << "global _start\n_start:\n";
 #endif
-        for (const NodeStmt *s : m_prog.stmts)
-            gen_stmt(s);
+#if defined(IPLATFORM_WINDOWS)
+        if (!m_opts.profile_path.empty())
+            throw CompileError("--profile is not supported on Windows yet");
+#endif
+#if defined(IPLATFORM_WINDOWS)
+        if (m_opts.lines)
+            m_output << "    .file 1 \"" << m_opts.source_path << "\"\n";
+#endif
+    }
 
+    [[nodiscard]] AsmBuffer finish()
+    {
+        // The exit code and the runtime belong to no statement.
+        if (m_opts.lines)
+            m_output << line_directive(0);
 #if defined(IPLATFORM_WINDOWS)
         if (!m_has_explicit_exit)
             m_output << "    movl $0, %eax\n";
@@ -266,98 +509,2375 @@ public:
         m_output << "    popq %rbp\n";
         m_output << "    ret\n";
 #elif defined(IPLATFORM_LINUX)
+        gen_exit_flush();
         m_output << "    mov rax, 60\n";
-        if (m_has_explicit_exit)
+        m_output << "    mov rdi, 0\n";
+        m_output << "    syscall\n";
+        if (!m_call_sites.empty())
         {
-            m_output << "    pop rdi\n";
+            std::string main = m_output.str();
+            AsmBuffer out;
+            resolve_calls(main, out);
+            for (bool more = true; more;)
+            {
+                more = false;
+                for (Function &fn : m_functions)
+                {
+                    if (fn.needed && !fn.emitted)
+                    {
+                        fn.emitted = more = true;
+                        m_changes += fn.changes;
+                        resolve_calls(fn.code, out);
+                    }
+                }
+            }
+            m_output.swap(out);
+            gen_runtime();
+            return std::move(m_output);
         }
-        else
+        gen_runtime();
+#endif
+        return std::move(m_output);
+    }
+
+    // Operators value numbering saved, net of the ones it spent computing
+    // shared values into their slots. Complete once finish() has returned.
+    [[nodiscard]] u64 ops_removed() const
+    {
+        return m_changes[Pass::CSE] > 0 ? static_cast<u64>(m_changes[Pass::CSE]) : 0;
+    }
+
+    // What each code generation pass changed in the code that was kept, in
+    // the units of PassInfo. Complete once finish() has returned.
+    [[nodiscard]] const PassCounts &pass_changes() const
+    {
+        return m_changes;
+    }
+
+    // Nanoseconds spent in each pass with GenOptions::time_passes. A pass
+    // nested in another (a call inlined into a hoisted expression) is
+    // charged to the inner one only.
+    [[nodiscard]] const PassCounts &pass_time() const
+    {
+        return m_pass_ns;
+    }
+
+    [[nodiscard]] AsmBuffer generate()
+    {
+        begin();
+        for (const NodeStmt *s : m_prog.stmts)
+            gen_stmt(s);
+        return finish();
+    }
+
+#if defined(IPLATFORM_LINUX)
+    // A program the compiler has already run (-O3): what it wrote to stdout
+    // as one .rodata blob, a single write(2) of it (repeated only if it comes
+    // back short), the index error message if that is how it ended, and the
+    // exit.
+    [[nodiscard]] static AsmBuffer precomputed(const std::string &output, bool index_error, u8 status)
+    {
+        AsmBuffer out;
+        out << "section .text\nglobal _start\n_start:\n";
+        if (!output.empty())
         {
-            m_output << "    mov rdi, 0\n";
+            out << "    lea rsi, [rel yz_result]\n";
+            out << "    mov rdx, " << output.size() << "\n";
+            out << ".rest:\n";
+            out << "    mov eax, 1\n";
+            out << "    mov edi, 1\n";
+            out << "    syscall\n";
+            out << "    test rax, rax\n";
+            out << "    jle .sent\n";
+            out << "    add rsi, rax\n";
+            out << "    sub rdx, rax\n";
+            out << "    jnz .rest\n";
+            out << ".sent:\n";
         }
-        m_output << "    syscall\n";
-#endif
-        return m_output.str();
+        if (index_error)
+        {
+            out << "    mov eax, 1\n";
+            out << "    mov edi, 2\n";
+            out << "    lea rsi, [rel yz_index_msg]\n";
+            out << "    mov edx, 20\n";
+            out << "    syscall\n";
+        }
+        out << "    mov eax, 60\n";
+        out << "    mov edi, " << static_cast<int>(status) << "\n";
+        out << "    syscall\n";
+
+        out << "\nsection .rodata\n";
+        if (index_error)
+            out << "yz_index_msg: db \"Index out of bounds\", 10\n";
+        if (output.empty())
+            return out;
+        // The output is digits, '-' and newlines; anything else that could
+        // not sit in a string is written as a number.
+        out << "yz_result:\n";
+        for (size_t line = 0; line < output.size(); line += 64)
+        {
+            out << "    db ";
+            bool quoted = false;
+            for (size_t i = line; i < std::min(output.size(), line + 64); i++)
+            {
+                unsigned char c = static_cast<unsigned char>(output[i]);
+                bool plain = c >= 0x20 && c < 0x7f && c != '"';
+                if (plain != quoted)
+                    out << (plain ? (i > line ? ", \"" : "\"") : "\", ");
+                else if (!plain && i > line)
+                    out << ", ";
+                quoted = plain;
+                if (plain)
+                    out << c;
+                else
+                    out << static_cast<int>(c);
+            }
+            out << (quoted ? "\"\n" : "\n");
+        }
+        return out;
     }
+#endif
 
 private:
-    void push(const std::string &reg)
+#if defined(IPLATFORM_LINUX)
+    // Size of the .bss buffer that `out` appends to before a write(2) is issued.
+    static constexpr size_t OUT_BUFFER_SIZE = 1024 * 1024;
+
+    // Everything a program does on its way out before the exit syscall.
+    void gen_exit_flush()
+    {
+        m_output << "    call yz_flush\n";
+        if (!m_opts.profile_path.empty())
+            m_output << "    call yz_prof_dump\n";
+    }
+
+    static constexpr size_t NO_COUNTER = ~size_t(0);
+    static constexpr u32 DROPPED_SITE = ~0u; // in a copy of a call that is not used
+
+    // One profile site for the statement at `offset`. Statements that follow
+    // each other without control flow in between run equally often, so only
+    // the first of such a run bumps a counter and the rest share it. The
+    // first statement of an innermost loop body counts in a register instead
+    // (see gen_while). Returns the counter.
+    size_t count_stmt(u32 offset)
+    {
+        if (m_prof_run == NO_COUNTER)
+        {
+            m_prof_run = m_prof_counters++;
+            if (m_prof_loop_reg)
+                m_output << "    inc " << m_prof_loop_reg << "\n";
+            else
+                m_output << "    inc QWORD [rel yz_prof_counts + " << m_prof_run * 8 << "]\n";
+            m_prof_loop_reg = nullptr;
+        }
+        m_prof_sites.push_back({offset, static_cast<u32>(m_prof_run)});
+        return m_prof_run;
+    }
+
+    // Whether the statement after `stmt` may run a different number of times.
+    // There is no `break`, so only a return or an exit can make it; an exit
+    // inside a called function is left out and may leave the rest of the run
+    // counted once too often.
+    static bool ends_run(const NodeStmt *stmt)
+    {
+        if (std::holds_alternative<NodeStmtReturn *>(stmt->var) || std::holds_alternative<NodeStmtExit *>(stmt->var))
+            return true;
+        const NodeStmtBlock *body = nullptr;
+        if (auto block = std::get_if<NodeStmtBlock *>(&stmt->var))
+            body = *block;
+        else if (auto loop = std::get_if<NodeStmtWhile *>(&stmt->var))
+            body = (*loop)->body;
+        return body && std::any_of(body->stmts.begin(), body->stmts.end(), ends_run);
+    }
+
+    static bool has_call(const NodeExpr *expr)
+    {
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                return has_call((*paren)->expr);
+            if (const NodeTermIndex *const *index = std::get_if<NodeTermIndex *>(&(*term)->var))
+                return has_call((*index)->index);
+            return std::holds_alternative<NodeTermCall *>((*term)->var);
+        }
+        return std::visit([](const auto *op)
+                          { return has_call(op->lhs) || has_call(op->rhs); },
+                          std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    // Whether `stmt` may need r10: a call clobbers it, and so may an
+    // element-wise loop over arrays. Nothing else the generator emits does,
+    // yz_out included, unless the top of the stack is cached in it.
+    bool may_use_r10(const NodeStmt *stmt) const
+    {
+        if (std::holds_alternative<NodeStmtArray *>(stmt->var))
+            return true;
+        if (auto assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+        {
+            size_t offset;
+            const Var *var = find_var((*assign)->ident.value.value(), &offset);
+            return (var && var->array_len) || has_call((*assign)->expr);
+        }
+        if (auto let = std::get_if<NodeStmtLet *>(&stmt->var))
+            return has_call((*let)->expr);
+        if (auto print = std::get_if<NodeStmtOut *>(&stmt->var))
+            return has_call((*print)->expr);
+        if (auto expr_stmt = std::get_if<NodeStmtExpr *>(&stmt->var))
+            return has_call((*expr_stmt)->expr);
+        if (auto element = std::get_if<NodeStmtIndexAssign *>(&stmt->var))
+            return has_call((*element)->index) || has_call((*element)->expr);
+        if (auto block = std::get_if<NodeStmtBlock *>(&stmt->var))
+            for (const NodeStmt *s : (*block)->stmts)
+                if (may_use_r10(s))
+                    return true;
+        return false;
+    }
+
+    // Whether `expr` calls a function with a loop or an exit in it.
+    bool calls_control_flow(const NodeExpr *expr) const
+    {
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                return calls_control_flow((*paren)->expr);
+            if (const NodeTermIndex *const *index = std::get_if<NodeTermIndex *>(&(*term)->var))
+                return calls_control_flow((*index)->index);
+            if (const NodeTermCall *const *call = std::get_if<NodeTermCall *>(&(*term)->var))
+            {
+                auto it = m_fn_index.find((*call)->ident.value.value());
+                if (it != m_fn_index.end() && m_functions[it->second].control_flow)
+                    return true;
+                return std::any_of((*call)->args.begin(), (*call)->args.end(), [&](const NodeExpr *arg)
+                                   { return calls_control_flow(arg); });
+            }
+            return false;
+        }
+        return std::visit([&](const auto *op)
+                          { return calls_control_flow(op->lhs) || calls_control_flow(op->rhs); },
+                          std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    // Whether `stmt` contains a loop, a function definition or an exit, calls
+    // a function that does, or (with `returns`) can return.
+    bool has_control_flow(const NodeStmt *stmt, bool returns = true) const
+    {
+        if (std::holds_alternative<NodeStmtWhile *>(stmt->var) || std::holds_alternative<NodeStmtExit *>(stmt->var) ||
+            std::holds_alternative<NodeStmtFn *>(stmt->var))
+            return true;
+        if (auto ret = std::get_if<NodeStmtReturn *>(&stmt->var))
+            return returns || calls_control_flow((*ret)->expr);
+        if (auto let = std::get_if<NodeStmtLet *>(&stmt->var))
+            return calls_control_flow((*let)->expr);
+        if (auto print = std::get_if<NodeStmtOut *>(&stmt->var))
+            return calls_control_flow((*print)->expr);
+        if (auto assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+            return calls_control_flow((*assign)->expr);
+        if (auto expr_stmt = std::get_if<NodeStmtExpr *>(&stmt->var))
+            return calls_control_flow((*expr_stmt)->expr);
+        if (auto array = std::get_if<NodeStmtArray *>(&stmt->var))
+            return (*array)->init && calls_control_flow((*array)->init);
+        if (auto element = std::get_if<NodeStmtIndexAssign *>(&stmt->var))
+            return calls_control_flow((*element)->index) || calls_control_flow((*element)->expr);
+        if (auto block = std::get_if<NodeStmtBlock *>(&stmt->var))
+            for (const NodeStmt *s : (*block)->stmts)
+                if (has_control_flow(s, returns))
+                    return true;
+        return false;
+    }
+
+    // The profile file is "YZPROF1\0" and the source hash, site count and
+    // counter count as u64s, then every site as its source offset and counter
+    // index (u32 each), then every counter as a u64.
+    void gen_profile_runtime()
+    {
+        m_prof_sites.erase(std::remove_if(m_prof_sites.begin(), m_prof_sites.end(), [](const std::pair<u32, u32> &site)
+                                          { return site.second == DROPPED_SITE; }),
+                           m_prof_sites.end());
+        size_t sites = m_prof_sites.size();
+        m_output << "\nsection .bss\n";
+        m_output << "    alignb 64\n";
+        m_output << "yz_prof_counts: resq " << std::max<size_t>(m_prof_counters, 1) << "\n";
+
+        m_output << "\nsection .rodata\n";
+        m_output << "yz_prof_path: db ";
+        for (char c : m_opts.profile_path)
+            m_output << static_cast<int>(static_cast<unsigned char>(c)) << ", ";
+        m_output << "0\n";
+        m_output << "    align 8\n";
+        m_output << "yz_prof_head: db \"YZPROF1\", 0\n";
+        char hash[24];
+        snprintf(hash, sizeof(hash), "0x%016llx", static_cast<unsigned long long>(m_opts.profile_source_hash));
+        m_output << "    dq " << hash << ", " << sites << ", " << m_prof_counters << "\n";
+        for (size_t i = 0; i < sites; i += 8)
+        {
+            m_output << "    dd ";
+            for (size_t j = i; j < std::min(sites, i + 8); j++)
+                m_output << (j > i ? ", " : "") << m_prof_sites[j].first << ", " << m_prof_sites[j].second;
+            m_output << "\n";
+        }
+
+        // yz_prof_dump: writes the profile file. A failure to open it is
+        // ignored, the program's exit status stays its own.
+        // Clobbers rax, rcx, rdx, rsi, rdi, r8, r11.
+        m_output << "\nsection .text\n";
+        m_output << "yz_prof_dump:\n";
+        m_output << "    mov eax, 2\n";
+        m_output << "    lea rdi, [rel yz_prof_path]\n";
+        m_output << "    mov esi, 577\n"; // O_WRONLY | O_CREAT | O_TRUNC
+        m_output << "    mov edx, 420\n"; // 0644
+        m_output << "    syscall\n";
+        m_output << "    test rax, rax\n";
+        m_output << "    js .unopened\n";
+        m_output << "    mov r8, rax\n";
+        m_output << "    mov rdi, r8\n";
+        m_output << "    lea rsi, [rel yz_prof_head]\n";
+        m_output << "    mov rdx, " << 32 + sites * 8 << "\n";
+        m_output << "    mov eax, 1\n";
+        m_output << "    syscall\n";
+        m_output << "    mov rdi, r8\n";
+        m_output << "    lea rsi, [rel yz_prof_counts]\n";
+        m_output << "    mov rdx, " << m_prof_counters * 8 << "\n";
+        m_output << "    mov eax, 1\n";
+        m_output << "    syscall\n";
+        m_output << "    mov rdi, r8\n";
+        m_output << "    mov eax, 3\n";
+        m_output << "    syscall\n";
+        m_output << ".unopened:\n";
+        m_output << "    ret\n";
+    }
+
+    void gen_runtime()
+    {
+        if (!m_opts.profile_path.empty())
+            gen_profile_runtime();
+        m_output << "\nsection .bss\n";
+        m_output << "    alignb 64\n";
+        m_output << "yz_out_buf: resb " << OUT_BUFFER_SIZE << "\n";
+        m_output << "yz_out_len: resq 1\n";
+        for (const auto &[symbol, len] : m_static_arrays)
+        {
+            m_output << "    alignb 64\n";
+            m_output << symbol << ": resq " << len << "\n";
+        }
+
+        m_output << "\nsection .rodata\n";
+        m_output << "yz_digit_pairs: db \"";
+        for (int i = 0; i < 100; i++)
+            m_output << static_cast<char>('0' + i / 10) << static_cast<char>('0' + i % 10);
+        m_output << "\"\n";
+        m_output << "    align 8\n";
+        m_output << "yz_pow10: dq ";
+        u64 pow10 = 10;
+        for (int i = 0; i < 19; i++, pow10 *= 10)
+            m_output << (i ? ", " : "") << pow10;
+        m_output << "\n";
+        if (m_index_checked)
+            m_output << "yz_index_msg: db \"Index out of bounds\", 10\n";
+
+        // yz_out: rax = signed value. Appends its decimal form and a newline to
+        // yz_out_buf, flushing first if a worst-case number might not fit.
+        // Clobbers rax, rcx, rdx, rsi, rdi, r8, r11.
+        m_output << "\nsection .text\n";
+        m_output << "yz_out:\n";
+        m_output << "    mov rsi, QWORD [rel yz_out_len]\n";
+        m_output << "    cmp rsi, " << OUT_BUFFER_SIZE - 21 << "\n";
+        m_output << "    jbe .room\n";
+        m_output << "    push rax\n";
+        m_output << "    call yz_flush\n";
+        m_output << "    pop rax\n";
+        m_output << "    xor esi, esi\n";
+        m_output << ".room:\n";
+        m_output << "    lea rdi, [rel yz_out_buf]\n";
+        m_output << "    add rdi, rsi\n";
+        m_output << "    test rax, rax\n";
+        m_output << "    jns .count\n";
+        m_output << "    mov BYTE [rdi], '-'\n";
+        m_output << "    inc rdi\n";
+        m_output << "    neg rax\n";
+        // From here on rax is treated as unsigned, which keeps INT64_MIN correct.
+        m_output << ".count:\n";
+        m_output << "    lea r8, [rel yz_pow10]\n";
+        m_output << "    mov ecx, 1\n";
+        m_output << ".count_loop:\n";
+        m_output << "    cmp rax, QWORD [r8 + rcx * 8 - 8]\n";
+        m_output << "    jb .counted\n";
+        m_output << "    inc ecx\n";
+        m_output << "    cmp ecx, 20\n";
+        m_output << "    jb .count_loop\n";
+        m_output << ".counted:\n";
+        m_output << "    lea rsi, [rdi + rcx]\n";
+        m_output << "    mov BYTE [rsi], 10\n";
+        m_output << "    lea r11, [rsi + 1]\n";
+        m_output << "    lea r8, [rel yz_digit_pairs]\n";
+        m_output << ".pairs:\n";
+        m_output << "    cmp rax, 100\n";
+        m_output << "    jb .tail\n";
+        m_output << "    mov rcx, rax\n";
+        // rax / 100 through the reciprocal, the same sequence compilers emit.
+        m_output << "    shr rax, 2\n";
+        m_output << "    mov rdx, 0x28F5C28F5C28F5C3\n";
+        m_output << "    mul rdx\n";
+        m_output << "    shr rdx, 2\n";
+        m_output << "    mov rax, rdx\n";
+        m_output << "    imul rdx, rdx, 100\n";
+        m_output << "    sub rcx, rdx\n";
+        m_output << "    movzx edx, WORD [r8 + rcx * 2]\n";
+        m_output << "    sub rsi, 2\n";
+        m_output << "    mov WORD [rsi], dx\n";
+        m_output << "    jmp .pairs\n";
+        m_output << ".tail:\n";
+        m_output << "    cmp rax, 10\n";
+        m_output << "    jb .one\n";
+        m_output << "    movzx edx, WORD [r8 + rax * 2]\n";
+        m_output << "    mov WORD [rsi - 2], dx\n";
+        m_output << "    jmp .done\n";
+        m_output << ".one:\n";
+        m_output << "    add eax, '0'\n";
+        m_output << "    mov BYTE [rsi - 1], al\n";
+        m_output << ".done:\n";
+        m_output << "    lea rax, [rel yz_out_buf]\n";
+        m_output << "    sub r11, rax\n";
+        m_output << "    mov QWORD [rel yz_out_len], r11\n";
+        m_output << "    ret\n";
+
+        // yz_flush: writes the pending buffer to fd 1, retrying short writes.
+        m_output << "\nyz_flush:\n";
+        m_output << "    mov rdx, QWORD [rel yz_out_len]\n";
+        m_output << "    lea rsi, [rel yz_out_buf]\n";
+        m_output << ".write:\n";
+        m_output << "    test rdx, rdx\n";
+        m_output << "    jz .written\n";
+        m_output << "    mov eax, 1\n";
+        m_output << "    mov edi, 1\n";
+        m_output << "    syscall\n";
+        m_output << "    test rax, rax\n";
+        m_output << "    jle .written\n";
+        m_output << "    add rsi, rax\n";
+        m_output << "    sub rdx, rax\n";
+        m_output << "    jmp .write\n";
+        m_output << ".written:\n";
+        m_output << "    mov QWORD [rel yz_out_len], 0\n";
+        m_output << "    ret\n";
+
+        if (m_index_checked)
+        {
+            // yz_index_error: flushes `out`, reports to stderr and exits with status 1.
+            m_output << "\nyz_index_error:\n";
+            gen_exit_flush();
+            m_output << "    mov eax, 1\n";
+            m_output << "    mov edi, 2\n";
+            m_output << "    lea rsi, [rel yz_index_msg]\n";
+            m_output << "    mov edx, 20\n";
+            m_output << "    syscall\n";
+            m_output << "    mov eax, 60\n";
+            m_output << "    mov edi, 1\n";
+            m_output << "    syscall\n";
+        }
+    }
+#endif
+
+    // With GenOptions::cache_tos the top two entries of the expression stack
+    // are kept in TOS_REGS, deepest first in m_cached, and only the entries
+    // below them are on the machine stack. A push into a full cache spills
+    // its deepest entry; spill_cache() writes all of it back before anything
+    // that needs the stack in memory: a new slot, a call, or a jump.
+    //
+    // The `mov` a push() emits is taken back if the value is popped or
+    // spilled right after it, while it is still in the pushed register.
+    static constexpr const char *TOS_REGS[] = {"r10", "r11"};
+
+    struct CachedPush
+    {
+        std::string reg; // what the top of the stack was copied from
+        size_t start = 0;
+        size_t end = SIZE_MAX; // m_output size after the copy
+    };
+
+    void push(std::string_view reg)
     {
 #if defined(IPLATFORM_LINUX)
-        m_output << "    push " << reg << "\n";
+        if (m_cache_tos)
+        {
+            if (m_cached.size() == 2)
+            {
+                m_output << "    push " << m_cached.front() << "\n";
+                m_cached.erase(m_cached.begin());
+            }
+            const char *tos = !m_cached.empty() && m_cached.back() == TOS_REGS[0] ? TOS_REGS[1] : TOS_REGS[0];
+            m_last_push.reg = reg;
+            m_last_push.start = m_output.size();
+            m_output << "    mov " << tos << ", " << reg << "\n";
+            m_last_push.end = m_output.size();
+            m_cached.push_back(tos);
+        }
+        else
+            m_output << "    push " << reg << "\n";
 #elif defined(IPLATFORM_WINDOWS)
         m_output << "    pushq %" << reg << "\n";
 #endif
         m_stack_size++;
     }
 
-    void pop(const std::string &reg)
+    void pop(std::string_view reg)
     {
 #if defined(IPLATFORM_LINUX)
-        m_output << "    pop " << reg << "\n";
+        if (!m_cached.empty())
+        {
+            m_changes[Pass::TOS_CACHE]++;
+            if (take_back_push())
+            {
+                if (m_last_push.reg != reg)
+                    m_output << "    mov " << reg << ", " << m_last_push.reg << "\n";
+            }
+            else
+                m_output << "    mov " << reg << ", " << m_cached.back() << "\n";
+            m_cached.pop_back();
+        }
+        else
+            m_output << "    pop " << reg << "\n";
 #elif defined(IPLATFORM_WINDOWS)
         m_output << "    popq %" << reg << "\n";
 #endif
         m_stack_size--;
     }
 
+    void spill_cache()
+    {
+        bool taken_back = !m_cached.empty() && take_back_push();
+        for (size_t i = 0; i < m_cached.size(); i++)
+        {
+            bool top = i + 1 == m_cached.size();
+            m_output << "    push " << (top && taken_back ? m_last_push.reg.c_str() : m_cached[i]) << "\n";
+        }
+        m_cached.clear();
+    }
+
+    // Removes the copy the last push() made if nothing has been emitted since.
+    bool take_back_push()
+    {
+        bool last = m_output.size() == m_last_push.end && m_output.truncate(m_last_push.start);
+        m_last_push.end = SIZE_MAX;
+        return last;
+    }
+
+    // The slot of the value just pushed, which becomes a variable and so has
+    // to be in memory.
+    size_t top_slot()
+    {
+        spill_cache();
+        return m_stack_size - 1;
+    }
+
     struct Var
     {
-        std::string name;
+        std::string name; // empty for values hoisted out of a loop
         size_t stack_loc; // For Linux: offset from stack top. For Windows: index for rbp offset.
+        bool is_mutable = false;
+        const char *reg = nullptr; // while a loop keeps the value in a register
+        size_t slots = 1;          // stack slots taken, 0 for arrays in .bss
+        size_t array_len = 0;      // element count, for arrays
+        std::string symbol;        // .bss label of an array declared outside functions
+        const char *base_reg = nullptr; // while an element-wise loop holds the array's address
+        u8 size = 8;               // bytes of a sized value (i8 to i32), which sits in the low bytes...
+        u8 byte = 0;               // ...or `byte` bytes into a slot it shares with other sized values
     };
 
     std::vector<Var> m_vars{};
     std::vector<size_t> m_scopes{};
 
+    // Where `return` goes: the epilogue of an out-of-line function, or the end
+    // of an inlined copy whose parameters start at stack slot `base`.
+    struct FnContext
+    {
+        std::string ret_label;
+        size_t base = 0;
+        bool inlined = false;
+        bool jumped = false;
+    };
+
+    // The per-function part of the generator state. An out-of-line function
+    // body is generated in a fresh one, swapped in for the duration.
+    struct Frame
+    {
+        AsmBuffer output;
+        std::vector<Var> vars;
+        std::vector<size_t> scopes;
+        size_t stack_size = 0;
+        size_t frame_start = 0;
+        std::unordered_map<const NodeExpr *, size_t> hoisted;
+        std::unordered_map<const NodeExpr *, size_t> value_of;
+        std::unordered_map<size_t, size_t> available;
+        std::vector<size_t> available_order;
+        std::vector<const char *> free_regs = LOOP_REGS;
+        std::vector<const char *> used_regs;
+        FnContext *fn_ctx = nullptr;
+    };
+
+    void swap_frame(Frame &frame)
+    {
+        m_output.swap(frame.output);
+        m_last_push.end = SIZE_MAX;
+        m_vars.swap(frame.vars);
+        m_scopes.swap(frame.scopes);
+        std::swap(m_stack_size, frame.stack_size);
+        std::swap(m_frame_start, frame.frame_start);
+        m_hoisted.swap(frame.hoisted);
+        m_value_of.swap(frame.value_of);
+        m_available.swap(frame.available);
+        m_available_order.swap(frame.available_order);
+        m_free_regs.swap(frame.free_regs);
+        m_used_regs.swap(frame.used_regs);
+        std::swap(m_fn_ctx, frame.fn_ctx);
+    }
+
     void push_scope()
     {
         m_scopes.push_back(m_vars.size());
     }
 
+    // --verify-each: between two statements of a frame the stack holds its
+    // variables and nothing else, all of it in memory. Inlined bodies share
+    // the stack with the caller's operands and are left out.
+    void verify_stack() const
+    {
+        if (m_inline_depth > 0)
+            return;
+        size_t slots = 0;
+        for (const Var &var : m_vars)
+            slots += var.slots;
+        if (slots != m_stack_size || !m_cached.empty())
+        {
+            throw CompileError("--verify-each: the stack is " + std::to_string(m_stack_size) + " slots (" +
+                               std::to_string(m_cached.size()) + " in registers) after the statement, its variables take " +
+                               std::to_string(slots));
+        }
+    }
+
     void pop_scope()
     {
         size_t pop_count = m_vars.size() - m_scopes.back();
-        if (pop_count > 0)
+        size_t slots = 0;
+        for (size_t i = 0; i < pop_count; i++)
+        {
+            slots += m_vars.back().slots;
+            m_vars.pop_back();
+        }
+        if (slots > 0)
         {
 #if defined(IPLATFORM_WINDOWS)
-            m_output << "    addq $" << (pop_count * 8) << ", %rsp\n";
+            m_output << "    addq $" << (slots * 8) << ", %rsp\n";
 #elif defined(IPLATFORM_LINUX)
-            m_output << "    add rsp, " << (pop_count * 8) << "\n";
+            m_output << "    add rsp, " << (slots * 8) << "\n";
 #endif
-            m_stack_size -= pop_count;
-            for (size_t i = 0; i < pop_count; i++)
-            {
-                m_vars.pop_back();
-            }
+            m_stack_size -= slots;
         }
         m_scopes.pop_back();
+        // Values computed in the scope are gone with their slots.
+        while (!m_available_order.empty() && m_available[m_available_order.back()] >= m_vars.size())
+        {
+            m_available.erase(m_available_order.back());
+            m_available_order.pop_back();
+        }
+    }
+
+    // Attributes the code that follows to `line` (0 for none) in the line table.
+    std::string line_directive(u32 line) const
+    {
+#if defined(IPLATFORM_WINDOWS)
+        return "    .loc 1 " + std::to_string(line) + "\n";
+#else
+        return "%line " + std::to_string(line) + "+0 " + m_opts.source_path + "\n";
+#endif
+    }
+
+    // Starts the code of the statement at `offset`. Besides the line, a local
+    // symbol lets a profiler that only reads the symbol table tell statements apart.
+    void mark_stmt(u32 offset)
+    {
+        u32 line = m_opts.lines->locate(offset).line;
+        m_output << line_directive(line);
+        m_output << "yz_L" << line << "_" << m_label_count++ << ":\n";
+    }
+
+    // Throws if `ident` is already declared in the current scope.
+    void check_new_name(const Token &ident) const
+    {
+        const std::string &name = ident.value.value();
+        auto it = std::find_if(m_vars.cbegin(), m_vars.cend(), [&](const Var &var)
+                               {
+            bool in_current_scope = false;
+            if (!m_scopes.empty()) {
+                size_t current_scope_start_index = m_scopes.back();
+                // This determines if the variable 'var' is inside the current scope
+                size_t var_index = &var - &m_vars[0];
+                if (var_index >= current_scope_start_index) {
+                    in_current_scope = true;
+                }
+            } else { // Global scope
+                in_current_scope = true;
+            }
+            return in_current_scope && var.name == name; });
+
+        if (it != m_vars.cend())
+        {
+            throw CompileError("Identifier already used in this scope: " + name, ident.offset);
+        }
     }
 
     const Var *find_var(const std::string &name, size_t *out_offset) const
     {
-        auto it = std::find_if(m_vars.crbegin(), m_vars.crend(), [&](const Var &var)
+        // Names of the caller are not visible in an inlined function body.
+        auto first = m_vars.crend() - static_cast<std::ptrdiff_t>(m_frame_start);
+        auto it = std::find_if(m_vars.crbegin(), first, [&](const Var &var)
                                { return var.name == name; });
 
-        if (it == m_vars.crend())
+        if (it == first)
         {
             return nullptr;
         }
 
         const Var &var = *it;
-#if defined(IPLATFORM_WINDOWS)
-        // For Windows, offset is from RBP. stack_loc is the Nth variable declared.
+        *out_offset = var_offset(var);
+        return &var;
+    }
+
+    [[nodiscard]] size_t var_offset(const Var &var) const
+    {
+#if defined(IPLATFORM_WINDOWS)
+        // For Windows, offset is from RBP. stack_loc is the Nth variable declared.
         // The +1 is because RBP is pushed first, so first var is at rbp-8
-        *out_offset = (&var - &m_vars[0] + 1) * 8;
+        return (&var - &m_vars[0] + 1) * 8;
 #elif defined(IPLATFORM_LINUX)
-        // For Linux, offset is from RSP.
-        *out_offset = (m_stack_size - var.stack_loc - 1) * 8;
+        // For Linux, offset is from RSP, past the entries held in registers.
+        return (m_stack_size - m_cached.size() - var.stack_loc - 1) * 8;
 #endif
-        return &var;
+    }
+
+    void push_var(const Var &var)
+    {
+#if defined(IPLATFORM_WINDOWS)
+        m_output << "    movl -" << var_offset(var) << "(%rbp), %eax\n";
+        push("rax");
+#elif defined(IPLATFORM_LINUX)
+        if (var.reg)
+        {
+            push(var.reg);
+            return;
+        }
+        load_var("rax", var);
+        push("rax");
+#endif
+    }
+
+    static constexpr const char *SIZE_NAMES[] = {"", "BYTE", "WORD", "", "DWORD", "", "", "", "QWORD"};
+
+    // The stack memory a variable lives in, as an operand of its own size.
+    [[nodiscard]] std::string var_mem(const Var &var) const
+    {
+        return std::string(SIZE_NAMES[var.size]) + " [rsp + " + std::to_string(var_offset(var) + var.byte) + "]";
+    }
+
+    // The low `size` bytes of a 64-bit register.
+    static std::string sub_reg(std::string_view reg, u8 size)
+    {
+        if (size == 8)
+            return std::string(reg);
+        if (reg[1] >= '0' && reg[1] <= '9') // r8-r15
+            return std::string(reg) + (size == 4 ? "d" : size == 2 ? "w" : "b");
+        std::string low(reg.substr(1));
+        if (size == 4)
+            return "e" + low;
+        if (size == 2)
+            return low;
+        return low[1] == 'x' ? low.substr(0, 1) + "l" : low + "l"; // al, bl, cl, dl, sil, dil
+    }
+
+#if defined(IPLATFORM_LINUX)
+    // Sized values are kept sign-extended in registers, so a load widens them.
+    void load_var(const char *reg, const Var &var)
+    {
+        const char *op = var.size == 8 ? "mov" : var.size == 4 ? "movsxd" : "movsx";
+        m_output << "    " << op << " " << reg << ", " << var_mem(var) << "\n";
+    }
+
+    // Stores rax into a variable, wrapping it around to the variable's size.
+    void store_rax(const Var &var)
+    {
+        if (!var.reg)
+            m_output << "    mov " << var_mem(var) << ", " << sub_reg("rax", var.size) << "\n";
+        else if (var.size == 8)
+            m_output << "    mov " << var.reg << ", rax\n";
+        else
+            m_output << "    " << (var.size == 4 ? "movsxd " : "movsx ") << var.reg << ", " << sub_reg("rax", var.size) << "\n";
+    }
+
+    // A sized let shares the slot of the sized value declared just before it
+    // in the same scope when it fits there at its natural alignment.
+    // Otherwise it takes a slot of its own, the value's low bytes.
+    void gen_sized_let(const NodeStmtLet *let)
+    {
+        m_narrow = let->size <= 4;
+        gen_expr(let->expr);
+        m_narrow = false;
+        Var var{.name = let->ident.value.value(), .stack_loc = 0, .is_mutable = let->is_mutable,
+                .size = let->size};
+        size_t scope_start = m_scopes.empty() ? 0 : m_scopes.back();
+        if (m_vars.size() > std::max(scope_start, m_frame_start))
+        {
+            const Var &prev = m_vars.back();
+            size_t byte = (prev.byte + prev.size + let->size - 1) / let->size * let->size;
+            if (prev.size < 8 && !prev.name.empty() && !prev.reg && byte + let->size <= 8)
+            {
+                pop("rax");
+                var.stack_loc = prev.stack_loc;
+                var.slots = 0;
+                var.byte = static_cast<u8>(byte);
+                m_output << "    mov " << var_mem(var) << ", " << sub_reg("rax", var.size) << "\n";
+            }
+        }
+        if (var.slots)
+            var.stack_loc = top_slot();
+        m_vars.push_back(var);
+    }
+#elif defined(IPLATFORM_WINDOWS)
+    void gen_sized_let(const NodeStmtLet *let)
+    {
+        throw CompileError("Sized types are not supported on Windows yet", let->ident.offset);
+    }
+#endif
+
+    // Loops are laid out with the test at the bottom, so an iteration costs a
+    // single conditional jump:
+    //
+    //         <hoisted invariants, counters loaded into registers>
+    //         jmp  cond
+    //     body:
+    //         <body>
+    //     cond:
+    //         <test>, jcc body
+    //         <counters stored back>
+    void gen_while(const NodeStmtWhile *loop)
+    {
+        std::string body = "yz_while_" + std::to_string(m_label_count++);
+        std::string cond = body + "_cond";
+
+        push_scope();
+        std::vector<const NodeExpr *> hoisted;
+        if (m_opts.hoist_invariants)
+            hoist_invariants(loop, hoisted);
+        // The body of an innermost loop that cannot be left halfway counts
+        // its iterations in a register, added to its counter once the loop is
+        // done; a memory increment every iteration would chain through store
+        // forwarding and slow a tight loop down a lot. A body that leaves r10
+        // alone counts in that, any other takes a callee-saved register after
+        // the loop's variables.
+        const char *counter_reg = nullptr;
+        size_t counter = m_prof_counters;
+        bool count_in_reg = !m_opts.profile_path.empty() && !loop->body->stmts.empty() &&
+                            std::none_of(loop->body->stmts.begin(), loop->body->stmts.end(), [&](const NodeStmt *s)
+                                         { return has_control_flow(s); });
+        bool scratch_counter = count_in_reg && !m_cache_tos &&
+                               std::none_of(loop->body->stmts.begin(), loop->body->stmts.end(), [&](const NodeStmt *s)
+                                            { return may_use_r10(s); });
+        if (scratch_counter)
+            counter_reg = "r10";
+        std::vector<size_t> cached =
+            bind_loop_registers(loop, hoisted, count_in_reg && !scratch_counter ? &counter_reg : nullptr);
+        if (counter_reg)
+        {
+            m_output << "    xor " << counter_reg << ", " << counter_reg << "\n";
+            m_prof_loop_reg = counter_reg;
+        }
+        // The condition runs once more than the body.
+        m_prof_nested_run = NO_COUNTER;
+
+        m_output << "    jmp " << cond << "\n";
+        m_output << body << ":\n";
+        push_scope();
+        for (const NodeStmt *s : loop->body->stmts)
+            gen_stmt(s);
+        pop_scope();
+        if (m_opts.lines)
+            mark_stmt(loop->cond->offset);
+        m_output << cond << ":\n";
+        gen_branch_if(loop->cond, body);
+
+        if (counter_reg)
+        {
+            m_output << "    add QWORD [rel yz_prof_counts + " << counter * 8 << "], " << counter_reg << "\n";
+            if (!scratch_counter)
+                m_free_regs.push_back(counter_reg);
+        }
+        PassClock clock(*this, Pass::LOOP_REGS);
+        for (size_t index : cached)
+        {
+            Var &var = m_vars[index];
+#if defined(IPLATFORM_LINUX)
+            if (var.is_mutable)
+                m_output << "    mov " << var_mem(var) << ", " << sub_reg(var.reg, var.size) << "\n";
+#endif
+            m_free_regs.push_back(var.reg);
+            var.reg = nullptr;
+        }
+        for (const NodeExpr *expr : hoisted)
+            m_hoisted.erase(expr);
+        pop_scope();
+    }
+
+    // Jumps to `label` when `cond` is non-zero. A `<` whose operands are
+    // registers, immediates or a single stack slot becomes one cmp + jl.
+    void gen_branch_if(const NodeExpr *cond, const std::string &label)
+    {
+#if defined(IPLATFORM_LINUX)
+        const NodeBinExpr *const *bin = std::get_if<NodeBinExpr *>(&cond->var);
+        const NodeBinExprLess *const *less = bin && !m_hoisted.count(cond) ? std::get_if<NodeBinExprLess *>(&(*bin)->var) : nullptr;
+        if (less)
+        {
+            Operand lhs = operand((*less)->lhs);
+            Operand rhs = operand((*less)->rhs);
+            // A sized variable in memory is only compared with an immediate
+            // that fits it, at its own size.
+            auto wide = [](const Operand &op)
+            { return op.kind != Operand::MEM || op.size == 8; };
+            if (lhs.kind == Operand::REG && rhs.kind != Operand::NONE && wide(rhs))
+                m_output << "    cmp " << lhs.text << ", " << rhs.text << "\n    jl " << label << "\n";
+            else if (rhs.kind == Operand::REG && lhs.kind != Operand::NONE && wide(lhs))
+                m_output << "    cmp " << rhs.text << ", " << lhs.text << "\n    jg " << label << "\n";
+            else if (lhs.kind == Operand::MEM && rhs.kind == Operand::IMM && fits(rhs, lhs.size))
+                m_output << "    cmp " << lhs.text << ", " << rhs.text << "\n    jl " << label << "\n";
+            else
+            {
+                gen_expr((*less)->rhs);
+                gen_expr((*less)->lhs);
+                pop("rbx");
+                pop("rax");
+                m_output << "    cmp rbx, rax\n    jl " << label << "\n";
+            }
+            return;
+        }
+        gen_expr(cond);
+        pop("rax");
+        m_output << "    test rax, rax\n    jnz " << label << "\n";
+#elif defined(IPLATFORM_WINDOWS)
+        gen_expr(cond);
+        pop("rax");
+        m_output << "    testl %eax, %eax\n    jnz " << label << "\n";
+#endif
+    }
+
+    struct Operand
+    {
+        enum Kind
+        {
+            NONE,
+            REG,
+            IMM,
+            MEM
+        } kind = NONE;
+        std::string text;
+        u8 size = 8; // of a MEM operand
+    };
+
+    // `expr` as an instruction operand, if it is a variable or a small literal.
+    Operand operand(const NodeExpr *expr) const
+    {
+        const Var *var = nullptr;
+        auto hoisted = m_hoisted.find(expr);
+        if (hoisted != m_hoisted.end())
+            var = &m_vars[hoisted->second];
+        else if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (const NodeTermIntLit *const *lit = std::get_if<NodeTermIntLit *>(&(*term)->var))
+            {
+                // Nine characters, a '-' from the fold pass included, always
+                // fit the sign-extended 32-bit immediate.
+                const std::string &value = (*lit)->int_lit.value.value();
+                if (value.size() <= 9)
+                    return {Operand::IMM, value};
+                return {};
+            }
+            if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                return operand((*paren)->expr);
+            const NodeTermIdent *const *ident = std::get_if<NodeTermIdent *>(&(*term)->var);
+            if (!ident)
+                return {};
+            size_t offset;
+            var = find_var((*ident)->ident.value.value(), &offset);
+        }
+        if (!var || var->array_len)
+            return {};
+        if (var->reg)
+            return {Operand::REG, var->reg};
+        return {Operand::MEM, var_mem(*var), var->size};
+    }
+
+    // True if an immediate operand is in the range of a signed `size`-byte value.
+    static bool fits(const Operand &imm, u8 size)
+    {
+        if (size >= 4)
+            return true; // literals taken as operands have at most nine characters
+        i64 value = std::stoll(imm.text);
+        return value >= -(1ll << (size * 8 - 1)) && value < (1ll << (size * 8 - 1));
+    }
+
+    // `x = x + a`, `x = a + x`, `x = x - a` and `x = a` become a single add,
+    // sub or mov when `a` is an operand. Returns false if `expr` has another shape.
+    // A sized variable in memory is updated with an operation of its own
+    // size; one in a register is sign-extended again afterwards.
+    bool gen_update(const Var &var, const NodeExpr *expr)
+    {
+        Operand target = var.reg ? Operand{Operand::REG, var.reg} : Operand{Operand::MEM, var_mem(var), var.size};
+        auto usable = [&](const Operand &src)
+        {
+            if (src.kind == Operand::IMM)
+                return fits(src, var.size);
+            return src.kind == Operand::REG || (src.kind == Operand::MEM && src.size == 8 && target.kind == Operand::REG);
+        };
+        auto source = [&](const Operand &src)
+        {
+            return src.kind == Operand::REG && target.kind == Operand::MEM ? sub_reg(src.text, var.size) : src.text;
+        };
+        auto widen = [&]
+        {
+            if (var.reg && var.size < 8)
+                m_output << "    " << (var.size == 4 ? "movsxd " : "movsx ") << var.reg << ", " << sub_reg(var.reg, var.size) << "\n";
+        };
+        auto is_target = [&](const NodeExpr *side)
+        {
+            Operand op = operand(side);
+            return op.kind == target.kind && op.text == target.text;
+        };
+
+        Operand src = operand(expr);
+        if (src.kind != Operand::NONE)
+        {
+            if (!usable(src))
+                return false;
+            if (!is_target(expr))
+            {
+                m_output << "    mov " << target.text << ", " << source(src) << "\n";
+                if (src.kind != Operand::IMM)
+                    widen();
+            }
+            return true;
+        }
+
+        const NodeBinExpr *const *bin = std::get_if<NodeBinExpr *>(&expr->var);
+        if (!bin || m_hoisted.count(expr))
+            return false;
+        const char *op = nullptr;
+        const NodeExpr *other = nullptr;
+        if (const NodeBinExprAdd *const *add = std::get_if<NodeBinExprAdd *>(&(*bin)->var))
+        {
+            op = "add";
+            if (is_target((*add)->lhs))
+                other = (*add)->rhs;
+            else if (is_target((*add)->rhs))
+                other = (*add)->lhs;
+        }
+        else if (const NodeBinExprSub *const *sub = std::get_if<NodeBinExprSub *>(&(*bin)->var))
+        {
+            op = "sub";
+            if (is_target((*sub)->lhs))
+                other = (*sub)->rhs;
+        }
+        if (!other)
+            return false;
+        src = operand(other);
+        if (!usable(src))
+            return false;
+        m_output << "    " << op << " " << target.text << ", " << source(src) << "\n";
+        widen();
+        return true;
+    }
+
+    // Names a loop can change: everything it declares or assigns, nested
+    // blocks and loops included.
+    static void collect_changed(const NodeStmt *stmt, std::unordered_set<std::string> &changed)
+    {
+        if (auto let = std::get_if<NodeStmtLet *>(&stmt->var))
+            changed.insert((*let)->ident.value.value());
+        else if (auto assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+            changed.insert((*assign)->ident.value.value());
+        else if (auto array = std::get_if<NodeStmtArray *>(&stmt->var))
+            changed.insert((*array)->ident.value.value());
+        else if (auto element = std::get_if<NodeStmtIndexAssign *>(&stmt->var))
+            changed.insert((*element)->ident.value.value());
+        else if (auto block = std::get_if<NodeStmtBlock *>(&stmt->var))
+            for (const NodeStmt *s : (*block)->stmts)
+                collect_changed(s, changed);
+        else if (auto loop = std::get_if<NodeStmtWhile *>(&stmt->var))
+            for (const NodeStmt *s : (*loop)->body->stmts)
+                collect_changed(s, changed);
+    }
+
+    // True if `expr` has the same value on every iteration and is safe to
+    // evaluate even if the loop never runs: no division (it could trap), and
+    // every name resolves now to a variable the loop does not change.
+    bool is_invariant(const NodeExpr *expr, const std::unordered_set<std::string> &changed) const
+    {
+        if (m_hoisted.count(expr))
+            return true;
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (std::holds_alternative<NodeTermIntLit *>((*term)->var))
+                return true;
+            if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                return is_invariant((*paren)->expr, changed);
+            // A call may print, so it has to run on every iteration. Array
+            // elements are left alone.
+            if (!std::holds_alternative<NodeTermIdent *>((*term)->var))
+                return false;
+            const std::string &name = std::get<NodeTermIdent *>((*term)->var)->ident.value.value();
+            size_t offset;
+            const Var *var = find_var(name, &offset);
+            return !changed.count(name) && var && !var->array_len;
+        }
+        const NodeBinExpr *bin = std::get<NodeBinExpr *>(expr->var);
+        if (std::holds_alternative<NodeBinExprDiv *>(bin->var))
+            return false;
+        return std::visit([&](const auto *op)
+                          { return is_invariant(op->lhs, changed) && is_invariant(op->rhs, changed); },
+                          bin->var);
+    }
+
+    // Collects the largest invariant operator expressions under `expr`.
+    void collect_invariants(const NodeExpr *expr, const std::unordered_set<std::string> &changed,
+                            std::vector<const NodeExpr *> &out) const
+    {
+        if (m_hoisted.count(expr))
+            return;
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                collect_invariants((*paren)->expr, changed, out);
+            else if (const NodeTermCall *const *call = std::get_if<NodeTermCall *>(&(*term)->var))
+                for (const NodeExpr *arg : (*call)->args)
+                    collect_invariants(arg, changed, out);
+            else if (const NodeTermIndex *const *index = std::get_if<NodeTermIndex *>(&(*term)->var))
+                collect_invariants((*index)->index, changed, out);
+            return;
+        }
+        if (is_invariant(expr, changed))
+        {
+            if (std::find(out.begin(), out.end(), expr) == out.end())
+                out.push_back(expr);
+            return;
+        }
+        std::visit([&](const auto *op)
+                   {
+            collect_invariants(op->lhs, changed, out);
+            collect_invariants(op->rhs, changed, out); },
+                   std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    void collect_invariants(const NodeStmt *stmt, const std::unordered_set<std::string> &changed,
+                            std::vector<const NodeExpr *> &out) const
+    {
+        if (auto exit = std::get_if<NodeStmtExit *>(&stmt->var))
+            collect_invariants((*exit)->expr, changed, out);
+        else if (auto let = std::get_if<NodeStmtLet *>(&stmt->var))
+            collect_invariants((*let)->expr, changed, out);
+        else if (auto print = std::get_if<NodeStmtOut *>(&stmt->var))
+            collect_invariants((*print)->expr, changed, out);
+        else if (auto assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+            collect_invariants((*assign)->expr, changed, out);
+        else if (auto ret = std::get_if<NodeStmtReturn *>(&stmt->var))
+            collect_invariants((*ret)->expr, changed, out);
+        else if (auto expr_stmt = std::get_if<NodeStmtExpr *>(&stmt->var))
+            collect_invariants((*expr_stmt)->expr, changed, out);
+        else if (auto array = std::get_if<NodeStmtArray *>(&stmt->var))
+        {
+            if ((*array)->init)
+                collect_invariants((*array)->init, changed, out);
+        }
+        else if (auto element = std::get_if<NodeStmtIndexAssign *>(&stmt->var))
+        {
+            collect_invariants((*element)->index, changed, out);
+            collect_invariants((*element)->expr, changed, out);
+        }
+        else if (auto block = std::get_if<NodeStmtBlock *>(&stmt->var))
+            for (const NodeStmt *s : (*block)->stmts)
+                collect_invariants(s, changed, out);
+        else if (auto loop = std::get_if<NodeStmtWhile *>(&stmt->var))
+        {
+            collect_invariants((*loop)->cond, changed, out);
+            for (const NodeStmt *s : (*loop)->body->stmts)
+                collect_invariants(s, changed, out);
+        }
+    }
+
+    // Loop-invariant code motion: every invariant expression in the loop is
+    // evaluated once into an unnamed slot of the loop's scope, and gen_expr()
+    // loads the slot instead of recomputing it.
+    void hoist_invariants(const NodeStmtWhile *loop, std::vector<const NodeExpr *> &hoisted)
+    {
+        PassClock clock(*this, Pass::HOIST);
+        std::unordered_set<std::string> changed;
+        for (const NodeStmt *s : loop->body->stmts)
+            collect_changed(s, changed);
+
+        collect_invariants(loop->cond, changed, hoisted);
+        for (const NodeStmt *s : loop->body->stmts)
+            collect_invariants(s, changed, hoisted);
+
+        for (const NodeExpr *expr : hoisted)
+        {
+            gen_expr(expr);
+            m_vars.push_back({.name = "", .stack_loc = top_slot()});
+            m_hoisted[expr] = m_vars.size() - 1;
+        }
+        m_changes[Pass::HOIST] += static_cast<i64>(hoisted.size());
+    }
+
+    static void collect_assigned(const NodeStmt *stmt, std::vector<std::string> &names)
+    {
+        if (auto assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+        {
+            const std::string &name = (*assign)->ident.value.value();
+            if (std::find(names.begin(), names.end(), name) == names.end())
+                names.push_back(name);
+        }
+        else if (auto block = std::get_if<NodeStmtBlock *>(&stmt->var))
+            for (const NodeStmt *s : (*block)->stmts)
+                collect_assigned(s, names);
+        else if (auto loop = std::get_if<NodeStmtWhile *>(&stmt->var))
+            for (const NodeStmt *s : (*loop)->body->stmts)
+                collect_assigned(s, names);
+    }
+
+    // Gives the variables the loop assigns, then the profile counter if
+    // `counter_reg` asks for one, then its hoisted values, one of the free
+    // callee-saved registers each. yz_out preserves r12-r15, so they stay
+    // valid across `out`. Returns the m_vars indices that were given one.
+    std::vector<size_t> bind_loop_registers(const NodeStmtWhile *loop, const std::vector<const NodeExpr *> &hoisted,
+                                            const char **counter_reg = nullptr)
+    {
+        PassClock clock(*this, Pass::LOOP_REGS);
+        std::vector<size_t> cached;
+#if defined(IPLATFORM_LINUX)
+        auto take_counter = [&]
+        {
+            if (!counter_reg || *counter_reg || m_free_regs.empty())
+                return;
+            *counter_reg = m_free_regs.back();
+            m_free_regs.pop_back();
+            if (std::find(m_used_regs.begin(), m_used_regs.end(), *counter_reg) == m_used_regs.end())
+                m_used_regs.push_back(*counter_reg);
+        };
+        if (!m_opts.loop_registers)
+        {
+            take_counter();
+            return cached;
+        }
+
+        std::vector<size_t> candidates;
+        std::vector<std::string> assigned;
+        for (const NodeStmt *s : loop->body->stmts)
+            collect_assigned(s, assigned);
+        for (const std::string &name : assigned)
+        {
+            size_t offset;
+            const Var *var = find_var(name, &offset);
+            if (var && var->is_mutable && !var->array_len)
+                candidates.push_back(var - &m_vars[0]);
+        }
+        size_t assigned_count = candidates.size();
+        for (const NodeExpr *expr : hoisted)
+            candidates.push_back(m_hoisted[expr]);
+
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            if (i == assigned_count)
+                take_counter();
+            Var &var = m_vars[candidates[i]];
+            if (m_free_regs.empty())
+                break;
+            if (var.reg)
+                continue;
+            var.reg = m_free_regs.back();
+            m_free_regs.pop_back();
+            if (std::find(m_used_regs.begin(), m_used_regs.end(), var.reg) == m_used_regs.end())
+                m_used_regs.push_back(var.reg);
+            load_var(var.reg, var);
+            cached.push_back(candidates[i]);
+        }
+        take_counter();
+        m_changes[Pass::LOOP_REGS] += static_cast<i64>(cached.size());
+#endif
+        return cached;
+    }
+
+    // Value numbering. Two expressions get the same number when they are
+    // known to have the same value: literals by their text, `val`s and
+    // hoisted values by their slot, operators by the operator and the numbers
+    // of their operands, sorted for + and *. `var`s, array elements, calls
+    // and division (it could trap) get none. A number is `available` while a
+    // slot holding its value is in scope, and gen_expr() loads the slot
+    // instead of evaluating the expression again. Straight-line code in
+    // enclosing scopes always runs first, so that is the dominance there is.
+    static constexpr size_t NO_VALUE = 0;
+
+    struct ValueKey
+    {
+        char op;
+        size_t lhs;
+        size_t rhs;
+
+        bool operator==(const ValueKey &other) const
+        {
+            return op == other.op && lhs == other.lhs && rhs == other.rhs;
+        }
+    };
+
+    struct ValueKeyHash
+    {
+        size_t operator()(const ValueKey &key) const
+        {
+            return (key.lhs * 0x9e3779b97f4a7c15ULL) ^ (key.rhs * 0xff51afd7ed558ccdULL) ^ static_cast<size_t>(key.op);
+        }
+    };
+
+    size_t value(const ValueKey &key)
+    {
+        return m_values.emplace(key, next_value()).first->second;
+    }
+
+    [[nodiscard]] size_t next_value() const
+    {
+        return m_values.size() + m_literal_values.size() + 1;
+    }
+
+    static size_t operations(const NodeExpr *expr)
+    {
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                return operations((*paren)->expr);
+            return 0;
+        }
+        return 1 + std::visit([](const auto *op)
+                              { return operations(op->lhs) + operations(op->rhs); },
+                              std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    // Occurrences of every operator value in one statement, and the first
+    // expression with each, operands before the operators using them.
+    struct StmtValues
+    {
+        std::unordered_map<size_t, size_t> count;
+        std::vector<const NodeExpr *> first;
+    };
+
+    size_t number_values(const NodeExpr *expr, StmtValues &values)
+    {
+        auto hoisted = m_hoisted.find(expr);
+        if (hoisted != m_hoisted.end())
+            return value({'h', hoisted->second, 0});
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (const NodeTermIntLit *const *lit = std::get_if<NodeTermIntLit *>(&(*term)->var))
+                return m_literal_values.emplace((*lit)->int_lit.value.value(), next_value()).first->second;
+            if (const NodeTermIdent *const *ident = std::get_if<NodeTermIdent *>(&(*term)->var))
+            {
+                size_t offset;
+                const Var *var = find_var((*ident)->ident.value.value(), &offset);
+                if (!var || var->is_mutable || var->array_len || var->base_reg)
+                    return NO_VALUE;
+                return value({'v', static_cast<size_t>(var - &m_vars[0]), 0});
+            }
+            if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+            {
+                size_t number = number_values((*paren)->expr, values);
+                if (number != NO_VALUE && m_value_of.count((*paren)->expr))
+                    m_value_of[expr] = number;
+                return number;
+            }
+            if (const NodeTermCall *const *call = std::get_if<NodeTermCall *>(&(*term)->var))
+                for (const NodeExpr *arg : (*call)->args)
+                    number_values(arg, values);
+            else if (const NodeTermIndex *const *index = std::get_if<NodeTermIndex *>(&(*term)->var))
+                number_values((*index)->index, values);
+            return NO_VALUE;
+        }
+
+        const NodeBinExpr *bin = std::get<NodeBinExpr *>(expr->var);
+        static constexpr char OPS[] = {'+', '*', '/', '-', '<'}; // in NodeBinExpr::var order
+        char op = OPS[bin->var.index()];
+        size_t lhs = std::visit([&](const auto *node)
+                                { return number_values(node->lhs, values); }, bin->var);
+        size_t rhs = std::visit([&](const auto *node)
+                                { return number_values(node->rhs, values); }, bin->var);
+        if (op == '/' || lhs == NO_VALUE || rhs == NO_VALUE)
+            return NO_VALUE;
+        if ((op == '+' || op == '*') && rhs < lhs)
+            std::swap(lhs, rhs);
+        size_t number = value({op, lhs, rhs});
+        m_value_of[expr] = number;
+        if (values.count[number]++ == 0)
+            values.first.push_back(expr);
+        return number;
+    }
+
+    // The expressions of `stmt` itself; nested statements are numbered when
+    // they are generated.
+    template <typename F>
+    static void stmt_exprs(const NodeStmt *stmt, F &&visit)
+    {
+        if (auto exit = std::get_if<NodeStmtExit *>(&stmt->var))
+            visit((*exit)->expr);
+        else if (auto let = std::get_if<NodeStmtLet *>(&stmt->var))
+            visit((*let)->expr);
+        else if (auto print = std::get_if<NodeStmtOut *>(&stmt->var))
+            visit((*print)->expr);
+        else if (auto assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+            visit((*assign)->expr);
+        else if (auto ret = std::get_if<NodeStmtReturn *>(&stmt->var))
+            visit((*ret)->expr);
+        else if (auto expr_stmt = std::get_if<NodeStmtExpr *>(&stmt->var))
+            visit((*expr_stmt)->expr);
+        else if (auto array = std::get_if<NodeStmtArray *>(&stmt->var))
+        {
+            if ((*array)->init)
+                visit((*array)->init);
+        }
+        else if (auto element = std::get_if<NodeStmtIndexAssign *>(&stmt->var))
+        {
+            visit((*element)->index);
+            visit((*element)->expr);
+        }
+    }
+
+    // Runs `gen` with the values of `stmt` numbered. A value the statement
+    // computes more than once and no slot holds yet is first evaluated into
+    // an unnamed slot of the current scope, where later statements find it too.
+    template <typename F>
+    void with_value_numbers(const NodeStmt *stmt, F &&gen)
+    {
+        if (!m_opts.value_numbering)
+        {
+            gen();
+            return;
+        }
+        // A call may generate a whole function body in the middle of the statement.
+        std::unordered_map<const NodeExpr *, size_t> outer;
+        m_value_of.swap(outer);
+        {
+            PassClock clock(*this, Pass::CSE);
+            StmtValues values;
+            stmt_exprs(stmt, [&](const NodeExpr *expr)
+                       { number_values(expr, values); });
+            for (const NodeExpr *expr : values.first)
+            {
+                size_t number = m_value_of[expr];
+                if (values.count[number] < 2 || m_available.count(number))
+                    continue;
+                m_changes[Pass::CSE] -= static_cast<i64>(operations(expr));
+                gen_expr(expr);
+                m_vars.push_back({.name = "", .stack_loc = top_slot()});
+                make_available(expr);
+            }
+        }
+        gen();
+        m_value_of.swap(outer);
+    }
+
+    // Records that the top of m_vars holds the value of `expr`.
+    void make_available(const NodeExpr *expr)
+    {
+        auto number = m_value_of.find(expr);
+        if (number == m_value_of.end() || m_available.count(number->second))
+            return;
+        m_available[number->second] = m_vars.size() - 1;
+        m_available_order.push_back(number->second);
+    }
+
+    // Arrays hold 64-bit integers. Outside functions they live in .bss and
+    // are 64-byte aligned; inside a function they are stack slots and the
+    // padding keeps the first element 16-byte aligned.
+    static constexpr size_t MAX_ARRAY_LEN = size_t(1) << 24;
+    // Registers holding array addresses in an element-wise loop, whose index
+    // is in rcx. The stack-machine operators only touch rax, rbx and rdx.
+    static constexpr const char *ELEM_BASE_REGS[] = {"rsi", "rdi", "r8", "r9", "r10", "r11"};
+    static constexpr size_t ELEM_BASE_REG_COUNT = sizeof(ELEM_BASE_REGS) / sizeof(ELEM_BASE_REGS[0]);
+
+    // `at` is where an error is reported.
+    const Var &array_var(const Token &ident, u32 at) const
+    {
+        const std::string &name = ident.value.value();
+        size_t offset;
+        const Var *var = find_var(name, &offset);
+        if (!var)
+        {
+            throw CompileError("Undeclared identifier: " + name, at);
+        }
+        if (!var->array_len)
+        {
+            throw CompileError("Not an array: " + name, at);
+        }
+        return *var;
+    }
+
+    // Where to report an error found on an expression node. A node shared by
+    // hash-consing stands for every occurrence of its expression and carries
+    // the offset of the first, so the error goes without one and is placed
+    // at the statement it came from.
+    [[nodiscard]] u32 expr_offset(u32 offset) const
+    {
+        return m_opts.shared_nodes ? CompileError::NO_OFFSET : offset;
+    }
+
+    // The index if it is a literal, which is bounds-checked here instead of at run time.
+    std::optional<size_t> const_index(const Var &var, const NodeExpr *index) const
+    {
+        const NodeTerm *const *term = std::get_if<NodeTerm *>(&index->var);
+        const NodeTermIntLit *const *lit = term ? std::get_if<NodeTermIntLit *>(&(*term)->var) : nullptr;
+        if (!lit)
+            return {};
+        const std::string &value = (*lit)->int_lit.value.value();
+        if (value.size() > 9 || std::stoull(value) >= var.array_len)
+        {
+            throw CompileError("Index " + value + " out of bounds for " + var.name + "[" +
+                               std::to_string(var.array_len) + "]",
+                               expr_offset((*lit)->int_lit.offset));
+        }
+        return std::stoull(value);
+    }
+
+    void check_index(const Var &var)
+    {
+        m_output << "    cmp rax, " << var.array_len << "\n";
+        m_output << "    jae yz_index_error\n";
+        m_index_checked = true;
+    }
+
+    // Memory operand of an element: `index`, or the one whose index is in rax.
+    // May emit code, so it has to be called before the instruction is written.
+    std::string element(const Var &var, std::optional<size_t> index)
+    {
+        if (!var.symbol.empty())
+        {
+            if (index)
+                return "QWORD [rel " + var.symbol + " + " + std::to_string(*index * 8) + "]";
+            m_output << "    lea rbx, [rel " << var.symbol << "]\n";
+            return "QWORD [rbx + rax * 8]";
+        }
+        if (index)
+            return "QWORD [rsp + " + std::to_string(var_offset(var) + *index * 8) + "]";
+        return "QWORD [rsp + rax * 8 + " + std::to_string(var_offset(var)) + "]";
+    }
+
+    void lea_array(const Var &var, const char *reg)
+    {
+        if (!var.symbol.empty())
+            m_output << "    lea " << reg << ", [rel " << var.symbol << "]\n";
+        else
+            m_output << "    lea " << reg << ", [rsp + " << var_offset(var) << "]\n";
+    }
+
+    void gen_array(const NodeStmtArray *decl)
+    {
+#if defined(IPLATFORM_WINDOWS)
+        throw CompileError("Arrays are not supported on Windows yet");
+#elif defined(IPLATFORM_LINUX)
+        const std::string &name = decl->ident.value.value();
+        check_new_name(decl->ident);
+        const std::string &size = decl->size.value.value();
+        size_t len = size.size() > 9 ? MAX_ARRAY_LEN + 1 : std::stoull(size);
+        if (len == 0 || len > MAX_ARRAY_LEN)
+        {
+            throw CompileError("Invalid array size for " + name + ": " + size, decl->size.offset);
+        }
+
+        Var var{.name = name, .stack_loc = 0, .is_mutable = true, .slots = 0, .array_len = len};
+        if (!m_fn_ctx)
+        {
+            var.symbol = "yz_arr_" + std::to_string(m_static_arrays.size());
+            m_static_arrays.push_back({var.symbol, len});
+        }
+        else
+        {
+            var.slots = len + (m_stack_size + len) % 2;
+            m_output << "    sub rsp, " << var.slots * 8 << "\n";
+            m_stack_size += var.slots;
+            var.stack_loc = m_stack_size - 1;
+        }
+
+        // The initializer cannot see the array it initializes.
+        if (decl->init)
+            gen_elementwise(var, decl->init);
+        else if (!m_scopes.empty() || var.symbol.empty())
+        {
+            // .bss starts zeroed, so only arrays that can be declared more than once are cleared.
+            lea_array(var, "rdi");
+            m_output << "    mov ecx, " << len << "\n";
+            m_output << "    xor eax, eax\n";
+            m_output << "    rep stosq\n";
+        }
+        m_vars.push_back(std::move(var));
+#endif
+    }
+
+    [[nodiscard]] bool has_array(const NodeExpr *expr) const
+    {
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                return has_array((*paren)->expr);
+            const NodeTermIdent *const *ident = std::get_if<NodeTermIdent *>(&(*term)->var);
+            size_t offset;
+            const Var *var = ident ? find_var((*ident)->ident.value.value(), &offset) : nullptr;
+            return var && var->array_len;
+        }
+        return std::visit([&](const auto *op)
+                          { return has_array(op->lhs) || has_array(op->rhs); },
+                          std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    // The arrays an element-wise expression reads (m_vars indices) and its
+    // largest subexpressions that read none, which are evaluated only once.
+    void collect_elementwise(const NodeExpr *expr, size_t len, std::vector<size_t> &arrays,
+                             std::vector<const NodeExpr *> &scalars) const
+    {
+        if (!has_array(expr))
+        {
+            scalars.push_back(expr);
+            return;
+        }
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+            {
+                collect_elementwise((*paren)->expr, len, arrays, scalars);
+                return;
+            }
+            size_t offset;
+            const Var *var = find_var(std::get<NodeTermIdent *>((*term)->var)->ident.value.value(), &offset);
+            if (var->array_len != len)
+            {
+                throw CompileError("Array length mismatch: " + var->name + " has " + std::to_string(var->array_len) +
+                                   " elements, expected " + std::to_string(len),
+                                   expr_offset((*term)->offset));
+            }
+            size_t index = var - &m_vars[0];
+            if (std::find(arrays.begin(), arrays.end(), index) == arrays.end())
+                arrays.push_back(index);
+            return;
+        }
+        std::visit([&](const auto *op)
+                   {
+            collect_elementwise(op->lhs, len, arrays, scalars);
+            collect_elementwise(op->rhs, len, arrays, scalars); },
+                   std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    // target = expr, element by element. Scalars in `expr` are evaluated once
+    // into hidden slots and broadcast. The elements are computed with vector
+    // instructions when the options allow it and the expression only adds,
+    // subtracts and multiplies; the remaining tail, or every element
+    // otherwise, runs through the ordinary stack-machine code.
+    void gen_elementwise(Var target, const NodeExpr *expr)
+    {
+        size_t len = target.array_len;
+        std::vector<size_t> arrays;
+        std::vector<const NodeExpr *> scalars;
+        collect_elementwise(expr, len, arrays, scalars);
+        if (arrays.size() >= ELEM_BASE_REG_COUNT)
+        {
+            throw CompileError("Too many arrays in one element-wise expression for " + target.name);
+        }
+
+        push_scope();
+        std::vector<const NodeExpr *> evaluated;
+        for (const NodeExpr *scalar : scalars)
+        {
+            if (m_hoisted.count(scalar))
+                continue;
+            gen_expr(scalar);
+            m_vars.push_back({.name = "", .stack_loc = top_slot()});
+            m_hoisted[scalar] = m_vars.size() - 1;
+            evaluated.push_back(scalar);
+        }
+        lea_array(target, ELEM_BASE_REGS[0]);
+        for (size_t i = 0; i < arrays.size(); i++)
+        {
+            m_vars[arrays[i]].base_reg = ELEM_BASE_REGS[i + 1];
+            lea_array(m_vars[arrays[i]], ELEM_BASE_REGS[i + 1]);
+        }
+
+        size_t done = 0;
+        if (m_opts.simd != SimdLevel::NONE)
+        {
+            PassClock clock(*this, Pass::SIMD);
+            std::string vector_code;
+            if (gen_vector_loop(target, expr, scalars, vector_code, done))
+            {
+                m_output << vector_code;
+                m_changes[Pass::SIMD]++;
+            }
+            else
+                done = 0;
+        }
+        if (done < len)
+        {
+            std::string loop = "yz_elem_" + std::to_string(m_label_count++);
+            m_output << "    mov ecx, " << done << "\n";
+            m_output << loop << ":\n";
+            // From the fifth array on, r10 and r11 hold addresses.
+            bool cache_tos = m_cache_tos;
+            m_cache_tos = cache_tos && arrays.size() < 4;
+            gen_expr(expr);
+            pop("rax");
+            m_cache_tos = cache_tos;
+            m_output << "    mov QWORD [" << ELEM_BASE_REGS[0] << " + rcx * 8], rax\n";
+            m_output << "    inc rcx\n";
+            m_output << "    cmp rcx, " << len << "\n";
+            m_output << "    jb " << loop << "\n";
+        }
+
+        for (size_t index : arrays)
+            m_vars[index].base_reg = nullptr;
+        for (const NodeExpr *scalar : evaluated)
+            m_hoisted.erase(scalar);
+        pop_scope();
+    }
+
+    // Vector register allocation for gen_vector_loop(): `owned` registers
+    // hold temporaries, the others broadcast scalars and must not be written.
+    struct VecReg
+    {
+        int index = -1;
+        bool owned = false;
+    };
+
+    struct VecState
+    {
+        bool avx2;
+        std::vector<int> free;
+        std::unordered_map<const NodeExpr *, int> broadcast;
+
+        [[nodiscard]] std::string name(int index) const
+        {
+            return (avx2 ? "ymm" : "xmm") + std::to_string(index);
+        }
+    };
+
+    // The elements [0, done) of target = expr with SSE2 or AVX2 integer
+    // instructions, two or four per iteration. Returns false, and leaves the
+    // work to the scalar loop, if the expression cannot be vectorized.
+    bool gen_vector_loop(const Var &target, const NodeExpr *expr, const std::vector<const NodeExpr *> &scalars,
+                         std::string &code, size_t &done)
+    {
+        VecState state{.avx2 = m_opts.simd == SimdLevel::AVX2};
+        size_t width = state.avx2 ? 4 : 2;
+        done = target.array_len - target.array_len % width;
+        if (done == 0)
+            return false;
+        for (int i = 15; i >= 0; i--)
+            state.free.push_back(i);
+
+        bool ok = true;
+        code = capture([&]
+                       {
+            for (const NodeExpr *scalar : scalars)
+            {
+                if (state.free.empty())
+                {
+                    ok = false;
+                    return;
+                }
+                int reg = state.free.back();
+                state.free.pop_back();
+                state.broadcast[scalar] = reg;
+                const Var &slot = m_vars[m_hoisted.at(scalar)];
+                if (state.avx2)
+                {
+                    if (slot.reg)
+                        m_output << "    vmovq xmm" << reg << ", " << slot.reg << "\n    vpbroadcastq " << state.name(reg) << ", xmm" << reg << "\n";
+                    else
+                        m_output << "    vpbroadcastq " << state.name(reg) << ", QWORD [rsp + " << var_offset(slot) << "]\n";
+                }
+                else
+                {
+                    if (slot.reg)
+                        m_output << "    movq xmm" << reg << ", " << slot.reg << "\n";
+                    else
+                        m_output << "    movq xmm" << reg << ", QWORD [rsp + " << var_offset(slot) << "]\n";
+                    m_output << "    punpcklqdq xmm" << reg << ", xmm" << reg << "\n";
+                }
+            }
+
+            std::string loop = "yz_vec_" + std::to_string(m_label_count++);
+            m_output << "    xor ecx, ecx\n";
+            m_output << loop << ":\n";
+            VecReg result;
+            if (!gen_vec(expr, state, result))
+            {
+                ok = false;
+                return;
+            }
+            const char *store = !state.avx2 ? "movdqa" : target.symbol.empty() ? "vmovdqu" : "vmovdqa";
+            m_output << "    " << store << " [" << ELEM_BASE_REGS[0] << " + rcx * 8], " << state.name(result.index) << "\n";
+            m_output << "    add rcx, " << width << "\n";
+            m_output << "    cmp rcx, " << done << "\n";
+            m_output << "    jb " << loop << "\n";
+            if (state.avx2)
+                m_output << "    vzeroupper\n"; });
+        return ok;
+    }
+
+    bool vec_alloc(VecState &state, VecReg &reg)
+    {
+        if (state.free.empty())
+            return false;
+        reg = {state.free.back(), true};
+        state.free.pop_back();
+        return true;
+    }
+
+    void vec_free(VecState &state, const VecReg &reg)
+    {
+        if (reg.owned)
+            state.free.push_back(reg.index);
+    }
+
+    bool gen_vec(const NodeExpr *expr, VecState &state, VecReg &out)
+    {
+        auto broadcast = state.broadcast.find(expr);
+        if (broadcast != state.broadcast.end())
+        {
+            out = {broadcast->second, false};
+            return true;
+        }
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                return gen_vec((*paren)->expr, state, out);
+            // Everything else that is not a broadcast scalar is an array.
+            size_t offset;
+            const Var *var = find_var(std::get<NodeTermIdent *>((*term)->var)->ident.value.value(), &offset);
+            if (!vec_alloc(state, out))
+                return false;
+            const char *load = !state.avx2 ? "movdqa" : var->symbol.empty() ? "vmovdqu" : "vmovdqa";
+            m_output << "    " << load << " " << state.name(out.index) << ", [" << var->base_reg << " + rcx * 8]\n";
+            return true;
+        }
+
+        const NodeBinExpr *bin = std::get<NodeBinExpr *>(expr->var);
+        const char *op = nullptr;
+        if (std::holds_alternative<NodeBinExprAdd *>(bin->var))
+            op = "paddq";
+        else if (std::holds_alternative<NodeBinExprSub *>(bin->var))
+            op = "psubq";
+        else if (!std::holds_alternative<NodeBinExprMulti *>(bin->var))
+            return false;
+        VecReg lhs, rhs;
+        if (!std::visit([&](const auto *node)
+                        { return gen_vec(node->lhs, state, lhs) && gen_vec(node->rhs, state, rhs); },
+                        bin->var))
+            return false;
+
+        // SSE2 instructions overwrite their first operand, so a broadcast
+        // lhs is copied first. AVX2 writes a third register instead.
+        if (!lhs.owned)
+        {
+            VecReg copy;
+            if (!vec_alloc(state, copy))
+                return false;
+            if (!state.avx2)
+                m_output << "    movdqa " << state.name(copy.index) << ", " << state.name(lhs.index) << "\n";
+            else
+                m_output << "    vmovdqa " << state.name(copy.index) << ", " << state.name(lhs.index) << "\n";
+            lhs = copy;
+        }
+        std::string l = state.name(lhs.index);
+        std::string r = state.name(rhs.index);
+        if (op)
+        {
+            if (state.avx2)
+                m_output << "    v" << op << " " << l << ", " << l << ", " << r << "\n";
+            else
+                m_output << "    " << op << " " << l << ", " << r << "\n";
+        }
+        else
+        {
+            // There is no 64-bit vector multiply before AVX-512, so it is
+            // built from 32x32->64 products: lo*lo + ((hi*lo + lo*hi) << 32).
+            VecReg t1, t2;
+            if (!vec_alloc(state, t1) || !vec_alloc(state, t2))
+                return false;
+            std::string a = state.name(t1.index);
+            std::string b = state.name(t2.index);
+            if (state.avx2)
+            {
+                m_output << "    vpsrlq " << a << ", " << l << ", 32\n";
+                m_output << "    vpmuludq " << a << ", " << a << ", " << r << "\n";
+                m_output << "    vpsrlq " << b << ", " << r << ", 32\n";
+                m_output << "    vpmuludq " << b << ", " << b << ", " << l << "\n";
+                m_output << "    vpaddq " << a << ", " << a << ", " << b << "\n";
+                m_output << "    vpsllq " << a << ", " << a << ", 32\n";
+                m_output << "    vpmuludq " << l << ", " << l << ", " << r << "\n";
+                m_output << "    vpaddq " << l << ", " << l << ", " << a << "\n";
+            }
+            else
+            {
+                m_output << "    movdqa " << a << ", " << l << "\n";
+                m_output << "    psrlq " << a << ", 32\n";
+                m_output << "    pmuludq " << a << ", " << r << "\n";
+                m_output << "    movdqa " << b << ", " << r << "\n";
+                m_output << "    psrlq " << b << ", 32\n";
+                m_output << "    pmuludq " << b << ", " << l << "\n";
+                m_output << "    paddq " << a << ", " << b << "\n";
+                m_output << "    psllq " << a << ", 32\n";
+                m_output << "    pmuludq " << l << ", " << r << "\n";
+                m_output << "    paddq " << l << ", " << a << "\n";
+            }
+            vec_free(state, t1);
+            vec_free(state, t2);
+        }
+        vec_free(state, rhs);
+        out = lhs;
+        return true;
+    }
+
+    // Functions follow the System V AMD64 convention: the first six arguments
+    // in rdi, rsi, rdx, rcx, r8, r9, the rest on the stack, the result in rax,
+    // rbx, rbp and r12-r15 preserved and rsp 16-byte aligned at every call.
+    static constexpr const char *ARG_REGS[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+    static constexpr size_t ARG_REG_COUNT = sizeof(ARG_REGS) / sizeof(ARG_REGS[0]);
+    static inline const std::vector<const char *> LOOP_REGS = {"r15", "r14", "r13", "r12"};
+
+    // Inliner cost model, in rough AST nodes of the callee body. A function at
+    // or under INLINE_ALWAYS_COST is expanded at every call site, one under
+    // INLINE_ONCE_COST only if it has a single call site in the program.
+    static constexpr size_t INLINE_ALWAYS_COST = 12;
+    static constexpr size_t INLINE_ONCE_COST = 400;
+    static constexpr size_t CALL_COST = 10;
+    static constexpr size_t MAX_INLINE_DEPTH = 8;
+    static constexpr char CALL_MARKER = '\x01';
+
+    struct Function
+    {
+        const NodeStmtFn *def;
+        size_t cost = 0;
+        bool recursive = false;
+        bool control_flow = false; // has a loop or an exit, maybe in a callee
+        std::unordered_set<const NodeTermCall *> call_sites;
+        std::string code; // the out-of-line copy, with unresolved call markers
+        PassCounts changes;
+        bool needed = false;
+        bool emitted = false;
+    };
+
+    // The code for one call, both ways it may end up being compiled.
+    struct CallSite
+    {
+        size_t fn;
+        bool can_inline = false;
+        bool always_inline = false;
+        std::string inlined;
+        std::string outlined;
+        PassCounts inlined_changes; // made by the passes in each copy
+        PassCounts outlined_changes;
+        std::pair<size_t, size_t> inlined_sites{0, 0}; // m_prof_sites of each copy
+        std::pair<size_t, size_t> outlined_sites{0, 0};
+    };
+
+    // Charges the time until it goes out of scope to `pass` rather than to
+    // the pass it interrupts, if any, with GenOptions::time_passes.
+    class PassClock
+    {
+    public:
+        inline PassClock(Generator &gen, Pass pass) : m_gen(gen), m_outer(gen.m_timing)
+        {
+            m_gen.switch_clock(pass);
+        }
+
+        inline PassClock(const PassClock &other) = delete;
+
+        inline PassClock operator=(const PassClock &other) = delete;
+
+        inline ~PassClock()
+        {
+            m_gen.switch_clock(m_outer);
+        }
+
+    private:
+        Generator &m_gen;
+        Pass m_outer;
+    };
+
+    void switch_clock(Pass pass)
+    {
+        if (!m_opts.time_passes)
+            return;
+        auto now = std::chrono::steady_clock::now();
+        if (m_timing != Pass::COUNT)
+            m_pass_ns[m_timing] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_timing_since).count();
+        m_timing = pass;
+        m_timing_since = now;
+    }
+
+    template <typename F>
+    std::string capture(F &&gen)
+    {
+        AsmBuffer out;
+        m_output.swap(out);
+        m_last_push.end = SIZE_MAX;
+        gen();
+        m_output.swap(out);
+        m_last_push.end = SIZE_MAX;
+        return out.str();
+    }
+
+    // Rough size of the code an expression or statement expands to. Sets
+    // `recursive` if it calls `self`.
+    static size_t cost(const NodeExpr *expr, const std::string &self, bool &recursive)
+    {
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                return cost((*paren)->expr, self, recursive);
+            if (const NodeTermCall *const *call = std::get_if<NodeTermCall *>(&(*term)->var))
+            {
+                recursive |= (*call)->ident.value.value() == self;
+                size_t total = CALL_COST;
+                for (const NodeExpr *arg : (*call)->args)
+                    total += cost(arg, self, recursive);
+                return total;
+            }
+            if (const NodeTermIndex *const *index = std::get_if<NodeTermIndex *>(&(*term)->var))
+                return 1 + cost((*index)->index, self, recursive);
+            return 1;
+        }
+        return 1 + std::visit([&](const auto *op)
+                              { return cost(op->lhs, self, recursive) + cost(op->rhs, self, recursive); },
+                              std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    static size_t cost(const NodeStmt *stmt, const std::string &self, bool &recursive)
+    {
+        if (auto exit = std::get_if<NodeStmtExit *>(&stmt->var))
+            return 1 + cost((*exit)->expr, self, recursive);
+        if (auto let = std::get_if<NodeStmtLet *>(&stmt->var))
+            return 1 + cost((*let)->expr, self, recursive);
+        if (auto print = std::get_if<NodeStmtOut *>(&stmt->var))
+            return 1 + cost((*print)->expr, self, recursive);
+        if (auto assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+            return 1 + cost((*assign)->expr, self, recursive);
+        if (auto ret = std::get_if<NodeStmtReturn *>(&stmt->var))
+            return 1 + cost((*ret)->expr, self, recursive);
+        if (auto expr_stmt = std::get_if<NodeStmtExpr *>(&stmt->var))
+            return 1 + cost((*expr_stmt)->expr, self, recursive);
+        if (auto array = std::get_if<NodeStmtArray *>(&stmt->var))
+            return 4 + ((*array)->init ? cost((*array)->init, self, recursive) : 0);
+        if (auto element = std::get_if<NodeStmtIndexAssign *>(&stmt->var))
+            return 2 + cost((*element)->index, self, recursive) + cost((*element)->expr, self, recursive);
+        size_t total = 0;
+        if (auto block = std::get_if<NodeStmtBlock *>(&stmt->var))
+            for (const NodeStmt *s : (*block)->stmts)
+                total += cost(s, self, recursive);
+        else if (auto loop = std::get_if<NodeStmtWhile *>(&stmt->var))
+        {
+            total = 2 + cost((*loop)->cond, self, recursive);
+            for (const NodeStmt *s : (*loop)->body->stmts)
+                total += cost(s, self, recursive);
+        }
+        return total;
+    }
+
+    // Compiles the out-of-line copy of a function when it is defined. Calls
+    // only ever refer to functions defined earlier or to the function itself,
+    // so the only recursion there can be is direct.
+    void gen_fn(const NodeStmtFn *fn)
+    {
+#if defined(IPLATFORM_WINDOWS)
+        throw CompileError("Functions are not supported on Windows yet");
+#elif defined(IPLATFORM_LINUX)
+        const std::string &name = fn->ident.value.value();
+        if (m_fn_index.count(name))
+        {
+            throw CompileError("Function already defined: " + name, fn->ident.offset);
+        }
+        size_t index = m_functions.size();
+        m_functions.push_back({.def = fn});
+        m_fn_index[name] = index;
+        for (const NodeStmt *s : fn->body->stmts)
+        {
+            m_functions[index].cost += cost(s, name, m_functions[index].recursive);
+            m_functions[index].control_flow |= has_control_flow(s, false);
+        }
+
+        Frame frame;
+        swap_frame(frame);
+        PassCounts changes = m_changes;
+        FnContext ctx{.ret_label = "yz_ret_" + name};
+        m_fn_ctx = &ctx;
+        push_scope();
+        for (size_t i = 0; i < fn->params.size(); i++)
+        {
+            if (i < ARG_REG_COUNT)
+                m_output << "    push " << ARG_REGS[i] << "\n";
+            else // past the saved rbp and the return address
+                m_output << "    push QWORD [rbp + " << 16 + (i - ARG_REG_COUNT) * 8 << "]\n";
+            m_stack_size++;
+            m_vars.push_back({.name = fn->params[i].value.value(), .stack_loc = m_stack_size - 1});
+        }
+        gen_fn_body(fn->body);
+
+        // rbx is the scratch register of every binary operator. The saved
+        // registers are padded to an even count so the frame starts aligned.
+        std::vector<const char *> saved = {"rbx"};
+        saved.insert(saved.end(), m_used_regs.begin(), m_used_regs.end());
+        AsmBuffer code;
+        code << "\nyz_fn_" << name << ":\n";
+        if (m_opts.lines)
+            code << line_directive(m_opts.lines->locate(fn->ident.offset).line);
+        code << "    push rbp\n";
+        code << "    mov rbp, rsp\n";
+        for (const char *reg : saved)
+            code << "    push " << reg << "\n";
+        if (saved.size() % 2)
+            code << "    sub rsp, 8\n";
+        code << m_output;
+        if (m_opts.lines)
+            code << line_directive(m_opts.lines->locate(fn->ident.offset).line);
+        if (ctx.jumped)
+            code << ctx.ret_label << ":\n";
+        code << "    lea rsp, [rbp - " << saved.size() * 8 << "]\n";
+        for (size_t i = saved.size(); i-- > 0;)
+            code << "    pop " << saved[i] << "\n";
+        code << "    pop rbp\n";
+        code << "    ret\n";
+
+        swap_frame(frame);
+        m_functions[index].code = code.str();
+        // Counted when the copy is emitted, if it ever is.
+        m_functions[index].changes = m_changes - changes;
+        m_changes = changes;
+#endif
+    }
+
+    // The statements of a function body, in the scope of its parameters. A
+    // final `return` leaves its value in rax without a jump; falling off the
+    // end returns 0.
+    void gen_fn_body(const NodeStmtBlock *body)
+    {
+        const NodeStmtReturn *const *last = body->stmts.empty() ? nullptr : std::get_if<NodeStmtReturn *>(&body->stmts.back()->var);
+        for (size_t i = 0; i + (last ? 1 : 0) < body->stmts.size(); i++)
+            gen_stmt(body->stmts[i]);
+        if (last)
+        {
+            if (!m_opts.profile_path.empty())
+                count_stmt(body->stmts.back()->offset);
+            with_value_numbers(body->stmts.back(), [&]
+                               {
+                gen_expr((*last)->expr);
+                pop("rax"); });
+        }
+        else
+            m_output << "    xor eax, eax\n";
+    }
+
+    void gen_return(const NodeStmtReturn *ret)
+    {
+        if (!m_fn_ctx)
+        {
+            throw CompileError("`return` outside of a function");
+        }
+        gen_expr(ret->expr);
+        pop("rax");
+        if (m_fn_ctx->inlined && m_stack_size > m_fn_ctx->base)
+            m_output << "    add rsp, " << (m_stack_size - m_fn_ctx->base) * 8 << "\n";
+        m_output << "    jmp " << m_fn_ctx->ret_label << "\n";
+        m_fn_ctx->jumped = true;
+    }
+
+    // A call leaves a marker in the output and records the code for a real
+    // call and/or an inlined copy. Which one is used is settled in finish(),
+    // when the number of call sites of every function is known.
+    void gen_call(const NodeTermCall *call)
+    {
+#if defined(IPLATFORM_WINDOWS)
+        throw CompileError("Functions are not supported on Windows yet");
+#elif defined(IPLATFORM_LINUX)
+        const std::string &name = call->ident.value.value();
+        auto it = m_fn_index.find(name);
+        if (it == m_fn_index.end())
+        {
+            throw CompileError("Undeclared function: " + name, call->ident.offset);
+        }
+        Function &fn = m_functions[it->second];
+        if (call->args.size() != fn.def->params.size())
+        {
+            throw CompileError("Function " + name + " expects " + std::to_string(fn.def->params.size()) +
+                               " arguments, got " + std::to_string(call->args.size()),
+                               call->ident.offset);
+        }
+        fn.call_sites.insert(call);
+
+        CallSite site{.fn = it->second};
+        site.can_inline = m_opts.inline_functions && !fn.recursive &&
+                          fn.cost < INLINE_ONCE_COST && m_inline_depth < MAX_INLINE_DEPTH;
+        site.always_inline = site.can_inline && fn.cost <= INLINE_ALWAYS_COST;
+        // Both copies start from the stack in memory and end with the result pushed.
+        spill_cache();
+        size_t stack_size = m_stack_size;
+        PassCounts changes = m_changes;
+        if (site.can_inline)
+        {
+            PassClock clock(*this, Pass::INLINE);
+            site.inlined_sites.first = m_prof_sites.size();
+            site.inlined = capture([&]
+                                   { gen_inline(call, fn.def); });
+            site.inlined_sites.second = m_prof_sites.size();
+            site.inlined_changes = m_changes - changes;
+            m_changes = changes;
+        }
+        if (!site.always_inline)
+        {
+            m_stack_size = stack_size;
+            m_cached.clear();
+            site.outlined_sites.first = m_prof_sites.size();
+            site.outlined = capture([&]
+                                    { gen_outlined_call(call, name); });
+            site.outlined_sites.second = m_prof_sites.size();
+            site.outlined_changes = m_changes - changes;
+            m_changes = changes;
+        }
+        m_output << CALL_MARKER << m_call_sites.size() << "\n";
+        m_call_sites.push_back(std::move(site));
+#endif
+    }
+
+    void gen_outlined_call(const NodeTermCall *call, const std::string &name)
+    {
+        size_t args = call->args.size();
+        size_t stack_args = args > ARG_REG_COUNT ? args - ARG_REG_COUNT : 0;
+        // Every frame starts 16-byte aligned, so the slot count says whether
+        // rsp will be aligned at the call.
+        size_t pad = (m_stack_size + stack_args) % 2;
+        if (pad)
+        {
+            m_output << "    sub rsp, 8\n";
+            m_stack_size++;
+        }
+        // Right to left, like the operands of a binary operator, which leaves
+        // the seventh argument on top.
+        for (size_t i = args; i-- > 0;)
+            gen_expr(call->args[i]);
+        for (size_t i = 0; i < args && i < ARG_REG_COUNT; i++)
+            pop(ARG_REGS[i]);
+        spill_cache();
+        m_output << "    call yz_fn_" << name << "\n";
+        if (stack_args + pad)
+        {
+            m_output << "    add rsp, " << (stack_args + pad) * 8 << "\n";
+            m_stack_size -= stack_args + pad;
+        }
+        push("rax");
+    }
+
+    // The body of `fn` expanded in place. The arguments are evaluated in the
+    // same order as for a real call and become the parameter slots; `return`
+    // drops the callee's slots and jumps to the end with its value in rax.
+    void gen_inline(const NodeTermCall *call, const NodeStmtFn *fn)
+    {
+        size_t base = m_stack_size;
+        size_t args = call->args.size();
+        for (size_t i = args; i-- > 0;)
+            gen_expr(call->args[i]);
+        spill_cache();
+
+        FnContext ctx{.ret_label = "yz_inline_" + std::to_string(m_label_count++), .base = base, .inlined = true};
+        FnContext *outer_ctx = m_fn_ctx;
+        size_t outer_start = m_frame_start;
+        m_fn_ctx = &ctx;
+        m_frame_start = m_vars.size();
+        m_inline_depth++;
+        // The caller's hoisted expressions are over names the body cannot
+        // see, and in a hash-consed AST the body may share their nodes.
+        std::unordered_map<const NodeExpr *, size_t> outer_hoisted;
+        m_hoisted.swap(outer_hoisted);
+        size_t outer_run = m_prof_run;
+        m_prof_run = m_prof_nested_run;
+        push_scope();
+        for (size_t i = 0; i < args; i++)
+            m_vars.push_back({.name = fn->params[i].value.value(), .stack_loc = base + args - 1 - i});
+        gen_fn_body(fn->body);
+        pop_scope();
+        m_prof_run = outer_run;
+        m_hoisted.swap(outer_hoisted);
+        if (ctx.jumped)
+            m_output << ctx.ret_label << ":\n";
+        m_inline_depth--;
+        m_frame_start = outer_start;
+        m_fn_ctx = outer_ctx;
+        push("rax");
+    }
+
+    // Copies `text` to `out` with every call marker replaced by the inlined
+    // copy, if the callee is always inlined or has a single call site, and by
+    // the call otherwise. A function some call still refers to is `needed`.
+    // The profile sites of the copy left out are dropped.
+    void resolve_calls(std::string_view text, AsmBuffer &out)
+    {
+        size_t pos = 0;
+        for (size_t mark; (mark = text.find(CALL_MARKER, pos)) != std::string_view::npos;)
+        {
+            out << text.substr(pos, mark - pos);
+            size_t end = text.find('\n', mark);
+            size_t index = 0;
+            std::from_chars(text.data() + mark + 1, text.data() + end, index);
+            const CallSite &site = m_call_sites[index];
+            Function &fn = m_functions[site.fn];
+            bool inlined = site.always_inline || (site.can_inline && fn.call_sites.size() == 1);
+            if (!inlined)
+                fn.needed = true;
+            m_changes += inlined ? site.inlined_changes : site.outlined_changes;
+            m_changes[Pass::INLINE] += inlined;
+            std::pair<size_t, size_t> unused = inlined ? site.outlined_sites : site.inlined_sites;
+            for (size_t i = unused.first; i < unused.second; i++)
+                m_prof_sites[i].second = DROPPED_SITE;
+            resolve_calls(inlined ? site.inlined : site.outlined, out);
+            pos = end + 1;
+        }
+        out << text.substr(pos);
     }
 
     const NodeProg m_prog;
-    std::stringstream m_output;
+    const GenOptions m_opts;
+    AsmBuffer m_output;
+    bool m_narrow = false; // only the low 32 bits of the expression being generated are used
     size_t m_stack_size = 0;
+    bool m_cache_tos;                   // push and pop go through m_cached
+    std::vector<const char *> m_cached; // TOS_REGS holding the top of the stack, deepest first
+    CachedPush m_last_push;
     bool m_has_explicit_exit = false;
+    size_t m_label_count = 0;
+    std::unordered_map<const NodeExpr *, size_t> m_hoisted; // expression -> m_vars index of its slot
+    std::unordered_map<ValueKey, size_t, ValueKeyHash> m_values;
+    std::unordered_map<std::string, size_t> m_literal_values;
+    std::unordered_map<const NodeExpr *, size_t> m_value_of; // value numbers of the current statement
+    std::unordered_map<size_t, size_t> m_available;          // value number -> m_vars index of its slot
+    std::vector<size_t> m_available_order;
+    PassCounts m_changes;
+    PassCounts m_pass_ns;
+    Pass m_timing = Pass::COUNT; // the pass the clock is running for, if any
+    std::chrono::steady_clock::time_point m_timing_since;
+    std::vector<const char *> m_free_regs = LOOP_REGS;
+    std::vector<const char *> m_used_regs; // callee-saved registers the current frame has used
+    size_t m_frame_start = 0;              // first m_vars entry visible to name lookup
+    FnContext *m_fn_ctx = nullptr;         // the function being generated, if any
+    size_t m_inline_depth = 0;
+    std::vector<Function> m_functions;
+    std::unordered_map<std::string, size_t> m_fn_index;
+    std::vector<CallSite> m_call_sites;
+    std::vector<std::pair<std::string, size_t>> m_static_arrays; // .bss label, element count
+    bool m_index_checked = false;
+    std::vector<std::pair<u32, u32>> m_prof_sites; // source offset and counter of every profiled statement
+    size_t m_prof_counters = 0;
+    size_t m_prof_run = NO_COUNTER;       // counter of the straight-line run being generated
+    size_t m_prof_nested_run = NO_COUNTER; // the run a block or inlined body may start with
+    const char *m_prof_loop_reg = nullptr; // register the next run counts in
 };
\ No newline at end of file
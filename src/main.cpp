@@ -1,15 +1,117 @@
 #include "core/defines.h"
 #include "YLogger/logger.h"
-#include "tokenizer.hpp"
-#include "parser.hpp"
-#include "genration.hpp"
+#include "driver.hpp"
+#include "watch.hpp"
+
+static void print_usage()
+{
+    LLOG(RED_TEXT("Incorrect usage."), " Correct usage is...\n");
+    LLOG("yz [-O0|-O1|-O2|-O3] [-g] [--no-inline] [--no-cse] [--tos-cache] [--simd=none|sse2|avx2|native] [-j <threads>] [--pipeline] [--hash-cons] [--watch] [--cache] [--cache-dir=<dir>] [--cache-size=<MiB>]\n");
+    LLOG("   [--passes=<pass>,...] [--verify-each] [--eval-steps=<n>] [--eval-mem=<MiB>] [--profile] [--emit-ast-bin] [--time-phases] [--stats-json[=<file>]] <filename.yz|filename.yzast>...\n");
+    LLOG("   passes: ", PassSet::all().str(), "\n");
+    LLOG("   --stats-json writes to stderr, since stdout carries the program's output\n");
+    LLOG("yz --report <filename.yz>...   hot statements from the <filename>.yzprof a --profile build wrote\n");
+}
+
+static bool parse_args(int argc, char *argv[], Options &opts)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "-j")
+        {
+            if (i + 1 >= argc)
+                return false;
+            opts.jobs = std::strtoul(argv[++i], nullptr, 10);
+        }
+        else if (arg.size() > 2 && arg.rfind("-j", 0) == 0)
+            opts.jobs = std::strtoul(arg.c_str() + 2, nullptr, 10);
+        else if (arg == "--cache")
+            opts.cache = true;
+        else if (arg.rfind("--cache-dir=", 0) == 0)
+        {
+            opts.cache = true;
+            opts.cache_dir = arg.substr(12);
+        }
+        else if (arg.rfind("--cache-size=", 0) == 0)
+            opts.cache_max_bytes = std::strtoull(arg.c_str() + 13, nullptr, 10) * 1024 * 1024;
+        else if (arg == "-O0" || arg == "-O1" || arg == "-O2" || arg == "-O3")
+            opts.opt_level = arg[2] - '0';
+        else if (arg.rfind("--passes=", 0) == 0)
+        {
+            try
+            {
+                opts.passes = PassSet::parse(arg.substr(9));
+            }
+            catch (const CompileError &err)
+            {
+                LLOG(RED_TEXT(err.what()), "\n");
+                return false;
+            }
+        }
+        else if (arg == "--verify-each")
+            opts.verify_each = true;
+        else if (arg.rfind("--eval-steps=", 0) == 0)
+            opts.eval_budget.steps = std::strtoull(arg.c_str() + 13, nullptr, 10);
+        else if (arg.rfind("--eval-mem=", 0) == 0)
+            opts.eval_budget.bytes = std::strtoull(arg.c_str() + 11, nullptr, 10) * 1024 * 1024;
+        else if (arg == "--no-inline")
+            opts.inline_functions = false;
+        else if (arg == "--no-cse")
+            opts.value_numbering = false;
+        else if (arg == "--tos-cache")
+            opts.cache_tos = true;
+        else if (arg == "-g")
+            opts.debug_info = true;
+        else if (arg == "--profile")
+            opts.profile = true;
+        else if (arg == "--report")
+            opts.report = true;
+        else if (arg == "--emit-ast-bin")
+            opts.emit_ast = true;
+        else if (arg.rfind("--simd=", 0) == 0)
+        {
+            std::string simd = arg.substr(7);
+            if (simd == "none")
+                opts.simd = SimdLevel::NONE;
+            else if (simd == "sse2")
+                opts.simd = SimdLevel::SSE2;
+            else if (simd == "avx2")
+                opts.simd = SimdLevel::AVX2;
+            else if (simd == "native")
+                opts.simd = __builtin_cpu_supports("avx2") ? SimdLevel::AVX2 : SimdLevel::SSE2;
+            else
+                return false;
+        }
+        else if (arg == "--pipeline")
+            opts.pipeline = true;
+        else if (arg == "--hash-cons")
+            opts.hash_cons = true;
+        else if (arg == "--watch")
+            opts.watch = true;
+        else if (arg == "--time-phases")
+            opts.time_phases = true;
+        else if (arg == "--stats-json")
+            opts.stats_json = true;
+        else if (arg.rfind("--stats-json=", 0) == 0)
+        {
+            opts.stats_json = true;
+            opts.stats_json_path = arg.substr(13);
+        }
+        else if (arg.rfind("--", 0) == 0)
+            return false;
+        else
+            opts.inputs.push_back(arg);
+    }
+    return !opts.inputs.empty();
+}
 
 i32 main(int argc, char *argv[])
 {
-    if (argc != 2)
+    Options opts;
+    if (!parse_args(argc, argv, opts))
     {
-        LLOG(RED_TEXT("Incorrect usage."), " Correct usage is...\n");
-        LLOG("yz <filename.yz>\n");
+        print_usage();
         return EXIT_FAILURE;
     }
 
@@ -19,52 +121,59 @@ i32 main(int argc, char *argv[])
         LLOG(PURPLE_TEXT("Running on Windows...\n"));
     #endif
 
-    std::string contents;
-    {
-        std::ifstream input(argv[1]);
-        if (!input.is_open())
-        {
-            LLOG(RED_TEXT("Could not open file: "), argv[1], "\n");
-            return EXIT_FAILURE;
-        }
-        std::stringstream contents_stream;
-
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
-    }
+    std::unique_ptr<CompileCache> cache;
+    if (opts.cache)
+        cache = std::make_unique<CompileCache>(opts.cache_dir.empty() ? CompileCache::default_dir() : opts.cache_dir,
+                                               opts.cache_max_bytes);
 
-    Tokenizer tokenizer(contents);
-    std::vector<Token> tokens = tokenizer.tokenize();
-
-    Parser parser(std::move(tokens));
-    std::optional<NodeProg> tree = parser.parse_prog();
-
-    Generator genrator(tree.value());
+    if (opts.report)
+        return run_report(opts);
+    if (opts.watch)
+        return run_watch(opts, cache.get());
 
+    // Several inputs are a batch: compile them all in parallel, run none of them.
+    std::vector<CompileStats> stats;
+    if (opts.inputs.size() > 1)
     {
-        std::ofstream file("out.s");
-        file << genrator.generate();
+        // Workers report failures concurrently; keep them off a shared lock.
+        LOG_ENABLE_ASYNC();
+        size_t failures = compile_batch(opts, cache.get(), stats);
+        if (cache)
+            report_cache(*cache);
+        report_stats(opts, stats);
+        LOG_FLUSH();
+        return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-#if defined(IPLATFORM_LINUX)
-    system("nasm -f elf64 out.s -o out.o");
-    system("ld out.o -o out");
-    
-    int status = system("./out");
-
-    if (WIFEXITED(status))
+    const std::string &input = opts.inputs.front();
+    OutputPaths paths;
+    stats.emplace_back();
+    try
     {
-        int exit_code = WEXITSTATUS(status);
-        LLOG(BLUE_TEXT("Exit Code: "), exit_code, "\n");
+        CompileContext context(opts, cache.get());
+        paths = context.compile(input, stats.back());
     }
+    catch (const CompileError &err)
+    {
+        report_failure(input, err);
+        return EXIT_FAILURE;
+    }
+    if (cache)
+        report_cache(*cache);
 
-#elif defined(IPLATFORM_WINDOWS)
-    system("gcc -c out.s -o out.o");
-    system("gcc out.o -o out.exe");
-
-    i32 exit_code = system("out.exe");
-    LLOG(BLUE_TEXT("Exit Code: "), exit_code, "\n");
-#endif
+    ProcessResult result;
+    try
+    {
+        result = run_executable(paths.exe_path, stats.back());
+    }
+    catch (const CompileError &err)
+    {
+        LLOG(RED_TEXT(err.what()), "\n");
+        return EXIT_FAILURE;
+    }
+    if (result.exited)
+        LLOG(BLUE_TEXT("Exit Code: "), result.exit_code, "\n");
 
+    report_stats(opts, stats);
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
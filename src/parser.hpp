@@ -5,49 +5,109 @@
 #include "YLogger/logger.h"
 #include "core/nodes.hpp"
 #include "core/arena.hpp"
+#include "core/error.hpp"
+#include "core/hash_cons.hpp"
 
 class Parser
 {
 public:
-    inline explicit Parser(std::vector<Token> tokens)
-        : m_tokens(std::move(tokens)), m_alloc(1024 * 1024 * 4)
+    // With `hash_cons`, identical expression subtrees are built once and
+    // shared, calls excepted: every call site keeps a node of its own.
+    inline explicit Parser(const std::vector<Token> &tokens, ArenaAlloc &alloc, HashCons *hash_cons = nullptr)
+        : m_tokens(tokens), m_alloc(alloc), m_hash_cons(hash_cons)
     {
+        // Roughly one distinct subtree per two tokens in generated code.
+        if (m_hash_cons)
+            m_hash_cons->reserve(m_hash_cons->size() + tokens.size() / 2);
     }
 
     std::optional<NodeTerm *> parse_term()
     {
         if (auto int_lit = try_consume(TokenType::_int_lit))
         {
-            auto term_int_lit = m_alloc.alloc<NodeTermIntLit>();
-            term_int_lit->int_lit = int_lit.value();
+            return shared<NodeTerm>('i', nullptr, nullptr, int_lit->value.value(), [&]
+                                    {
+                auto term_int_lit = m_alloc.alloc<NodeTermIntLit>();
+                term_int_lit->int_lit = int_lit.value();
+                auto term = m_alloc.alloc<NodeTerm>();
+                term->var = term_int_lit;
+                term->offset = int_lit->offset;
+                return term; });
+        }
+        else if (peek().has_value() && peek()->type == TokenType::ident &&
+                 peek(1).has_value() && peek(1)->type == TokenType::open_paren)
+        {
+            auto term_call = m_alloc.alloc<NodeTermCall>();
+            term_call->ident = consume();
+            consume();
+            if (!try_consume(TokenType::close_paren))
+            {
+                do
+                {
+                    if (auto arg = parse_expr())
+                        term_call->args.push_back(arg.value());
+                    else
+                    {
+                        throw error("Invalid argument in call to " + term_call->ident.value.value());
+                    }
+                } while (try_consume(TokenType::comma));
+                try_consume(TokenType::close_paren, "Expected ')' after arguments");
+            }
             auto term = m_alloc.alloc<NodeTerm>();
-            term->var = term_int_lit;
+            term->var = term_call;
+            term->offset = term_call->ident.offset;
             return term;
         }
+        else if (peek().has_value() && peek()->type == TokenType::ident &&
+                 peek(1).has_value() && peek(1)->type == TokenType::open_bracket)
+        {
+            Token ident = consume();
+            consume();
+            auto index = parse_expr();
+            if (!index)
+            {
+                throw error("Invalid index expression");
+            }
+            try_consume(TokenType::close_bracket, "Expected ']'");
+            return shared<NodeTerm>('x', index.value(), nullptr, ident.value.value(), [&]
+                                    {
+                auto term_index = m_alloc.alloc<NodeTermIndex>();
+                term_index->ident = ident;
+                term_index->index = index.value();
+                auto term = m_alloc.alloc<NodeTerm>();
+                term->var = term_index;
+                term->offset = ident.offset;
+                return term; });
+        }
         else if (auto ident = try_consume(TokenType::ident))
         {
-            auto expr_ident = m_alloc.alloc<NodeTermIdent>();
-            expr_ident->ident = ident.value();
-            auto term = m_alloc.alloc<NodeTerm>();
-            term->var = expr_ident;
-            return term;
+            return shared<NodeTerm>('n', nullptr, nullptr, ident->value.value(), [&]
+                                    {
+                auto expr_ident = m_alloc.alloc<NodeTermIdent>();
+                expr_ident->ident = ident.value();
+                auto term = m_alloc.alloc<NodeTerm>();
+                term->var = expr_ident;
+                term->offset = ident->offset;
+                return term; });
         }
-        else if (try_consume(TokenType::open_paren))
+        else if (auto open = try_consume(TokenType::open_paren))
         {
             auto expr = parse_expr();
             if (!expr.has_value())
             {
-                LLOG(RED_TEXT("Expected Expression inside parentheses\n"));
-                exit(EXIT_FAILURE);
+                throw error("Expected Expression inside parentheses");
             }
             try_consume(TokenType::close_paren, "Expected ')' after expression");
 
-            auto term_paren = m_alloc.alloc<NodeTermParen>();
-            term_paren->expr = expr.value();
+            return shared<NodeTerm>('p', expr.value(), nullptr, {}, [&]
+                                    {
+                auto term_paren = m_alloc.alloc<NodeTermParen>();
+                term_paren->expr = expr.value();
 
-            auto term = m_alloc.alloc<NodeTerm>();
-            term->var = term_paren;
-            return term;
+                auto term = m_alloc.alloc<NodeTerm>();
+                term->var = term_paren;
+                term->offset = open->offset;
+                return term; });
         }
         else
         {
@@ -57,11 +117,16 @@ public:
 
     std::optional<NodeExpr *> parse_expr(int min_prec = 0)
     {
+        LTRACE(false, "parse_expr token ", m_idx, " min_prec ", min_prec, "\n");
         auto term_lhs_opt = parse_term();
         if (!term_lhs_opt)
             return {};
-        auto lhs_expr = m_alloc.alloc<NodeExpr>();
-        lhs_expr->var = term_lhs_opt.value();
+        NodeExpr *lhs_expr = shared<NodeExpr>('t', term_lhs_opt.value(), nullptr, {}, [&]
+                                              {
+            auto expr = m_alloc.alloc<NodeExpr>();
+            expr->var = term_lhs_opt.value();
+            expr->offset = term_lhs_opt.value()->offset;
+            return expr; });
 
         while (true)
         {
@@ -78,49 +143,36 @@ public:
             auto rhs_expr_opt = parse_expr(next_min_prec);
             if (!rhs_expr_opt)
             {
-                LLOG(RED_TEXT("Unable to parse expression on right-hand side of operator\n"));
-                exit(EXIT_FAILURE);
+                throw error("Unable to parse expression on right-hand side of operator");
             }
 
-            auto bin_expr = m_alloc.alloc<NodeBinExpr>();
-            if (op.type == TokenType::plus)
-            {
-                auto add = m_alloc.alloc<NodeBinExprAdd>();
-                add->lhs = lhs_expr;
-                add->rhs = rhs_expr_opt.value();
-                bin_expr->var = add;
-            }
-            else if (op.type == TokenType::star)
-            {
-                auto multi = m_alloc.alloc<NodeBinExprMulti>();
-                multi->lhs = lhs_expr;
-                multi->rhs = rhs_expr_opt.value();
-                bin_expr->var = multi;
-            }
-            else if (op.type == TokenType::sub)
-            {
-                auto sub = m_alloc.alloc<NodeBinExprSub>();
-                sub->lhs = lhs_expr;
-                sub->rhs = rhs_expr_opt.value();
-                bin_expr->var = sub;
-            }
-            else if (op.type == TokenType::div)
-            {
-                auto div = m_alloc.alloc<NodeBinExprDiv>();
-                div->lhs = lhs_expr;
-                div->rhs = rhs_expr_opt.value();
-                bin_expr->var = div;
-            }
+            NodeExpr *rhs_expr = rhs_expr_opt.value();
+            lhs_expr = shared<NodeExpr>(static_cast<char>(op.type), lhs_expr, rhs_expr, {}, [&]
+                                        {
+                auto bin_expr = m_alloc.alloc<NodeBinExpr>();
+                if (op.type == TokenType::plus)
+                    bin_expr->var = bin_node<NodeBinExprAdd>(lhs_expr, rhs_expr);
+                else if (op.type == TokenType::star)
+                    bin_expr->var = bin_node<NodeBinExprMulti>(lhs_expr, rhs_expr);
+                else if (op.type == TokenType::sub)
+                    bin_expr->var = bin_node<NodeBinExprSub>(lhs_expr, rhs_expr);
+                else if (op.type == TokenType::div)
+                    bin_expr->var = bin_node<NodeBinExprDiv>(lhs_expr, rhs_expr);
+                else if (op.type == TokenType::lt)
+                    bin_expr->var = bin_node<NodeBinExprLess>(lhs_expr, rhs_expr);
 
-            auto new_lhs_expr = m_alloc.alloc<NodeExpr>();
-            new_lhs_expr->var = bin_expr;
-            lhs_expr = new_lhs_expr;
+                auto new_lhs_expr = m_alloc.alloc<NodeExpr>();
+                new_lhs_expr->var = bin_expr;
+                new_lhs_expr->offset = lhs_expr->offset;
+                return new_lhs_expr; });
         }
         return lhs_expr;
     }
 
     std::optional<NodeStmt *> parse_stmt()
     {
+        LTRACE(false, "parse_stmt token ", m_idx, "\n");
+        u32 start = peek().value().offset;
         if (peek().value().type == TokenType::exit &&
             peek(1).has_value() && peek(1).value().type == TokenType::open_paren)
         {
@@ -131,33 +183,160 @@ public:
                 stmt_exit->expr = node_expr.value();
             else
             {
-                LLOG(RED_TEXT("Invalid Expression\n"));
-                exit(EXIT_FAILURE);
+                throw error("Invalid Expression");
             }
             try_consume(TokenType::close_paren, "Expected `)`");
             try_consume(TokenType::semi, "Expected `;`");
             auto stmt = m_alloc.alloc<NodeStmt>();
             stmt->var = stmt_exit;
+            stmt->offset = start;
             return stmt;
         }
-        else if (peek().has_value() && peek().value().type == TokenType::val &&
+        else if (peek().has_value() &&
+                 (peek().value().type == TokenType::val || peek().value().type == TokenType::var) &&
                  peek(1).has_value() && peek(1).value().type == TokenType::ident &&
-                 peek(2).has_value() && peek(2).value().type == TokenType::eq)
+                 peek(2).has_value() && (peek(2).value().type == TokenType::eq || peek(2).value().type == TokenType::colon))
         {
-            consume();
             auto stmt_let = m_alloc.alloc<NodeStmtLet>();
+            stmt_let->is_mutable = consume().type == TokenType::var;
             stmt_let->ident = consume();
-            consume();
+            if (try_consume(TokenType::colon))
+            {
+                Token type = try_consume(TokenType::ident, "Expected a type");
+                stmt_let->size = type_size(type);
+            }
+            try_consume(TokenType::eq, "Expected `=`");
             if (auto expr = parse_expr())
                 stmt_let->expr = expr.value();
             else
             {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw error("Invalid expression");
             }
             try_consume(TokenType::semi, "Expected `;`");
             auto stmt = m_alloc.alloc<NodeStmt>();
             stmt->var = stmt_let;
+            stmt->offset = start;
+            return stmt;
+        }
+        else if (peek().has_value() &&
+                 (peek().value().type == TokenType::val || peek().value().type == TokenType::var) &&
+                 peek(1).has_value() && peek(1).value().type == TokenType::ident &&
+                 peek(2).has_value() && peek(2).value().type == TokenType::open_bracket)
+        {
+            if (consume().type != TokenType::var)
+            {
+                throw error("Arrays are declared with `var`");
+            }
+            auto stmt_array = m_alloc.alloc<NodeStmtArray>();
+            stmt_array->ident = consume();
+            consume();
+            stmt_array->size = try_consume(TokenType::_int_lit, "Expected array size");
+            try_consume(TokenType::close_bracket, "Expected ']'");
+            if (try_consume(TokenType::eq))
+            {
+                if (auto expr = parse_expr())
+                    stmt_array->init = expr.value();
+                else
+                {
+                    throw error("Invalid expression");
+                }
+            }
+            try_consume(TokenType::semi, "Expected `;`");
+            auto stmt = m_alloc.alloc<NodeStmt>();
+            stmt->var = stmt_array;
+            stmt->offset = start;
+            return stmt;
+        }
+        else if (peek().has_value() && peek()->type == TokenType::ident &&
+                 peek(1).has_value() && peek(1)->type == TokenType::open_bracket)
+        {
+            auto stmt_index = m_alloc.alloc<NodeStmtIndexAssign>();
+            stmt_index->ident = consume();
+            consume();
+            if (auto index = parse_expr())
+                stmt_index->index = index.value();
+            else
+            {
+                throw error("Invalid index expression");
+            }
+            try_consume(TokenType::close_bracket, "Expected ']'");
+            try_consume(TokenType::eq, "Expected '=' after array element");
+            if (auto expr = parse_expr())
+                stmt_index->expr = expr.value();
+            else
+            {
+                throw error("Invalid expression");
+            }
+            try_consume(TokenType::semi, "Expected `;`");
+            auto stmt = m_alloc.alloc<NodeStmt>();
+            stmt->var = stmt_index;
+            stmt->offset = start;
+            return stmt;
+        }
+        else if (peek().has_value() && peek()->type == TokenType::ident &&
+                 peek(1).has_value() && peek(1)->type == TokenType::eq)
+        {
+            auto stmt_assign = m_alloc.alloc<NodeStmtAssign>();
+            stmt_assign->ident = consume();
+            consume();
+            if (auto expr = parse_expr())
+                stmt_assign->expr = expr.value();
+            else
+            {
+                throw error("Invalid expression");
+            }
+            try_consume(TokenType::semi, "Expected `;`");
+            auto stmt = m_alloc.alloc<NodeStmt>();
+            stmt->var = stmt_assign;
+            stmt->offset = start;
+            return stmt;
+        }
+        else if (peek().has_value() && peek()->type == TokenType::ident &&
+                 peek(1).has_value() && peek(1)->type == TokenType::open_paren)
+        {
+            auto stmt_expr = m_alloc.alloc<NodeStmtExpr>();
+            stmt_expr->expr = parse_expr().value();
+            try_consume(TokenType::semi, "Expected `;`");
+            auto stmt = m_alloc.alloc<NodeStmt>();
+            stmt->var = stmt_expr;
+            stmt->offset = start;
+            return stmt;
+        }
+        else if (try_consume(TokenType::_return))
+        {
+            auto stmt_return = m_alloc.alloc<NodeStmtReturn>();
+            if (auto expr = parse_expr())
+                stmt_return->expr = expr.value();
+            else
+            {
+                throw error("Invalid expression after return");
+            }
+            try_consume(TokenType::semi, "Expected `;`");
+            auto stmt = m_alloc.alloc<NodeStmt>();
+            stmt->var = stmt_return;
+            stmt->offset = start;
+            return stmt;
+        }
+        else if (peek().has_value() && peek()->type == TokenType::fn)
+        {
+            throw error("Functions can only be defined at the top level");
+        }
+        else if (try_consume(TokenType::_while))
+        {
+            try_consume(TokenType::open_paren, "Expected '(' after while");
+            auto stmt_while = m_alloc.alloc<NodeStmtWhile>();
+            if (auto cond = parse_expr())
+                stmt_while->cond = cond.value();
+            else
+            {
+                throw error("Invalid condition in while");
+            }
+            try_consume(TokenType::close_paren, "Expected ')'");
+            try_consume(TokenType::open_curly, "Expected '{' after while condition");
+            stmt_while->body = parse_block();
+            auto stmt = m_alloc.alloc<NodeStmt>();
+            stmt->var = stmt_while;
+            stmt->offset = start;
             return stmt;
         }
         else if (peek().has_value() && peek()->type == TokenType::out)
@@ -167,8 +346,7 @@ public:
             auto expr = parse_expr();
             if (!expr)
             {
-                LLOG(RED_TEXT("Invalid expression in print\n"));
-                exit(EXIT_FAILURE);
+                throw error("Invalid expression in print");
             }
             try_consume(TokenType::close_paren, "Expected ')'");
             try_consume(TokenType::semi, "Expected ';'");
@@ -176,33 +354,15 @@ public:
             stmt_out->expr = expr.value();
             auto stmt = m_alloc.alloc<NodeStmt>();
             stmt->var = stmt_out;
+            stmt->offset = start;
             return stmt;
         }
         else if (try_consume(TokenType::open_curly))
         {
-            auto block = m_alloc.alloc<NodeStmtBlock>();
-            while (true)
-            {
-                if (!peek().has_value())
-                {
-                    LLOG(RED_TEXT("Unterminated block\n"));
-                    exit(EXIT_FAILURE);
-                }
-                if (peek()->type == TokenType::close_curly)
-                {
-                    consume();
-                    break;
-                }
-                if (auto inner = parse_stmt())
-                    block->stmts.push_back(inner.value());
-                else
-                {
-                    LLOG(RED_TEXT("Invalid statement inside block\n"));
-                    exit(EXIT_FAILURE);
-                }
-            }
+            auto block = parse_block();
             auto stmt = m_alloc.alloc<NodeStmt>();
             stmt->var = block;
+            stmt->offset = start;
             return stmt;
         }
         else
@@ -216,18 +376,149 @@ public:
         NodeProg prog;
         while (peek().has_value())
         {
-            if (auto stmt = parse_stmt())
+            if (peek()->type == TokenType::fn)
+                prog.stmts.push_back(parse_fn());
+            else if (auto stmt = parse_stmt())
                 prog.stmts.push_back(stmt.value());
             else
             {
-                LLOG(RED_TEXT("Invalid Statement\n"));
-                exit(EXIT_FAILURE);
+                throw error("Invalid Statement");
             }
         }
         return prog;
     }
 
 private:
+    // Builds a node with `make`, or with hash-consing on, returns the one
+    // built before for the same `kind`, children and leaf text.
+    template <typename T, typename Make>
+    T *shared(char kind, const void *lhs, const void *rhs, const std::string &text, Make &&make)
+    {
+        if (!m_hash_cons)
+            return make();
+        return m_hash_cons->intern<T>({kind, lhs, rhs, text}, make);
+    }
+
+    template <typename T>
+    T *bin_node(NodeExpr *lhs, NodeExpr *rhs)
+    {
+        auto node = m_alloc.alloc<T>();
+        node->lhs = lhs;
+        node->rhs = rhs;
+        return node;
+    }
+
+    // fn name(a, b) { ... }
+    NodeStmt *parse_fn()
+    {
+        u32 start = consume().offset;
+        auto stmt_fn = m_alloc.alloc<NodeStmtFn>();
+        stmt_fn->ident = try_consume(TokenType::ident, "Expected function name after fn");
+        try_consume(TokenType::open_paren, "Expected '(' after function name");
+        if (!try_consume(TokenType::close_paren))
+        {
+            do
+            {
+                Token param = try_consume(TokenType::ident, "Expected parameter name");
+                for (const Token &other : stmt_fn->params)
+                {
+                    if (other.value == param.value)
+                        throw CompileError("Duplicate parameter name: " + param.value.value(), param.offset);
+                }
+                stmt_fn->params.push_back(param);
+            } while (try_consume(TokenType::comma));
+            try_consume(TokenType::close_paren, "Expected ')' after parameters");
+        }
+        try_consume(TokenType::open_curly, "Expected '{' before function body");
+        stmt_fn->body = parse_block();
+        auto stmt = m_alloc.alloc<NodeStmt>();
+        stmt->var = stmt_fn;
+        stmt->offset = start;
+        return stmt;
+    }
+
+    // The statements of a block whose `{` has been consumed, up to and including `}`.
+    NodeStmtBlock *parse_block()
+    {
+        auto block = m_alloc.alloc<NodeStmtBlock>();
+        while (true)
+        {
+            if (!peek().has_value())
+            {
+                throw error("Unterminated block");
+            }
+            if (peek()->type == TokenType::close_curly)
+            {
+                consume();
+                break;
+            }
+            if (auto inner = parse_stmt())
+                block->stmts.push_back(inner.value());
+            else
+            {
+                throw error("Invalid statement inside block");
+            }
+        }
+        return block;
+    }
+
+    // An error at the next token, or at the end of the last one when the
+    // tokens have run out.
+    [[nodiscard]] CompileError error(const std::string &msg) const
+    {
+        if (m_idx < m_tokens.size())
+            return CompileError(msg, m_tokens[m_idx].offset);
+        if (m_tokens.empty())
+            return CompileError(msg);
+        return CompileError(msg, token_end(m_tokens.back()));
+    }
+
+    // Bytes of the integer type `type` names: i8, i16, i32 or i64.
+    [[nodiscard]] static u8 type_size(const Token &type)
+    {
+        const std::string &name = type.value.value();
+        if (name == "i8")
+            return 1;
+        if (name == "i16")
+            return 2;
+        if (name == "i32")
+            return 4;
+        if (name == "i64")
+            return 8;
+        throw CompileError("Unknown type: " + name, type.offset);
+    }
+
+    // A token that is missing belongs right after the one before it.
+    [[nodiscard]] CompileError missing(const std::string &msg) const
+    {
+        if (m_idx == 0 || m_idx > m_tokens.size())
+            return error(msg);
+        return CompileError(msg, token_end(m_tokens[m_idx - 1]));
+    }
+
+    static u32 token_end(const Token &token)
+    {
+        if (token.value.has_value())
+            return token.offset + static_cast<u32>(token.value->size());
+        switch (token.type)
+        {
+        case TokenType::fn:
+            return token.offset + 2;
+        case TokenType::val:
+        case TokenType::var:
+        case TokenType::out:
+            return token.offset + 3;
+        case TokenType::exit:
+            return token.offset + 4;
+        case TokenType::_while:
+            return token.offset + 5;
+        case TokenType::_return:
+            return token.offset + 6;
+        default:
+            return token.offset + 1;
+        }
+    }
+
     [[nodiscard]] inline std::optional<Token> peek(int offset = 0) const
     {
         if (m_idx + offset >= m_tokens.size())
@@ -244,8 +535,7 @@ private:
     {
         if (peek().has_value() && peek().value().type == type)
             return consume();
-        LLOG(RED_TEXT(err_msg), "\n");
-        exit(EXIT_FAILURE);
+        throw missing(err_msg);
     }
 
     inline std::optional<Token> try_consume(TokenType type)
@@ -255,7 +545,8 @@ private:
         return {};
     }
 
-    const std::vector<Token> m_tokens;
+    const std::vector<Token> &m_tokens;
     size_t m_idx = 0;
-    ArenaAlloc m_alloc;
+    ArenaAlloc &m_alloc;
+    HashCons *m_hash_cons;
 };
\ No newline at end of file
@@ -0,0 +1,560 @@
+#pragma once
+#include <chrono>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "core/defines.h"
+#include "core/arena.hpp"
+#include "core/error.hpp"
+#include "core/nodes.hpp"
+#include "core/stats.hpp"
+#include "evaluator.hpp"
+
+// The optimization passes, in the order they run. AST passes rewrite the
+// parsed program before code is generated. Code generation passes are choices
+// the generator makes while it emits a statement, since its stack-machine
+// code is the only IR there is. Program passes work on the program as a whole.
+enum class Pass
+{
+    FOLD,
+    HOIST,
+    LOOP_REGS,
+    INLINE,
+    CSE,
+    SIMD,
+    TOS_CACHE,
+    EVALUATE,
+    COUNT
+};
+
+static constexpr size_t PASS_COUNT = static_cast<size_t>(Pass::COUNT);
+
+enum class PassKind
+{
+    AST,
+    CODEGEN,
+    PROGRAM
+};
+
+struct PassInfo
+{
+    const char *name;
+    PassKind kind;
+    int level;       // the lowest -O level that runs it
+    bool linux_only; // the Windows backend computes in 32 bits and has no runtime to cache or precompute
+    bool timed;      // false if its work is spread over every push and pop
+    const char *unit; // what its change count counts
+};
+
+static const PassInfo PASSES[PASS_COUNT] = {
+    {"fold", PassKind::AST, 2, true, true, "operators folded"},
+    {"hoist", PassKind::CODEGEN, 1, false, true, "expressions hoisted"},
+    {"loop-regs", PassKind::CODEGEN, 1, false, true, "values kept in registers"},
+    {"inline", PassKind::CODEGEN, 1, false, true, "calls inlined"},
+    {"cse", PassKind::CODEGEN, 1, false, true, "operators removed"},
+    {"simd", PassKind::CODEGEN, 1, false, true, "loops vectorized"},
+    {"tos-cache", PassKind::CODEGEN, 2, true, false, "pops from registers"},
+    {"evaluate", PassKind::PROGRAM, 3, true, true, "programs precomputed"},
+};
+
+inline const PassInfo &pass_info(Pass pass)
+{
+    return PASSES[static_cast<size_t>(pass)];
+}
+
+inline bool pass_supported(Pass pass)
+{
+#if defined(IPLATFORM_WINDOWS)
+    return !pass_info(pass).linux_only;
+#else
+    (void)pass;
+    return true;
+#endif
+}
+
+// A set of passes; they always run in Pass order, whatever order they were
+// named in.
+class PassSet
+{
+public:
+    inline PassSet() = default;
+
+    // What -O<level> runs: nothing at -O0; hoisting, loop registers, the
+    // inliner, value numbering and vector loops at -O1; constant folding and
+    // the cached stack top on top of that at -O2; and running the program at
+    // -O3.
+    [[nodiscard]] static PassSet level(int level)
+    {
+        PassSet set;
+        for (size_t i = 0; i < PASS_COUNT; i++)
+        {
+            Pass pass = static_cast<Pass>(i);
+            if (PASSES[i].level <= level && pass_supported(pass))
+                set.add(pass);
+        }
+        return set;
+    }
+
+    // --passes=a,b,c. Throws CompileError on an unknown name.
+    [[nodiscard]] static PassSet parse(std::string_view list)
+    {
+        PassSet set;
+        while (!list.empty())
+        {
+            size_t comma = list.find(',');
+            std::string_view name = list.substr(0, comma);
+            list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+            if (name.empty())
+                continue;
+            std::optional<Pass> pass = find(name);
+            if (!pass)
+                throw CompileError("Unknown pass: " + std::string(name) + " (passes are " + PassSet::all().str() + ")");
+            if (!pass_supported(*pass))
+                throw CompileError("Pass " + std::string(name) + " is not supported on Windows yet");
+            set.add(*pass);
+        }
+        return set;
+    }
+
+    [[nodiscard]] static PassSet all()
+    {
+        PassSet set;
+        set.m_bits = (1u << PASS_COUNT) - 1;
+        return set;
+    }
+
+    [[nodiscard]] bool has(Pass pass) const
+    {
+        return m_bits & bit(pass);
+    }
+
+    inline void add(Pass pass)
+    {
+        m_bits |= bit(pass);
+    }
+
+    inline void remove(Pass pass)
+    {
+        m_bits &= ~bit(pass);
+    }
+
+    [[nodiscard]] bool has_kind(PassKind kind) const
+    {
+        for (size_t i = 0; i < PASS_COUNT; i++)
+        {
+            if (has(static_cast<Pass>(i)) && PASSES[i].kind == kind)
+                return true;
+        }
+        return false;
+    }
+
+    // The names, comma-separated, in the order the passes run.
+    [[nodiscard]] std::string str() const
+    {
+        std::string out;
+        for (size_t i = 0; i < PASS_COUNT; i++)
+        {
+            if (!has(static_cast<Pass>(i)))
+                continue;
+            out += out.empty() ? "" : ",";
+            out += PASSES[i].name;
+        }
+        return out;
+    }
+
+private:
+    static std::optional<Pass> find(std::string_view name)
+    {
+        for (size_t i = 0; i < PASS_COUNT; i++)
+        {
+            if (name == PASSES[i].name)
+                return static_cast<Pass>(i);
+        }
+        return {};
+    }
+
+    static u32 bit(Pass pass)
+    {
+        return 1u << static_cast<u32>(pass);
+    }
+
+    u32 m_bits = 0;
+};
+
+// A number per pass: its changes, or its time in nanoseconds.
+struct PassCounts
+{
+    i64 values[PASS_COUNT] = {};
+
+    inline i64 &operator[](Pass pass)
+    {
+        return values[static_cast<size_t>(pass)];
+    }
+
+    inline i64 operator[](Pass pass) const
+    {
+        return values[static_cast<size_t>(pass)];
+    }
+
+    inline PassCounts &operator+=(const PassCounts &other)
+    {
+        for (size_t i = 0; i < PASS_COUNT; i++)
+            values[i] += other.values[i];
+        return *this;
+    }
+
+    inline PassCounts operator-(const PassCounts &other) const
+    {
+        PassCounts out = *this;
+        for (size_t i = 0; i < PASS_COUNT; i++)
+            out.values[i] -= other.values[i];
+        return out;
+    }
+};
+
+// Constant folding. An operator whose operands are literals becomes the
+// literal of its value, computed as the generated code would compute it
+// (Evaluator::binary()); one that would trap is left to trap at run time,
+// and so is an index: a literal index is bounds-checked at compile time, so
+// folding one could turn a run-time error into a compile error. The result
+// of a negative value is a literal with a leading '-', which only this pass
+// writes.
+//
+// Folded expressions are new nodes and the parents are pointed at them. In a
+// hash-consed AST every node is folded once and the result remembered, so the
+// nodes shared with statements the generator may already be working on (the
+// pipeline folds batch k+1 while batch k is generated) are never written again.
+class ConstantFolder
+{
+public:
+    inline ConstantFolder(ArenaAlloc &alloc, bool shared_nodes) : m_alloc(alloc), m_shared_nodes(shared_nodes)
+    {
+    }
+
+    void fold(NodeStmt *stmt)
+    {
+        if (auto exit = std::get_if<NodeStmtExit *>(&stmt->var))
+            (*exit)->expr = fold((*exit)->expr);
+        else if (auto let = std::get_if<NodeStmtLet *>(&stmt->var))
+            (*let)->expr = fold((*let)->expr);
+        else if (auto print = std::get_if<NodeStmtOut *>(&stmt->var))
+            (*print)->expr = fold((*print)->expr);
+        else if (auto assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+            (*assign)->expr = fold((*assign)->expr);
+        else if (auto ret = std::get_if<NodeStmtReturn *>(&stmt->var))
+            (*ret)->expr = fold((*ret)->expr);
+        else if (auto expr_stmt = std::get_if<NodeStmtExpr *>(&stmt->var))
+            (*expr_stmt)->expr = fold((*expr_stmt)->expr);
+        else if (auto array = std::get_if<NodeStmtArray *>(&stmt->var))
+        {
+            if ((*array)->init)
+                (*array)->init = fold((*array)->init);
+        }
+        else if (auto element = std::get_if<NodeStmtIndexAssign *>(&stmt->var))
+        {
+            fold_operands((*element)->index);
+            (*element)->expr = fold((*element)->expr);
+        }
+        else if (auto block = std::get_if<NodeStmtBlock *>(&stmt->var))
+            fold_block(*block);
+        else if (auto loop = std::get_if<NodeStmtWhile *>(&stmt->var))
+        {
+            (*loop)->cond = fold((*loop)->cond);
+            fold_block((*loop)->body);
+        }
+        else if (auto fn = std::get_if<NodeStmtFn *>(&stmt->var))
+            fold_block((*fn)->body);
+    }
+
+    [[nodiscard]] u64 folded() const
+    {
+        return m_folded;
+    }
+
+private:
+    void fold_block(NodeStmtBlock *block)
+    {
+        for (NodeStmt *stmt : block->stmts)
+            fold(stmt);
+    }
+
+    // `expr` with its operands folded and, if they are literals now, itself
+    // folded into a new node.
+    NodeExpr *fold(NodeExpr *expr)
+    {
+        if (m_shared_nodes)
+        {
+            auto done = m_result.find(expr);
+            if (done != m_result.end())
+                return done->second;
+        }
+        fold_operands(expr);
+        NodeExpr *result = expr;
+        if (NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            // A literal in parentheses is just the literal.
+            if (NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+            {
+                if (value((*paren)->expr))
+                    result = (*paren)->expr;
+            }
+        }
+        else
+        {
+            const NodeBinExpr *bin = std::get<NodeBinExpr *>(expr->var);
+            std::optional<i64> lhs = std::visit([&](const auto *op)
+                                                { return value(op->lhs); }, bin->var);
+            std::optional<i64> rhs = std::visit([&](const auto *op)
+                                                { return value(op->rhs); }, bin->var);
+            std::optional<i64> folded = lhs && rhs ? Evaluator::binary(bin, *lhs, *rhs) : std::nullopt;
+            if (folded)
+            {
+                result = literal(*folded, expr->offset);
+                m_folded++;
+            }
+        }
+        if (m_shared_nodes)
+            m_result[expr] = result;
+        return result;
+    }
+
+    // Folds what `expr` is made of, but not `expr` itself.
+    void fold_operands(NodeExpr *expr)
+    {
+        if (m_shared_nodes && !m_visited.insert(expr).second)
+            return;
+        if (NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                (*paren)->expr = fold((*paren)->expr);
+            else if (NodeTermCall *const *call = std::get_if<NodeTermCall *>(&(*term)->var))
+            {
+                for (NodeExpr *&arg : (*call)->args)
+                    arg = fold(arg);
+            }
+            else if (NodeTermIndex *const *index = std::get_if<NodeTermIndex *>(&(*term)->var))
+                fold_operands((*index)->index);
+            return;
+        }
+        std::visit([&](auto *op)
+                   {
+            op->lhs = fold(op->lhs);
+            op->rhs = fold(op->rhs); },
+                   std::get<NodeBinExpr *>(expr->var)->var);
+    }
+
+    // The value of a literal, or of nothing else.
+    static std::optional<i64> value(const NodeExpr *expr)
+    {
+        const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var);
+        const NodeTermIntLit *const *lit = term ? std::get_if<NodeTermIntLit *>(&(*term)->var) : nullptr;
+        if (!lit)
+            return {};
+        return Evaluator::literal((*lit)->int_lit.value.value());
+    }
+
+    NodeExpr *literal(i64 value, u32 offset)
+    {
+        auto lit = m_alloc.alloc<NodeTermIntLit>();
+        lit->int_lit = {.type = TokenType::_int_lit, .offset = offset, .value = std::to_string(value)};
+        auto term = m_alloc.alloc<NodeTerm>();
+        term->var = lit;
+        term->offset = offset;
+        auto expr = m_alloc.alloc<NodeExpr>();
+        expr->var = term;
+        expr->offset = offset;
+        return expr;
+    }
+
+    ArenaAlloc &m_alloc;
+    const bool m_shared_nodes;
+    std::unordered_map<const NodeExpr *, NodeExpr *> m_result; // with shared nodes: what each expression folded to
+    std::unordered_set<const NodeExpr *> m_visited;             // ...and the ones whose operands are folded
+    u64 m_folded = 0;
+};
+
+// --verify-each on the AST: every node a statement refers to exists, every
+// literal has a value and every sized binding a size there is a type for.
+// Throws CompileError naming the pass that broke it.
+class AstVerifier
+{
+public:
+    inline explicit AstVerifier(const char *pass) : m_pass(pass)
+    {
+    }
+
+    void verify(const NodeStmt *stmt)
+    {
+        if (!stmt)
+            fail("a missing statement", 0);
+        if (auto exit = std::get_if<NodeStmtExit *>(&stmt->var))
+            verify((*exit)->expr, stmt->offset);
+        else if (auto let = std::get_if<NodeStmtLet *>(&stmt->var))
+        {
+            u8 size = (*let)->size;
+            if (size != 1 && size != 2 && size != 4 && size != 8)
+                fail("a binding of " + std::to_string(size) + " bytes", stmt->offset);
+            verify((*let)->expr, stmt->offset);
+        }
+        else if (auto print = std::get_if<NodeStmtOut *>(&stmt->var))
+            verify((*print)->expr, stmt->offset);
+        else if (auto assign = std::get_if<NodeStmtAssign *>(&stmt->var))
+            verify((*assign)->expr, stmt->offset);
+        else if (auto ret = std::get_if<NodeStmtReturn *>(&stmt->var))
+            verify((*ret)->expr, stmt->offset);
+        else if (auto expr_stmt = std::get_if<NodeStmtExpr *>(&stmt->var))
+            verify((*expr_stmt)->expr, stmt->offset);
+        else if (auto array = std::get_if<NodeStmtArray *>(&stmt->var))
+        {
+            if ((*array)->init)
+                verify((*array)->init, stmt->offset);
+        }
+        else if (auto element = std::get_if<NodeStmtIndexAssign *>(&stmt->var))
+        {
+            verify((*element)->index, stmt->offset);
+            verify((*element)->expr, stmt->offset);
+        }
+        else if (auto block = std::get_if<NodeStmtBlock *>(&stmt->var))
+            verify(*block, stmt->offset);
+        else if (auto loop = std::get_if<NodeStmtWhile *>(&stmt->var))
+        {
+            verify((*loop)->cond, stmt->offset);
+            verify((*loop)->body, stmt->offset);
+        }
+        else if (auto fn = std::get_if<NodeStmtFn *>(&stmt->var))
+            verify((*fn)->body, stmt->offset);
+    }
+
+private:
+    void verify(const NodeStmtBlock *block, u32 offset)
+    {
+        if (!block)
+            fail("a missing block", offset);
+        for (const NodeStmt *stmt : block->stmts)
+            verify(stmt);
+    }
+
+    void verify(const NodeExpr *expr, u32 offset)
+    {
+        if (!expr)
+            fail("a missing expression", offset);
+        if (const NodeTerm *const *term = std::get_if<NodeTerm *>(&expr->var))
+        {
+            if (!*term)
+                fail("a missing term", expr->offset);
+            if (const NodeTermIntLit *const *lit = std::get_if<NodeTermIntLit *>(&(*term)->var))
+            {
+                const std::optional<std::string> &text = (*lit)->int_lit.value;
+                if (!text || !Evaluator::literal(*text))
+                    fail("the literal \"" + text.value_or("") + "\"", expr->offset);
+            }
+            else if (const NodeTermParen *const *paren = std::get_if<NodeTermParen *>(&(*term)->var))
+                verify((*paren)->expr, expr->offset);
+            else if (const NodeTermCall *const *call = std::get_if<NodeTermCall *>(&(*term)->var))
+            {
+                for (const NodeExpr *arg : (*call)->args)
+                    verify(arg, expr->offset);
+            }
+            else if (const NodeTermIndex *const *index = std::get_if<NodeTermIndex *>(&(*term)->var))
+                verify((*index)->index, expr->offset);
+            return;
+        }
+        const NodeBinExpr *bin = std::get<NodeBinExpr *>(expr->var);
+        if (!bin)
+            fail("a missing operator", expr->offset);
+        std::visit([&](const auto *op)
+                   {
+            if (!op)
+                fail("a missing operator", expr->offset);
+            verify(op->lhs, expr->offset);
+            verify(op->rhs, expr->offset); },
+                   bin->var);
+    }
+
+    [[noreturn]] void fail(const std::string &what, u32 offset) const
+    {
+        throw CompileError(std::string("--verify-each: ") + m_pass + " left " + what + " in the AST", offset);
+    }
+
+    const char *m_pass;
+};
+
+// Runs the AST passes of a compile, collects what every pass did and reports
+// it into the compile's stats. The code generation passes are run by the
+// Generator, which is given them as GenOptions, and the program passes by
+// the driver; both hand their numbers in here.
+class PassManager
+{
+public:
+    inline PassManager(PassSet passes, bool verify, ArenaAlloc &alloc, bool shared_nodes)
+        : m_passes(passes), m_verify(verify), m_folder(alloc, shared_nodes)
+    {
+    }
+
+    [[nodiscard]] const PassSet &passes() const
+    {
+        return m_passes;
+    }
+
+    // The AST passes over top-level statements the parser has just built,
+    // which may be a batch of the program.
+    void run_ast(const std::vector<NodeStmt *> &stmts)
+    {
+        if (!m_passes.has(Pass::FOLD))
+            return;
+        auto start = std::chrono::steady_clock::now();
+        for (NodeStmt *stmt : stmts)
+            m_folder.fold(stmt);
+        m_ns[Pass::FOLD] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        m_changes[Pass::FOLD] = static_cast<i64>(m_folder.folded());
+        if (m_verify)
+        {
+            AstVerifier verifier(pass_info(Pass::FOLD).name);
+            for (const NodeStmt *stmt : stmts)
+                verifier.verify(stmt);
+        }
+    }
+
+    // Adds the time and changes of the passes the generator ran.
+    void add_codegen(const PassCounts &ns, const PassCounts &changes)
+    {
+        for (size_t i = 0; i < PASS_COUNT; i++)
+        {
+            if (PASSES[i].kind == PassKind::CODEGEN)
+            {
+                m_ns.values[i] += ns.values[i];
+                m_changes.values[i] += changes.values[i];
+            }
+        }
+    }
+
+    void add(Pass pass, u64 ns, u64 changes)
+    {
+        m_ns[pass] += static_cast<i64>(ns);
+        m_changes[pass] += static_cast<i64>(changes);
+    }
+
+    // One PassStat per pass that ran, as one run over one file.
+    void report(CompileStats &stats) const
+    {
+        for (size_t i = 0; i < PASS_COUNT; i++)
+        {
+            Pass pass = static_cast<Pass>(i);
+            if (!m_passes.has(pass))
+                continue;
+            u64 changes = m_changes[pass] > 0 ? static_cast<u64>(m_changes[pass]) : 0;
+            stats.add_pass({PASSES[i].name, PASSES[i].unit, PASSES[i].timed, static_cast<u64>(m_ns[pass]), 1,
+                            changes > 0, changes});
+        }
+    }
+
+private:
+    const PassSet m_passes;
+    const bool m_verify;
+    ConstantFolder m_folder;
+    PassCounts m_ns;
+    PassCounts m_changes;
+};
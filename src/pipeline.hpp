@@ -0,0 +1,187 @@
+#pragma once
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+#include "core/defines.h"
+#include "core/arena.hpp"
+#include "core/hash_cons.hpp"
+#include "core/spsc_queue.hpp"
+#include "tokenizer.hpp"
+#include "parser.hpp"
+#include "passes.hpp"
+#include "genration.hpp"
+#include "ast_snapshot.hpp"
+
+// Tokenizer, parser and generator on three threads, connected by bounded SPSC
+// queues of top-level statement batches: while batch k is generated, batch
+// k+1 is parsed and batch k+2 tokenized. Batches are cut only between
+// top-level statements, so every statement is parsed and generated exactly as
+// in the serial path and the assembly is byte-identical.
+//
+// Errors are reported in serial order too: a tokenizer error anywhere wins
+// over a parse error, which wins over a generator error. That is why a stage
+// keeps consuming its input after a later stage has failed.
+class Pipeline
+{
+public:
+    static constexpr size_t DEFAULT_BATCH_TOKENS = 4096;
+    static constexpr size_t QUEUE_BATCHES = 8;
+
+    // `hash_cons`, if given, is shared by the parsers of all batches, so
+    // subtrees are shared across batches as they are in the serial path.
+    // `passes`, if given, runs its AST passes on every batch on the parser
+    // thread and is handed the generator's pass numbers at the end.
+    // `writer`, if given, gets every batch as parsed, before the passes.
+    inline Pipeline(const std::string &src, ArenaAlloc &alloc, GenOptions gen_opts = {},
+                    size_t batch_tokens = DEFAULT_BATCH_TOKENS, HashCons *hash_cons = nullptr,
+                    PassManager *passes = nullptr, AstWriter *writer = nullptr)
+        : m_src(src), m_alloc(alloc), m_gen_opts(gen_opts), m_batch_tokens(batch_tokens), m_hash_cons(hash_cons),
+          m_passes(passes), m_writer(writer)
+    {
+    }
+
+    // Returns the assembly, or throws what the serial path would have thrown.
+    [[nodiscard]] AsmBuffer run()
+    {
+        SpscQueue<TokenBatch> token_queue(QUEUE_BATCHES);
+        SpscQueue<StmtBatch> stmt_queue(QUEUE_BATCHES);
+        std::exception_ptr lex_err, parse_err, gen_err;
+
+        std::thread lexer([&]
+                          { lex(token_queue, lex_err); });
+        std::thread parser([&]
+                           { parse(token_queue, stmt_queue, parse_err); });
+        AsmBuffer assembly = generate(stmt_queue, gen_err);
+        lexer.join();
+        parser.join();
+
+        for (const std::exception_ptr &err : {lex_err, parse_err, gen_err})
+            if (err)
+                std::rethrow_exception(err);
+        return assembly;
+    }
+
+    [[nodiscard]] size_t tokens() const
+    {
+        return m_tokens;
+    }
+
+    [[nodiscard]] u64 ops_removed() const
+    {
+        return m_ops_removed;
+    }
+
+    // Every top-level statement, in order, once run() has returned.
+    [[nodiscard]] const std::vector<NodeStmt *> &stmts() const
+    {
+        return m_stmts;
+    }
+
+private:
+    struct TokenBatch
+    {
+        std::vector<Token> tokens;
+        bool last = false;
+    };
+
+    struct StmtBatch
+    {
+        std::vector<NodeStmt *> stmts;
+        bool last = false;
+    };
+
+    void lex(SpscQueue<TokenBatch> &out, std::exception_ptr &err)
+    {
+        Tokenizer tokenizer(m_src);
+        bool more = true;
+        while (more)
+        {
+            TokenBatch batch;
+            try
+            {
+                more = tokenizer.tokenize_batch(batch.tokens, m_batch_tokens);
+            }
+            catch (...)
+            {
+                err = std::current_exception();
+                more = false;
+            }
+            m_tokens += batch.tokens.size();
+            batch.last = !more;
+            out.push(std::move(batch));
+        }
+    }
+
+    // The only thread allocating from the arena, or using the hash-cons
+    // table, the AST passes or the snapshot writer, while the pipeline runs.
+    void parse(SpscQueue<TokenBatch> &in, SpscQueue<StmtBatch> &out, std::exception_ptr &err)
+    {
+        bool last = false;
+        while (!last)
+        {
+            TokenBatch tokens = in.pop();
+            StmtBatch batch;
+            batch.last = last = tokens.last;
+            if (!err)
+            {
+                try
+                {
+                    Parser parser(tokens.tokens, m_alloc, m_hash_cons);
+                    batch.stmts = std::move(parser.parse_prog().value().stmts);
+                    if (m_writer)
+                        m_writer->add(batch.stmts);
+                    if (m_passes)
+                        m_passes->run_ast(batch.stmts);
+                }
+                catch (...)
+                {
+                    err = std::current_exception();
+                }
+            }
+            out.push(std::move(batch));
+        }
+    }
+
+    AsmBuffer generate(SpscQueue<StmtBatch> &in, std::exception_ptr &err)
+    {
+        Generator generator(NodeProg{}, m_gen_opts);
+        generator.begin();
+        bool last = false;
+        while (!last)
+        {
+            StmtBatch batch = in.pop();
+            last = batch.last;
+            if (err)
+                continue;
+            try
+            {
+                for (const NodeStmt *stmt : batch.stmts)
+                    generator.gen_stmt(stmt);
+                m_stmts.insert(m_stmts.end(), batch.stmts.begin(), batch.stmts.end());
+            }
+            catch (...)
+            {
+                err = std::current_exception();
+            }
+        }
+        if (err)
+            return AsmBuffer();
+        AsmBuffer assembly = generator.finish();
+        m_ops_removed = generator.ops_removed();
+        if (m_passes)
+            m_passes->add_codegen(generator.pass_time(), generator.pass_changes());
+        return assembly;
+    }
+
+    const std::string &m_src;
+    ArenaAlloc &m_alloc;
+    const GenOptions m_gen_opts;
+    const size_t m_batch_tokens;
+    HashCons *const m_hash_cons;
+    PassManager *const m_passes;
+    AstWriter *const m_writer;
+    size_t m_tokens = 0;
+    u64 m_ops_removed = 0;
+    std::vector<NodeStmt *> m_stmts;
+};
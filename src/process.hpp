@@ -0,0 +1,262 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "core/asm_buffer.hpp"
+#include "core/defines.h"
+#include "core/error.hpp"
+
+#if defined(IPLATFORM_LINUX)
+#include <cerrno>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+
+// How a child process ended and what it cost, taken from wait4 so the numbers
+// belong to that child alone and not to every child the compiler has reaped.
+struct ProcessResult
+{
+    bool exited = false; // false when killed by a signal
+    int exit_code = 0;
+    int signal = 0;
+    u64 wall_ns = 0;
+    u64 user_ns = 0;
+    u64 sys_ns = 0;
+    u64 max_rss_kib = 0;
+};
+
+// A file name that no other compile, in this process or another, will pick.
+inline std::string unique_path(const std::string &prefix, const std::string &suffix)
+{
+    static std::atomic<u64> counter{0};
+#if defined(IPLATFORM_LINUX)
+    u64 pid = static_cast<u64>(getpid());
+#else
+    u64 pid = 0;
+#endif
+    return prefix + ".tmp." + std::to_string(pid) + "." + std::to_string(counter++) + suffix;
+}
+
+inline std::string temp_path(const std::string &suffix)
+{
+    std::error_code ec;
+    std::filesystem::path dir = std::filesystem::temp_directory_path(ec);
+    if (ec)
+        dir = ".";
+    return unique_path((dir / "yz").string(), suffix);
+}
+
+// Removes the file when it goes out of scope, whether or not it was created.
+class TempFile
+{
+public:
+    inline explicit TempFile(std::string path)
+        : m_path(std::move(path))
+    {
+    }
+
+    inline TempFile(const TempFile &other) = delete;
+
+    inline TempFile operator=(const TempFile &other) = delete;
+
+    inline ~TempFile()
+    {
+        std::error_code ec;
+        std::filesystem::remove(m_path, ec);
+    }
+
+    [[nodiscard]] const std::string &path() const
+    {
+        return m_path;
+    }
+
+private:
+    std::string m_path;
+};
+
+// An anonymous in-memory file holding `contents`. A child started with it
+// reads it as /dev/fd/3, so the bytes never touch the file system.
+class MemFile
+{
+public:
+    static constexpr int CHILD_FD = 3;
+
+    inline MemFile(const char *name, const AsmBuffer &contents)
+    {
+#if defined(IPLATFORM_LINUX)
+        m_fd = memfd_create(name, MFD_CLOEXEC);
+        if (m_fd < 0)
+            throw CompileError(std::string("memfd_create failed: ") + strerror(errno));
+        if (!contents.write_to(m_fd))
+        {
+            int err = errno;
+            close(m_fd);
+            throw CompileError(std::string("Could not write memfd: ") + strerror(err));
+        }
+#elif defined(IPLATFORM_WINDOWS)
+        (void)name;
+        (void)contents;
+        throw CompileError("memfd is only supported on Linux");
+#endif
+    }
+
+    inline MemFile(const MemFile &other) = delete;
+
+    inline MemFile operator=(const MemFile &other) = delete;
+
+    inline ~MemFile()
+    {
+#if defined(IPLATFORM_LINUX)
+        if (m_fd >= 0)
+            close(m_fd);
+#endif
+    }
+
+    [[nodiscard]] int fd() const
+    {
+        return m_fd;
+    }
+
+    // The name the child sees the file under.
+    [[nodiscard]] static std::string child_path()
+    {
+        return "/dev/fd/" + std::to_string(CHILD_FD);
+    }
+
+private:
+    int m_fd = -1;
+};
+
+inline std::string command_line(const std::vector<std::string> &argv)
+{
+    std::string out;
+    for (const std::string &arg : argv)
+        out += (out.empty() ? "" : " ") + arg;
+    return out;
+}
+
+// A program started with posix_spawnp, without a shell in between. `argv[0]`
+// is looked up in PATH. If `input_fd` is given the child gets it as fd 3.
+class ChildProcess
+{
+public:
+    inline explicit ChildProcess(const std::vector<std::string> &argv, int input_fd = -1)
+        : m_name(argv.at(0)), m_command(command_line(argv)), m_start(std::chrono::steady_clock::now())
+    {
+#if defined(IPLATFORM_LINUX)
+        std::vector<char *> args;
+        for (const std::string &arg : argv)
+            args.push_back(const_cast<char *>(arg.c_str()));
+        args.push_back(nullptr);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (input_fd >= 0)
+            posix_spawn_file_actions_adddup2(&actions, input_fd, MemFile::CHILD_FD);
+        int err = posix_spawnp(&m_pid, args[0], &actions, nullptr, args.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        if (err != 0)
+            throw CompileError("Could not run " + argv[0] + ": " + strerror(err));
+#elif defined(IPLATFORM_WINDOWS)
+        (void)input_fd;
+        // cmd strips the outer quotes of a line that starts with one, so the
+        // program name is only quoted when it is all there is.
+        std::string line = argv.size() == 1 ? "\"" + argv[0] + "\"" : argv[0];
+        for (size_t i = 1; i < argv.size(); i++)
+            line += " \"" + argv[i] + "\"";
+        m_status = system(line.c_str());
+#endif
+    }
+
+    inline ChildProcess(const ChildProcess &other) = delete;
+
+    inline ChildProcess operator=(const ChildProcess &other) = delete;
+
+    inline ~ChildProcess()
+    {
+        try
+        {
+            wait();
+        }
+        catch (const CompileError &)
+        {
+        }
+    }
+
+    // Waits for the child to end. Only the first call waits.
+    ProcessResult wait()
+    {
+        if (m_waited)
+            return m_result;
+        m_waited = true;
+#if defined(IPLATFORM_LINUX)
+        int status = 0;
+        rusage usage{};
+        while (wait4(m_pid, &status, 0, &usage) < 0)
+        {
+            if (errno != EINTR)
+                throw CompileError("wait4 failed for " + m_command + ": " + strerror(errno));
+        }
+        m_result.exited = WIFEXITED(status);
+        m_result.exit_code = m_result.exited ? WEXITSTATUS(status) : 0;
+        m_result.signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+        m_result.user_ns = static_cast<u64>(usage.ru_utime.tv_sec) * 1000000000ull +
+                           static_cast<u64>(usage.ru_utime.tv_usec) * 1000ull;
+        m_result.sys_ns = static_cast<u64>(usage.ru_stime.tv_sec) * 1000000000ull +
+                          static_cast<u64>(usage.ru_stime.tv_usec) * 1000ull;
+        m_result.max_rss_kib = static_cast<u64>(usage.ru_maxrss);
+#elif defined(IPLATFORM_WINDOWS)
+        m_result.exited = true;
+        m_result.exit_code = m_status;
+#endif
+        auto elapsed = std::chrono::steady_clock::now() - m_start;
+        m_result.wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        return m_result;
+    }
+
+    [[nodiscard]] const std::string &name() const
+    {
+        return m_name;
+    }
+
+    [[nodiscard]] const std::string &command() const
+    {
+        return m_command;
+    }
+
+private:
+    std::string m_name;
+    std::string m_command;
+    std::chrono::steady_clock::time_point m_start;
+    ProcessResult m_result;
+    bool m_waited = false;
+#if defined(IPLATFORM_LINUX)
+    pid_t m_pid = -1;
+#elif defined(IPLATFORM_WINDOWS)
+    int m_status = 0;
+#endif
+};
+
+// Waits for a tool and throws CompileError unless it exited with 0.
+inline ProcessResult finish_tool(ChildProcess &child)
+{
+    ProcessResult result = child.wait();
+    if (!result.exited || result.exit_code != 0)
+        throw CompileError(child.name() + " failed: " + child.command());
+    return result;
+}
+
+inline ProcessResult run_tool(const std::vector<std::string> &argv, int input_fd = -1)
+{
+    ChildProcess child(argv, input_fd);
+    return finish_tool(child);
+}
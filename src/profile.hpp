@@ -0,0 +1,122 @@
+#pragma once
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "core/defines.h"
+#include "core/error.hpp"
+#include "core/hash.hpp"
+#include "core/source_map.hpp"
+
+// How often the statement starting at `offset` ran.
+struct ProfileSite
+{
+    u32 offset;
+    u64 count;
+};
+
+struct Profile
+{
+    u64 source_hash = 0;
+    std::vector<ProfileSite> sites; // one per statement, by offset
+};
+
+// Reads the file a program compiled with --profile writes at exit (the layout
+// is in Generator::gen_profile_runtime). Statements that share a counter get
+// its count each. Copies of one statement made by the inliner have a site each
+// and are merged here.
+inline Profile read_profile(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open())
+        throw CompileError("Could not open file: " + path);
+
+    char magic[8];
+    u64 sites = 0;
+    u64 counters = 0;
+    Profile profile;
+    in.read(magic, sizeof(magic));
+    in.read(reinterpret_cast<char *>(&profile.source_hash), sizeof(u64));
+    in.read(reinterpret_cast<char *>(&sites), sizeof(u64));
+    in.read(reinterpret_cast<char *>(&counters), sizeof(u64));
+    if (!in || memcmp(magic, "YZPROF1", 8) != 0)
+        throw CompileError("Not a profile: " + path);
+
+    // The counts come from the header, so they are checked against what is
+    // left of the file before anything is allocated for them.
+    std::streamoff header = in.tellg();
+    in.seekg(0, std::ios::end);
+    u64 left = static_cast<u64>(in.tellg() - header);
+    in.seekg(header);
+    if (sites > left / (2 * sizeof(u32)) || counters > (left - sites * 2 * sizeof(u32)) / sizeof(u64))
+        throw CompileError("Truncated profile: " + path);
+
+    std::vector<u32> records(sites * 2); // offset, counter
+    std::vector<u64> counts(counters);
+    in.read(reinterpret_cast<char *>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(u32)));
+    in.read(reinterpret_cast<char *>(counts.data()), static_cast<std::streamsize>(counts.size() * sizeof(u64)));
+    if (!in)
+        throw CompileError("Truncated profile: " + path);
+
+    for (size_t i = 0; i < sites; i++)
+    {
+        if (records[i * 2 + 1] >= counters)
+            throw CompileError("Corrupt profile: " + path);
+        profile.sites.push_back({records[i * 2], counts[records[i * 2 + 1]]});
+    }
+    std::sort(profile.sites.begin(), profile.sites.end(), [](const ProfileSite &a, const ProfileSite &b)
+              { return a.offset < b.offset; });
+    size_t merged = 0;
+    for (const ProfileSite &site : profile.sites)
+    {
+        if (merged && profile.sites[merged - 1].offset == site.offset)
+            profile.sites[merged - 1].count += site.count;
+        else
+            profile.sites[merged++] = site;
+    }
+    profile.sites.resize(merged);
+    return profile;
+}
+
+// The `top` most executed statements of `source`, with their share of all
+// statement executions and the line they start on.
+inline std::string profile_report(const std::string &input, const std::string &source, Profile profile, size_t top)
+{
+    if (profile.source_hash != xxh64(source.data(), source.size()))
+        throw CompileError(input + " has changed since it was profiled, compile it with --profile and run it again");
+
+    u64 total = 0;
+    size_t ran = 0;
+    for (const ProfileSite &site : profile.sites)
+    {
+        total += site.count;
+        ran += site.count > 0;
+    }
+    std::stable_sort(profile.sites.begin(), profile.sites.end(), [](const ProfileSite &a, const ProfileSite &b)
+                     { return a.count > b.count; });
+
+    LineMap lines(source);
+    std::string out;
+    char line[256];
+    snprintf(line, sizeof(line), "%llu statement executions, %zu of %zu statements ran\n\n",
+             (unsigned long long)total, ran, profile.sites.size());
+    out += line;
+    snprintf(line, sizeof(line), "%14s %7s  %-10s %s\n", "count", "share", "line:col", "statement");
+    out += line;
+    for (size_t i = 0; i < std::min(top, ran); i++)
+    {
+        const ProfileSite &site = profile.sites[i];
+        SourceLocation loc = lines.locate(site.offset);
+        std::string text = lines.line_text(loc.line);
+        text.erase(0, std::min(text.find_first_not_of(" \t"), text.size()));
+        if (text.size() > 60)
+            text = text.substr(0, 57) + "...";
+        std::string where = std::to_string(loc.line) + ":" + std::to_string(loc.column);
+        snprintf(line, sizeof(line), "%14llu %6.1f%%  %-10s %s\n", (unsigned long long)site.count,
+                 total ? 100.0 * site.count / total : 0.0, where.c_str(), text.c_str());
+        out += line;
+    }
+    return out;
+}
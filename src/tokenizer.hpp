@@ -5,6 +5,7 @@
 #include <cctype>
 #include "core/defines.h"
 #include "core/nodes.hpp"
+#include "core/error.hpp"
 #include "YLogger/logger.h"
 
 class Tokenizer
@@ -14,15 +15,58 @@ public:
     inline explicit Tokenizer(const std::string &src)
         : m_src(src), m_idx(0)
     {
+        if (src.size() >= CompileError::NO_OFFSET)
+            throw CompileError("Source files of 4 GiB or more are not supported");
     }
 
     inline std::vector<Token> tokenize()
     {
         std::vector<Token> tokens;
+        tokenize(tokens);
+        return tokens;
+    }
+
+    // Fills `tokens`, reusing whatever capacity it already has.
+    inline void tokenize(std::vector<Token> &tokens)
+    {
+        tokens.clear();
+        std::string buff;
+        while (next_token(tokens, buff))
+            ;
+
+        m_idx = 0;
+    }
+
+    // Continues where the previous call stopped and fills `tokens` with whole
+    // top-level statements, at least `min_tokens` of them unless the source
+    // runs out first. Returns false once the whole source has been read.
+    inline bool tokenize_batch(std::vector<Token> &tokens, size_t min_tokens)
+    {
+        tokens.clear();
         std::string buff;
+        while (next_token(tokens, buff))
+        {
+            TokenType type = tokens.back().type;
+            if (type == TokenType::open_curly)
+                m_depth++;
+            else if (type == TokenType::close_curly)
+                m_depth--;
+            else if (type != TokenType::semi)
+                continue;
+
+            if (m_depth == 0 && tokens.size() >= min_tokens)
+                return true;
+        }
+        return false;
+    }
 
+private:
+    // Appends the next token to `tokens`; returns false at the end of the source.
+    inline bool next_token(std::vector<Token> &tokens, std::string &buff)
+    {
         while (peek().has_value())
         {
+            u32 start = static_cast<u32>(m_idx);
             if (std::isalpha(peek().value()))
             {
                 buff.push_back(consume());
@@ -35,11 +79,20 @@ public:
                     tokens.push_back({.type = TokenType::val});
                 else if (buff == "out")
                     tokens.push_back({.type = TokenType::out});
+                else if (buff == "var")
+                    tokens.push_back({.type = TokenType::var});
+                else if (buff == "while")
+                    tokens.push_back({.type = TokenType::_while});
+                else if (buff == "fn")
+                    tokens.push_back({.type = TokenType::fn});
+                else if (buff == "return")
+                    tokens.push_back({.type = TokenType::_return});
                 else
                     tokens.push_back({.type = TokenType::ident, .value = buff});
 
+                tokens.back().offset = start;
                 buff.clear();
-                continue;
+                return true;
             }
             if (std::isdigit(peek().value()))
             {
@@ -47,8 +100,9 @@ public:
                 while (peek().has_value() && std::isdigit(peek().value()))
                     buff.push_back(consume());
                 tokens.push_back({.type = TokenType::_int_lit, .value = buff});
+                tokens.back().offset = start;
                 buff.clear();
-                continue;
+                return true;
             }
             if (std::isspace(peek().value()))
             {
@@ -88,17 +142,30 @@ public:
             case '/':
                 tokens.push_back({.type = TokenType::div});
                 break;
+            case '<':
+                tokens.push_back({.type = TokenType::lt});
+                break;
+            case ',':
+                tokens.push_back({.type = TokenType::comma});
+                break;
+            case '[':
+                tokens.push_back({.type = TokenType::open_bracket});
+                break;
+            case ']':
+                tokens.push_back({.type = TokenType::close_bracket});
+                break;
+            case ':':
+                tokens.push_back({.type = TokenType::colon});
+                break;
             default:
-                LLOG(RED_TEXT("Unknown character in source\n"));
-                exit(EXIT_FAILURE);
+                throw CompileError("Unknown character in source", start);
             }
+            tokens.back().offset = start;
+            return true;
         }
-
-        m_idx = 0;
-        return tokens;
+        return false;
     }
 
-private:
     [[nodiscard]] inline std::optional<char> peek(int offset = 0) const
     {
         if (m_idx + offset >= m_src.length())
@@ -112,6 +179,7 @@ private:
         return m_src.at(m_idx++);
     }
 
-    const std::string m_src;
+    const std::string &m_src;
     size_t m_idx = 0;
+    i64 m_depth = 0; // curly nesting, for tokenize_batch
 };
\ No newline at end of file
@@ -0,0 +1,184 @@
+#pragma once
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "core/defines.h"
+#include "core/error.hpp"
+#include "core/stats.hpp"
+#include "YLogger/logger.h"
+#include "driver.hpp"
+
+#if defined(IPLATFORM_LINUX)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Reports writes to a set of files with inotify. The directories are watched
+// rather than the files, because editors often save by writing a new file
+// and renaming it over the old one, which a watch on the file would not see.
+class FileWatcher
+{
+public:
+    inline explicit FileWatcher(const std::vector<std::string> &paths)
+        : m_paths(paths)
+    {
+#if defined(IPLATFORM_LINUX)
+        m_fd = inotify_init1(IN_CLOEXEC);
+        if (m_fd < 0)
+            throw CompileError("inotify_init1 failed");
+        // Spellings of one directory ("./", "", "src/../") get the same
+        // watch descriptor, so each one keeps every input under it and an
+        // event is matched on the file name alone.
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            size_t slash = paths[i].find_last_of('/');
+            std::string dir = slash == std::string::npos ? "." : paths[i].substr(0, slash + 1);
+            int wd = inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (wd < 0)
+                throw CompileError("Could not watch directory: " + dir);
+            m_inputs[wd].push_back({i, slash == std::string::npos ? paths[i] : paths[i].substr(slash + 1)});
+        }
+#elif defined(IPLATFORM_WINDOWS)
+        throw CompileError("--watch is only supported on Linux");
+#endif
+    }
+
+    inline FileWatcher(const FileWatcher &other) = delete;
+
+    inline FileWatcher operator=(const FileWatcher &other) = delete;
+
+    inline ~FileWatcher()
+    {
+#if defined(IPLATFORM_LINUX)
+        if (m_fd >= 0)
+            close(m_fd);
+#endif
+    }
+
+    // Blocks until at least one of the files has been written and returns
+    // the ones that were, in the order they were given. `when` is set to the
+    // time the first event was read.
+    std::vector<std::string> wait(std::chrono::steady_clock::time_point &when)
+    {
+        std::vector<bool> changed(m_paths.size(), false);
+        bool any = false;
+#if defined(IPLATFORM_LINUX)
+        alignas(inotify_event) char buf[16 * 1024];
+        // Events already queued with the first one are taken in the same
+        // round, so one save does not compile twice.
+        for (int timeout = -1;; timeout = any ? 0 : -1)
+        {
+            pollfd pfd{.fd = m_fd, .events = POLLIN, .revents = 0};
+            if (poll(&pfd, 1, timeout) <= 0)
+            {
+                if (any)
+                    break;
+                continue;
+            }
+            ssize_t len = read(m_fd, buf, sizeof(buf));
+            if (len <= 0)
+                continue;
+            if (!any)
+                when = std::chrono::steady_clock::now();
+            for (ssize_t pos = 0; pos < len;)
+            {
+                const inotify_event *event = reinterpret_cast<const inotify_event *>(buf + pos);
+                pos += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+                auto inputs = m_inputs.find(event->wd);
+                if (inputs == m_inputs.end() || event->len == 0)
+                    continue;
+                for (const WatchedInput &input : inputs->second)
+                {
+                    if (input.name == event->name)
+                        changed[input.index] = any = true;
+                }
+            }
+        }
+#endif
+        std::vector<std::string> out;
+        for (size_t i = 0; i < m_paths.size(); i++)
+        {
+            if (changed[i])
+                out.push_back(m_paths[i]);
+        }
+        return out;
+    }
+
+private:
+    struct WatchedInput
+    {
+        size_t index;     // into m_paths
+        std::string name; // file name without the directory
+    };
+
+    std::vector<std::string> m_paths;
+    std::unordered_map<int, std::vector<WatchedInput>> m_inputs; // watch descriptor -> inputs in its directory
+    int m_fd = -1;
+};
+
+// --watch: compiles and runs every input, then compiles and runs a file again
+// each time it is saved. One CompileContext stays resident, so the arena,
+// token and source buffers are allocated once and reused warm. After every
+// run the latency from the save to the program's exit is printed.
+inline int run_watch(const Options &opts, CompileCache *cache)
+{
+    using Clock = std::chrono::steady_clock;
+    CompileContext context(opts, cache);
+    auto rebuild = [&](const std::string &input, Clock::time_point saved)
+    {
+        std::vector<CompileStats> stats(1);
+        OutputPaths paths;
+        try
+        {
+            paths = context.compile(input, stats.back());
+        }
+        catch (const CompileError &err)
+        {
+            report_failure(input, err);
+            LOG_FLUSH();
+            return;
+        }
+        u64 compile_ns = stats.back().total_ns();
+        ProcessResult result;
+        try
+        {
+            result = run_executable(paths.exe_path, stats.back());
+        }
+        catch (const CompileError &err)
+        {
+            report_failure(input, err);
+            LOG_FLUSH();
+            return;
+        }
+        double latency_ms = std::chrono::duration<double, std::milli>(Clock::now() - saved).count();
+        if (result.exited)
+            LLOG(BLUE_TEXT("Exit Code: "), result.exit_code, "\n");
+        char times[96];
+        snprintf(times, sizeof(times), "%.2f ms from save to exit (compile %.2f ms)", latency_ms, compile_ns / 1e6);
+        LLOG(GREEN_TEXT(input), ": ", times, "\n");
+        report_stats(opts, stats);
+        LOG_FLUSH();
+    };
+
+    try
+    {
+        FileWatcher watcher(opts.inputs);
+        for (const std::string &input : opts.inputs)
+            rebuild(input, Clock::now());
+        LLOG(CYAN_TEXT("Watching "), opts.inputs.size(), " file(s), Ctrl-C to stop\n");
+        LOG_FLUSH();
+        while (true)
+        {
+            Clock::time_point saved;
+            for (const std::string &input : watcher.wait(saved))
+                rebuild(input, saved);
+        }
+    }
+    catch (const CompileError &err)
+    {
+        LLOG(RED_TEXT(err.what()), "\n");
+        return EXIT_FAILURE;
+    }
+}
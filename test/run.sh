@@ -0,0 +1,47 @@
+#!/bin/bash
+
+# Compiles every regression program below with bin/yzlang (or $YZ) under
+# each set of flags, runs it and checks its exit code. Linux only, since the
+# programs use functions and arrays. Run from the repository root after
+# ./build.sh.
+
+compiler="${YZ:-./bin/yzlang}"
+
+# program -> expected exit code
+declare -A expected=(
+    # calls inlined into an assignment and into array indices, while the
+    # target variable is held across the call
+    [inline_assign]=20
+    # calls with 7 and 8 arguments, so some are passed on the stack
+    [many_args]=196
+    # whole-array expressions on lengths 5, 7 and 9, which leave a scalar
+    # remainder after the SSE2 and AVX2 loops
+    [simd_tail]=79
+    # i8, i16 and i32 values wrapping around on assignment and in loops
+    [wraparound]=119
+)
+
+flagSets=("-O0" "-O1" "-O2" "-O3" "-O0 --no-inline" "--simd=none" "--simd=sse2" "--simd=avx2" "--tos-cache" "--hash-cons" "--pipeline")
+
+failed=0
+for name in "${!expected[@]}"; do
+    for flags in "${flagSets[@]}"; do
+        if ! $compiler $flags test/$name.yz > /dev/null 2>&1 || [ ! -x test/$name ]; then
+            echo "FAIL $name [$flags]: compilation failed"
+            failed=1
+            continue
+        fi
+        ./test/$name > /dev/null
+        code=$?
+        if [ $code -ne ${expected[$name]} ]; then
+            echo "FAIL $name [$flags]: exit code $code, expected ${expected[$name]}"
+            failed=1
+        fi
+        rm -f test/$name test/$name.s test/$name.o
+    done
+done
+
+if [ $failed -eq 0 ]; then
+    echo "all regression programs passed."
+fi
+exit $failed